@@ -1,6 +1,7 @@
 #include "client_comm.hpp"
 
 #include <cstdlib>
+#include <chrono>
 
 #include "capsule.pb.h"
 #include "request.pb.h"
@@ -51,36 +52,39 @@ ClientComm::ClientComm(std::string ip, int64_t client_id, DCClient *dc_client)
     int pos = ip_count.find(count_delim);
     server_ip_count.push_back(std::make_pair(ip_count.substr(0, pos), std::stoi(ip_count.substr(pos + 1))));
 
-#if OUTGOING_MODE == 1 or OUTGOING_MODE == 2
-    // initialize dc server dc sockets
+    // initialize dc server dc and serve sockets
+    std::vector<std::string> server_names;
     for (auto &p : server_ip_count)
     {
         for (int i = INIT_DC_SERVER_ID; i < p.second + INIT_DC_SERVER_ID; i++)
         {
+            dc_server server;
+            server.name = p.first + ":" + std::to_string(i);
+            server.dc_socket = NULL;
+            server.send_mutex = new std::mutex();
+#if OUTGOING_MODE == 1 or OUTGOING_MODE == 2
             std::string server_addr = p.first + ":" + std::to_string(NET_DC_SERVER_BASE_PORT + i);
-            zmq::socket_t *socket_send_dc = new zmq::socket_t(m_context, ZMQ_PUSH);
-            socket_send_dc->connect("tcp://" + server_addr);
-
-            m_dc_server_dc_sockets.emplace(server_addr, socket_send_dc);
+            server.dc_socket = new zmq::socket_t(m_context, ZMQ_PUSH);
+            server.dc_socket->connect("tcp://" + server_addr);
             Logger::log(LogLevel::LDEBUG, "[DC CLIENT] connected to server for dc: " + server_addr);
-        }
-    }
-    Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Number of server destinations: " + std::to_string(m_dc_server_dc_sockets.size()));
 #endif
 
-    // initialize dc server serve sockets
-    for (auto &p : server_ip_count)
-    {
-        for (int i = INIT_DC_SERVER_ID; i < p.second + INIT_DC_SERVER_ID; i++)
-        {
-            std::string server_addr = p.first + ":" + std::to_string(NET_SERVE_PORT + i);
-            zmq::socket_t *socket_send_dc = new zmq::socket_t(m_context, ZMQ_PUSH);
-            socket_send_dc->connect("tcp://" + server_addr);
+            std::string serve_addr = p.first + ":" + std::to_string(NET_SERVE_PORT + i);
+            server.serve_socket = new zmq::socket_t(m_context, ZMQ_PUSH);
+            server.serve_socket->connect("tcp://" + serve_addr);
+            Logger::log(LogLevel::LDEBUG, "[DC CLIENT] connected to server for serve get: " + serve_addr);
 
-            m_dc_server_serve_sockets.emplace(server_addr, socket_send_dc);
-            Logger::log(LogLevel::LDEBUG, "[DC CLIENT] connected to server for serve get: " + server_addr);
+            m_dc_servers.push_back(server);
+            server_names.push_back(server.name);
         }
     }
+    Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Number of server destinations: " + std::to_string(m_dc_servers.size()));
+
+    // a record needs WRITE_THRESHOLD acks, so it goes to at least that many servers
+    int replicas = NET_REPLICAS;
+    if (replicas > 0 && replicas < WRITE_THRESHOLD)
+        replicas = WRITE_THRESHOLD;
+    m_placement = new Placement(server_names, replicas);
 
 #if OUTGOING_MODE == 3
     // initialize proxy write socket
@@ -91,30 +95,48 @@ ClientComm::ClientComm(std::string ip, int64_t client_id, DCClient *dc_client)
 #endif
 }
 
-void ClientComm::mcast_dc(const std::string &msg) 
+void ClientComm::send_dc(const std::string &hash, const std::string &msg) 
 {
-    for (auto &p : m_dc_server_dc_sockets)
+    send_dc(hash, msg.c_str(), msg.size());
+}
+
+void ClientComm::send_dc(const std::string &hash, const char *buf, size_t len) 
+{
+    std::vector<int> replicas;
+    m_placement->ReplicaSet(hash, &replicas);
+    for (int s : replicas)
     {
-        send_string(msg, p.second);
-        Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Sent dc to server: " + p.first);
+        zmq::message_t msg(buf, len);
+        std::lock_guard<std::mutex> lk(*m_dc_servers[s].send_mutex);
+        m_dc_servers[s].dc_socket->send(msg);
+        Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Sent dc to server: " + m_dc_servers[s].name);
     }
 }
 
 void ClientComm::send_dc_proxy(std::string &msg) 
 {
-    send_string(msg, m_proxy_write_socket);
+    {
+        std::lock_guard<std::mutex> lk(m_proxy_mutex);
+        send_string(msg, m_proxy_write_socket);
+    }
     Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Sent dc to proxy, dc: " + msg);
 }
 
-void ClientComm::send_get_req(std::string &msg) 
+void ClientComm::send_get_req(const std::string &hash, std::string &msg) 
 {
-    auto random_it = std::next(
-        std::begin(m_dc_server_serve_sockets), 
-        rand() % m_dc_server_serve_sockets.size()
-    );
+    int s = rand() % m_dc_servers.size();
+    if (!hash.empty())
+    {
+        std::vector<int> replicas;
+        m_placement->ReplicaSet(hash, &replicas);
+        s = replicas[rand() % replicas.size()];
+    }
 
-    send_string(msg, random_it->second);
-    Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Sent get req to server: " + random_it->first);
+    {
+        std::lock_guard<std::mutex> lk(*m_dc_servers[s].send_mutex);
+        send_string(msg, m_dc_servers[s].serve_socket);
+    }
+    Logger::log(LogLevel::LDEBUG, "[DC CLIENT] Sent get req to server: " + m_dc_servers[s].name);
 }
 
 void ClientComm::run_dc_client_listen_server(const std::atomic<bool> *end_signal)
@@ -133,9 +155,15 @@ void ClientComm::run_dc_client_listen_server(const std::atomic<bool> *end_signal
     };
 
     Logger::log(LogLevel::LDEBUG, "[DC CLIENT] run_dc_client_listen_server() start polling.");
+    auto next_sweep = std::chrono::steady_clock::now();
     while (true)
     {
         zmq::poll(pollitems.data(), pollitems.size(), 10);
+        auto now = std::chrono::steady_clock::now();
+        if (now >= next_sweep) {
+            m_dc_client->ExpireOps();
+            next_sweep = now + std::chrono::milliseconds(DC_OP_SWEEP_MS);
+        }
         /* ack */
         if (pollitems[0].revents & ZMQ_POLLIN)
         {
@@ -167,10 +195,11 @@ void ClientComm::handle_ack(std::string &msg) {
     //if (verify_dc) // skip for now
     
     // receive acks directly from dc servers
-    m_recv_ack_map[ack_dc.header_hash()] += 1;
-    if (m_recv_ack_map[ack_dc.header_hash()] == WRITE_THRESHOLD) {
+    // the count restarts at quorum, so that a later put of the same record collects acks of its own
+    if (++m_recv_ack_map[ack_dc.header_hash()] >= WRITE_THRESHOLD) {
         Logger::log(LogLevel::LDEBUG, "[DC CLIENT] ack message reached quorum for signature: " + Util::binary_to_hex_string(ack_dc.header_hash().c_str(), 32));
-        
+        m_recv_ack_map.erase(ack_dc.header_hash());
+
         if(!this->m_dc_client->CommitAck(ack_dc.header_hash())) {
             Logger::log(LogLevel::LDEBUG, "[DC CLIENT] COMMIT ACK failed");
         } 
@@ -190,6 +219,8 @@ void ClientComm::handle_get_resp(std::string &msg) {
 	    *fhc.mutable_fresh_hashes() = {resp.fresh_hashes().begin(), resp.fresh_hashes().end()};
             if(!this->m_dc_client->CommitFreshResp(resp.hash(), fhc))
                 Logger::log(LogLevel::LDEBUG, "[DC CLIENT] COMMIT FRESHNESS failed");
+        } else if (!this->m_dc_client->CommitGetFailure(resp.hash(), DC_OP_FAILED)) {
+            Logger::log(LogLevel::LDEBUG, "[DC CLIENT] COMMIT FRESHNESS failed");
         }
     } else {
         std::string dots("...");
@@ -203,6 +234,8 @@ void ClientComm::handle_get_resp(std::string &msg) {
         if (resp.success()) {
             if(!this->m_dc_client->CommitGetResp(resp.hash(), resp.record()))
                 Logger::log(LogLevel::LDEBUG, "[DC CLIENT] COMMIT GET RESP failed");
+        } else if (!this->m_dc_client->CommitGetFailure(resp.hash(), DC_OP_NOT_FOUND)) {
+            Logger::log(LogLevel::LDEBUG, "[DC CLIENT] COMMIT GET RESP failed");
         }
     }
 }
@@ -3,10 +3,13 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <zmq.hpp>
 #include <atomic>
+#include <mutex>
 
 #include "capsule.pb.h"
+#include "placement.hpp"
 
 
 class DCClient; // Forward Declaration to avoid circular dependency
@@ -16,9 +19,13 @@ class ClientComm
 public:
     ClientComm(std::string ip, int64_t client_id, DCClient *dc_client);
 
-    void mcast_dc(const std::string &msg);
+    // to the replica set of hash (see Placement)
+    void send_dc(const std::string &hash, const std::string &msg);
+    void send_dc(const std::string &hash, const char *buf, size_t len); // sent from buf, no intermediate string
     void send_dc_proxy(std::string &msg);
-    void send_get_req(std::string &msg);
+    // to one server holding hash; a freshness request (no hash) goes to any server,
+    // which all hold every record (DCClient refuses freshness requests when records are striped)
+    void send_get_req(const std::string &hash, std::string &msg);
     void run_dc_client_listen_server(const std::atomic<bool> *end_signal);
 
     DCClient *m_dc_client;
@@ -28,9 +35,17 @@ public:
     std::string m_recv_get_resp_port;
     std::string m_recv_get_resp_addr;
     zmq::context_t m_context;
-    std::unordered_map<std::string, zmq::socket_t *> m_dc_server_dc_sockets;
-    std::unordered_map<std::string, zmq::socket_t *> m_dc_server_serve_sockets;
+    struct dc_server
+    {
+        std::string name; // ip:id
+        zmq::socket_t *dc_socket; // records, NULL when they go through the proxy
+        zmq::socket_t *serve_socket; // get requests
+        std::mutex *send_mutex; // sockets are not thread-safe, client threads take turns sending to a server
+    };
+    std::vector<dc_server> m_dc_servers; // indexed as in m_placement
+    Placement *m_placement;
     zmq::socket_t *m_proxy_write_socket;
+    std::mutex m_proxy_mutex;
     std::unordered_map<std::string, int> m_recv_ack_map;
 
     /* for comm test? */
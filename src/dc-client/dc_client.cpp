@@ -2,6 +2,8 @@
 
 #include <string>
 #include <thread>
+#include <algorithm>
+#include <cassert>
 
 #include "capsule.pb.h"
 #include "request.pb.h"
@@ -12,7 +14,8 @@
 
 
 DCClient::DCClient(const int64_t client_id) : 
-    client_comm_(ClientComm(NET_DC_SERVER_IP, client_id, this))
+    client_comm_(ClientComm(NET_DC_SERVER_IP, client_id, this)),
+    record_cache_(RECORD_CACHE_BYTES)
 {}
 
 
@@ -23,140 +26,273 @@ int DCClient::RunListenServer(const std::atomic<bool> *end_signal)
     return 0;
 }
 
-void DCClient::Put(const std::string hash, const std::string &srl_pdu) {
-    Logger::log(LDEBUG, "[DCClient] Put called, " + Util::binary_to_hex_string(hash.c_str(), hash.size()));
+bool DCFuture::Ready() const
+{
+    std::lock_guard<std::mutex> lk(op_->m);
+    return op_->done;
+}
+
+bool DCFuture::Wait() const
+{
+    std::unique_lock<std::mutex> lk(op_->m);
+    op_->cv.wait_until(lk, op_->deadline, [this]{return op_->done;});
+    return op_->done && op_->ret == 0;
+}
+
+int DCFuture::Error() const
+{
+    std::lock_guard<std::mutex> lk(op_->m);
+    return op_->done ? op_->ret : DC_OP_TIMEOUT;
+}
 
-    std::shared_ptr<struct put_status> pops(new struct put_status);
-    pops->done = false;
-    pops->ret = 0;
-    pops->timestamp = 0;
+std::shared_ptr<const std::string> DCFuture::Result() const
+{
+    return Wait() ? op_->srl_pdu : nullptr;
+}
 
-    const auto res = put_status_.insert({hash, pops}); 
+bool DCFuture::WaitAll(const std::vector<DCFuture> &futures)
+{
+    bool ok = true;
+    for (auto &f : futures)
+        ok &= f.Wait();
+    return ok;
+}
 
-    if (res.second) { // new key is inserted
-        //capsule::CapsulePDU pdu;
-        //std::string out_msg;
+size_t DCFuture::WaitAny(const std::vector<DCFuture> &futures)
+{
+    dc_op::any_waiter w;
+    size_t registered = 0;
+    for (; registered < futures.size(); registered++) {
+        std::lock_guard<std::mutex> lk(futures[registered].op_->m);
+        if (futures[registered].op_->done)
+            break;
+        futures[registered].op_->any_waiters.push_back(&w);
+    }
 
-        //client_comm_.CreatePdu(hash, srl_payload, pdu);
-        //pdu.SerializeToString(&out_msg);
-        client_comm_.mcast_dc(srl_pdu);
+    if (registered == futures.size()) {
+        std::unique_lock<std::mutex> lk(w.m);
+        w.cv.wait(lk, [&w]{return w.fired;});
     }
-    
+
+    // ops notify their waiters under their own lock, so w is unreachable once removed from each
+    size_t ready = futures.size();
+    for (size_t i = 0; i < registered; i++) {
+        std::lock_guard<std::mutex> lk(futures[i].op_->m);
+        auto &waiters = futures[i].op_->any_waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+        if (futures[i].op_->done && ready == futures.size())
+            ready = i;
+    }
+    return ready < futures.size() ? ready : registered;
+}
+
+void DCClient::complete(std::shared_ptr<dc_op> op, int ret, std::shared_ptr<const std::string> srl_pdu)
+{
+    std::vector<DCCallback> callbacks;
     {
-        std::unique_lock<std::mutex> lk(put_status_[hash]->m);
-        const bool &d = put_status_[hash]->done;
-        put_status_[hash]->cv.wait(lk, [&d]{return d;});
+        std::lock_guard<std::mutex> lk(op->m);
+        op->done = true;
+        op->ret = ret;
+        op->srl_pdu = srl_pdu;
+        callbacks.swap(op->callbacks);
+        for (auto w : op->any_waiters) {
+            std::lock_guard<std::mutex> wlk(w->m);
+            w->fired = true;
+            w->cv.notify_all();
+        }
     }
+    op->cv.notify_all();
 
-    if (put_status_[hash]->ret) // something's wrong if ret = non-zero
-		Logger::log(ERROR, "[DCClient] Put error");
+    for (auto &callback : callbacks)
+        callback(ret == 0, srl_pdu);
+}
 
-    put_status_.erase(hash);
+void DCClient::addCallback(std::shared_ptr<dc_op> op, DCCallback callback)
+{
+    if (!callback)
+        return;
+    {
+        std::lock_guard<std::mutex> lk(op->m);
+        if (!op->done) {
+            op->callbacks.push_back(callback);
+            return;
+        }
+    }
+    callback(op->ret == 0, op->srl_pdu);
+}
+
+DCFuture DCClient::PutAsync(const std::string hash, const char *srl_pdu, size_t len, DCCallback callback)
+{
+    Logger::log(LDEBUG, "[DCClient] Put called, " + Util::binary_to_hex_string(hash.c_str(), hash.size()));
 
-    return;
+    // same record already in flight: share its ack
+    const auto res = put_status_.Emplace(hash, std::make_shared<dc_op>());
+    std::shared_ptr<dc_op> op = res.first;
+    bool inserted = res.second;
+    addCallback(op, callback);
+
+    if (inserted) // new key is inserted
+        client_comm_.send_dc(hash, srl_pdu, len);
+    return DCFuture(op);
 }
 
-/* can be improved to MT version using parallel hashmap and modify_if ...*/
-std::string* DCClient::Get(const std::string hash, DCGetOptions opt)
+DCFuture DCClient::GetAsync(const std::string hash, const DCGetOptions opt, DCCallback callback)
 {
     assert(opt.is_fresh_req == false || hash.size() == 0);
     assert(!(opt.is_fresh_req && opt.is_metaonly_req));
 
-    
     if (opt.is_fresh_req)
         Logger::log(LogLevel::LDEBUG, "[DCClient] Freshness Service called");
     else
         Logger::log(LogLevel::LDEBUG, "[DCClient] Get called, " + Util::binary_to_hex_string(hash.c_str(), hash.size()));
 
-    std::shared_ptr<struct get_status> gops(new struct get_status);
-    gops->done = false;
-    gops->ret = 0;
-    gops->timestamp = 0;
-    gops->srl_pdu = NULL;
-    gops->is_fresh_req = opt.is_fresh_req;
-    gops->is_metaonly_req = opt.is_metaonly_req;
+    if (opt.is_fresh_req && !client_comm_.m_placement->Everywhere()) {
+        // each server only knows the heads of the records placed on it, and a record whose successor
+        // lives on another server looks like a head: no subset of the answers gives the real heads
+        Logger::log(ERROR, "[DCClient] Freshness Service is unavailable when records are striped");
+        std::shared_ptr<dc_op> op = std::make_shared<dc_op>();
+        complete(op, DC_OP_FAILED, nullptr);
+        addCallback(op, callback);
+        return DCFuture(op);
+    }
 
+    if (!opt.is_fresh_req) {
+        std::shared_ptr<const std::string> cached = record_cache_.Get(hash, opt.is_metaonly_req);
+        if (cached) {
+            std::shared_ptr<dc_op> op = std::make_shared<dc_op>();
+            complete(op, 0, cached);
+            addCallback(op, callback);
+            return DCFuture(op);
+        }
+    }
 
-    gs_key gk(hash, opt.is_metaonly_req);
-    const auto res = get_status_.insert({gk, gops}); 
+    // requested before and still in flight
+    const auto res = get_status_.Emplace(gs_key(hash, opt.is_metaonly_req), std::make_shared<dc_op>());
+    std::shared_ptr<dc_op> op = res.first;
+    bool inserted = res.second;
+    addCallback(op, callback);
 
-    if (res.second) { // new key is inserted   
+    if (inserted) { // new key is inserted
         capsule::ClientGetRequest out_req;
         out_req.set_hash(hash);
         out_req.set_replyaddr(client_comm_.m_recv_get_resp_addr);
-        out_req.set_fresh_req(gops->is_fresh_req);
-        out_req.set_metaonly_req(gops->is_metaonly_req);
+        out_req.set_fresh_req(opt.is_fresh_req);
+        out_req.set_metaonly_req(opt.is_metaonly_req);
 
         std::string out_msg;
         out_req.SerializeToString(&out_msg);
-    
-        client_comm_.send_get_req(out_msg);
-    }
 
-    {
-        std::unique_lock<std::mutex> lk(get_status_[gk]->m);
-        const bool &d = get_status_[gk]->done;
-        get_status_[gk]->cv.wait(lk, [&d]{return d;});
+        client_comm_.send_get_req(hash, out_msg);
     }
+    return DCFuture(op);
+}
 
-    if (!get_status_[gk]->ret && get_status_[gk]->srl_pdu) // something's wrong if ret = non-zero
-        return get_status_[gk]->srl_pdu;
-    else
-        return NULL;
+bool DCClient::Put(const std::string hash, const std::string &srl_pdu) {
+    return Put(hash, srl_pdu.c_str(), srl_pdu.size());
+}
+
+bool DCClient::Put(const std::string hash, const char *srl_pdu, size_t len) {
+    if (PutAsync(hash, srl_pdu, len).Wait())
+        return true;
+    Logger::log(ERROR, "[DCClient] Put error");
+    return false;
+}
+
+void DCClient::SubmitPut(const std::string hash, const std::string &srl_pdu) {
+    SubmitPut(hash, srl_pdu.c_str(), srl_pdu.size());
+}
+
+void DCClient::SubmitPut(const std::string hash, const char *srl_pdu, size_t len) {
+    DCFuture f = PutAsync(hash, srl_pdu, len);
+    submitted_puts_.Update(hash, [&f](std::vector<DCFuture> &futures) {
+        futures.push_back(f);
+        return true;
+    });
+}
+
+bool DCClient::WaitPut(const std::string hash) {
+    DCFuture f;
+    submitted_puts_.Update(hash, [&f](std::vector<DCFuture> &futures) {
+        if (futures.empty())
+            return false;
+        f = futures.front();
+        futures.erase(futures.begin());
+        return !futures.empty();
+    });
+    if (!f.Valid())
+        return false;
+
+    if (f.Wait())
+        return true;
+    Logger::log(ERROR, "[DCClient] Put error");
+    return false;
+}
+
+std::shared_ptr<const std::string> DCClient::Get(const std::string hash, DCGetOptions opt)
+{
+    return GetAsync(hash, opt).Result();
 }
 
 bool DCClient::CommitAck(const std::string &hash) {
-    auto it = put_status_.find(hash);
-    if (it == put_status_.end())
+    // a later put of the same record is sent again
+    std::shared_ptr<dc_op> op;
+    if (!put_status_.Take(hash, &op))
         return false;
-    
-    {
-        std::unique_lock<std::mutex> lk(it->second->m);
-        it->second->done = true;
-        it->second->ret = 0;
-    }
-    it->second->cv.notify_all();
 
+    complete(op, 0, NULL);
     return true;
 }
 
 bool DCClient::CommitGetResp(const std::string &hash, const capsule::CapsulePDU &pdu) {
     bool is_metaonly_req = (pdu.payload_in_transit().size() == 0);
     gs_key gk(hash, is_metaonly_req);
-
-    auto it = get_status_.find(gk);
-    if (it == get_status_.end())
+    std::shared_ptr<dc_op> op;
+    if (!get_status_.Find(gk, &op))
         return false;
-    {
-        std::unique_lock<std::mutex> lk(it->second->m);
-        it->second->done = true;
-        it->second->ret = 0;
-        it->second->srl_pdu = new std::string();
 
-        /* TODO: change inteface to remove this reserialization */
-        pdu.SerializeToString(it->second->srl_pdu);    
+    /* TODO: change inteface to remove this reserialization */
+    std::shared_ptr<std::string> srl_pdu = std::make_shared<std::string>();
+    pdu.SerializeToString(srl_pdu.get());
+    // cached before the request is retired, so that a get in between finds one or the other
+    record_cache_.Put(hash, is_metaonly_req, srl_pdu);
+    get_status_.Erase(gk);
+    complete(op, 0, srl_pdu);
+    return true;
+}
+
+/* the response does not tell a metaonly get from a full one, and the server holds the record for neither */
+bool DCClient::CommitGetFailure(const std::string &hash, int ret) {
+    bool found = false;
+    for (bool is_metaonly_req : {false, true}) {
+        std::shared_ptr<dc_op> op;
+        if (get_status_.Take(gs_key(hash, is_metaonly_req), &op)) {
+            complete(op, ret, nullptr);
+            found = true;
+        }
     }
-    it->second->cv.notify_all();
+    return found;
+}
 
-    return true;
+void DCClient::ExpireOps() {
+    auto now = std::chrono::steady_clock::now();
+    auto expired = [now](const std::shared_ptr<dc_op> &op) { return op->deadline <= now; };
+
+    std::vector<std::shared_ptr<dc_op>> ops = put_status_.TakeIf(expired);
+    std::vector<std::shared_ptr<dc_op>> gets = get_status_.TakeIf(expired);
+    ops.insert(ops.end(), gets.begin(), gets.end());
+    if (!ops.empty())
+        Logger::log(WARNING, "[DCClient] " + std::to_string(ops.size()) + " requests got no answer in time");
+    for (auto &op : ops)
+        complete(op, DC_OP_TIMEOUT, nullptr);
 }
 
 bool DCClient::CommitFreshResp(const std::string &hash, const capsule::FreshHashesContainer &fhc) {
-    gs_key gk(hash, false);
-
-    auto it = get_status_.find(gk);
-    if (it == get_status_.end())
+    std::shared_ptr<dc_op> op;
+    if (!get_status_.Take(gs_key(hash, false), &op))
         return false;
-    {
-        std::unique_lock<std::mutex> lk(it->second->m);
-        it->second->done = true;
-        it->second->ret = 0;
-        it->second->srl_pdu = new std::string();
-
-        fhc.SerializeToString(it->second->srl_pdu);
-        //it->second->srl_pdu = new std::string(fresh_hashes_str.c_str(), fresh_hashes_str.size());
-    }
-    it->second->cv.notify_all();
 
+    std::shared_ptr<std::string> srl_pdu = std::make_shared<std::string>();
+    fhc.SerializeToString(srl_pdu.get());
+    complete(op, 0, srl_pdu);
     return true;
-}
\ No newline at end of file
+}
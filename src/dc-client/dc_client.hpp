@@ -7,11 +7,18 @@
 */
 
 #include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
 
 //#include "crypto.hpp"
 #include "client_comm.hpp"
+#include "sharded_map.hpp"
+#include "record_cache.hpp"
+#include "dc_config.hpp"
 #include "capsule.pb.h"
 #include "request.pb.h"
 /**
@@ -22,6 +29,64 @@ struct DCGetOptions {
     bool is_metaonly_req;
 };
 
+/**
+ * Completion callback of an asynchronous Put or Get, run by the listen thread, so it must not block.
+ * srl_pdu is the Get response (NULL for a Put or a failure).
+ */
+typedef std::function<void(bool ok, std::shared_ptr<const std::string> srl_pdu)> DCCallback;
+
+/* why a Put or Get failed */
+#define DC_OP_FAILED -1
+#define DC_OP_NOT_FOUND -2 // the server answered that it does not hold the record
+#define DC_OP_TIMEOUT -3 // no answer within DC_OP_TIMEOUT_MS
+
+/**
+ * State of a Put or Get in flight, completed by the listen thread, or failed by it at the deadline.
+ */
+struct dc_op {
+    struct any_waiter {
+        bool fired = false;
+        std::mutex m;
+        std::condition_variable cv;
+    };
+
+    bool done = false;
+    int ret = 0; // 0, or DC_OP_*
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DC_OP_TIMEOUT_MS);
+    std::shared_ptr<const std::string> srl_pdu; // Get response
+    std::vector<DCCallback> callbacks;
+    std::vector<any_waiter *> any_waiters; // in DCFuture::WaitAny
+    std::mutex m;
+    std::condition_variable cv;
+};
+
+/**
+ * Handle on an asynchronous Put or Get; copies share the operation.
+ * Wait returns whether it succeeded, waiting no longer than the deadline of the operation, and Error why not;
+ * the Result of a Get is its serialized response,
+ * which stays valid while held, even once evicted from the record cache.
+ */
+class DCFuture
+{
+public:
+    DCFuture() {}
+
+    bool Valid() const { return op_ != NULL; }
+    bool Ready() const;
+    bool Wait() const;
+    int Error() const;
+    std::shared_ptr<const std::string> Result() const;
+
+    static bool WaitAll(const std::vector<DCFuture> &futures); // true if all of them succeeded
+    static size_t WaitAny(const std::vector<DCFuture> &futures); // index of one that is ready
+
+private:
+    friend class DCClient;
+    explicit DCFuture(std::shared_ptr<dc_op> op) : op_(op) {}
+
+    std::shared_ptr<dc_op> op_;
+};
+
 class DCClient
 {
 public:
@@ -30,7 +95,7 @@ public:
     /** ListenServer takes 3 roles
      * 1. Receive and parse Ack
      * 2. Receive and parse Get resp
-     * 3. Periodically check ops_status_ and clear record cache 
+     * Completed gets are kept in a bounded record cache (see DCRecordCache)
     */
 
     int RunListenServer(const std::atomic<bool> *end_signal);
@@ -38,46 +103,49 @@ public:
     bool CommitAck(const std::string &hash);
     bool CommitGetResp(const std::string &hash, const capsule::CapsulePDU &pdu);
     bool CommitFreshResp(const std::string &hash, const capsule::FreshHashesContainer &fhc);
+    bool CommitGetFailure(const std::string &hash, int ret);
+    void ExpireOps(); // fails the operations past their deadline, so later requests of the same record are sent again
 
     /**
-     * current implementation supports synchronous only
+     * PutAsync and GetAsync send a request and return at once; any number can be in flight from one thread.
+     * A put of a record already in flight, or a get of one already requested, shares its operation;
+     * a get of a cached record completes at once.
+     * srl_pdu can be released as soon as PutAsync returns.
     */
-    void Put(const std::string hash, const std::string &srl_pdu);  
-    std::string* Get(const std::string hash, const DCGetOptions opt);
+    DCFuture PutAsync(const std::string hash, const char *srl_pdu, size_t len, DCCallback callback = nullptr);
+    DCFuture GetAsync(const std::string hash, const DCGetOptions opt, DCCallback callback = nullptr);
 
-private:
-    /** status of an outstanding operation
-    * ppdu is a pointer to CapsulePDU in Get resp.
-    * ppdu also takes a role of host-side cache.
+    /**
+     * Put is synchronous; it returns false if the write was not acked successfully.
+     * SubmitPut/WaitPut split it so that several puts can be in flight at once.
+     * Each SubmitPut must be matched by exactly one WaitPut on the same hash.
     */
-    struct put_status { 
-        bool done;
-        int ret;
-        uint64_t timestamp; // for cache eviction
-        std::mutex m;
-        std::condition_variable cv;
-    };
-    struct get_status { 
-        bool done;
-        int ret;
-        uint64_t timestamp; // for cache eviction
-        std::string* srl_pdu;
-        std::mutex m;
-        std::condition_variable cv;
+    bool Put(const std::string hash, const std::string &srl_pdu);
+    bool Put(const std::string hash, const char *srl_pdu, size_t len);
+    void SubmitPut(const std::string hash, const std::string &srl_pdu);
+    void SubmitPut(const std::string hash, const char *srl_pdu, size_t len);
+    bool WaitPut(const std::string hash);
+    std::shared_ptr<const std::string> Get(const std::string hash, const DCGetOptions opt);
+
+private:
+    static void complete(std::shared_ptr<dc_op> op, int ret, std::shared_ptr<const std::string> srl_pdu);
+    static void addCallback(std::shared_ptr<dc_op> op, DCCallback callback);
 
-        bool is_fresh_req;
-        bool is_metaonly_req;
-    };
     //Crypto crypto;
     //std::string m_prev_hash = "init";
 
-    /* Assuming single thread */
     ClientComm client_comm_; // communication implementation
-    
-    std::map<std::string, std::shared_ptr<struct put_status>> put_status_;
-    
+
+    /* requests are issued by any client thread and completed by the listen thread */
+    ShardedMap<std::string, std::shared_ptr<dc_op>> put_status_; // in flight, until acked
+    ShardedMap<std::string, std::vector<DCFuture>> submitted_puts_; // by SubmitPut, until WaitPut
+
     typedef std::pair<std::string, bool> gs_key; // <hash, metaonly>
-    std::map<gs_key, std::shared_ptr<struct get_status>> get_status_;
+    struct gs_key_hash {
+        size_t operator()(const gs_key &k) const { return std::hash<std::string>()(k.first) ^ k.second; }
+    };
+    ShardedMap<gs_key, std::shared_ptr<dc_op>, gs_key_hash> get_status_; // in flight, until answered
+    DCRecordCache record_cache_; // answered gets of records (freshness changes, so it is not cached)
 };
 
-#endif // DCCLIENT_H
\ No newline at end of file
+#endif // DCCLIENT_H
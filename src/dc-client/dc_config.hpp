@@ -34,6 +34,8 @@
 // Global Config
 #define VERIFY_SIG_PER_WRITES 1
 #define WRITE_THRESHOLD 1
+#define NET_REPLICAS (Util::load_replicas()) // servers holding each record, at least WRITE_THRESHOLD; 0 = all of them
+#define PLACEMENT_VNODES 64 // ring points per server (see Placement)
 #define REPLICATION_ACK "REPLICATION_ACK"
 #define REPLICATION_ID 4999
 #define PAIRING_TIMEOUT_SEC 5
@@ -50,5 +52,9 @@
 /**************** Client Config ****************/
 #define NET_CLIENT_RECV_ACK_PORT 5001 
 #define NET_CLIENT_RECV_GET_RESP_PORT 5101 
+#define RECORD_CACHE_BYTES ((uint64_t)Util::load_record_cache_mb() << 20) // Get responses kept by the client (see DCRecordCache)
+#define RECORD_CACHE_SHARDS 16
+#define DC_OP_TIMEOUT_MS 10000 // a put not acked or a get not answered by then fails
+#define DC_OP_SWEEP_MS 100 // how often the listen thread looks for such operations
 
 #endif // DCCONFIG_H
\ No newline at end of file
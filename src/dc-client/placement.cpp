@@ -0,0 +1,56 @@
+#include "placement.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <openssl/sha.h>
+
+#include "dc_config.hpp"
+#include "util/crypto.hpp"
+
+Placement::Placement(const std::vector<std::string> &servers, int replicas)
+{
+    m_servers = servers.size();
+    m_replicas = (replicas <= 0 || replicas > m_servers) ? m_servers : replicas;
+
+    for (int s = 0; s < m_servers; s++)
+    {
+        for (int v = 0; v < PLACEMENT_VNODES; v++)
+            m_ring.push_back(std::make_pair(position(servers[s] + "#" + std::to_string(v), false), s));
+    }
+    std::sort(m_ring.begin(), m_ring.end());
+}
+
+/* record names are SHA-256 hashes already (hashed), so their leading bytes are placed as they are */
+uint64_t Placement::position(const std::string &key, bool hashed)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    const unsigned char *p = (const unsigned char *)key.c_str();
+    if (!hashed || key.size() < sizeof(uint64_t))
+        p = Util::hash256((void *)key.c_str(), key.size(), digest);
+
+    uint64_t pos = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++)
+        pos = (pos << 8) | p[i];
+    return pos;
+}
+
+void Placement::ReplicaSet(const std::string &hash, std::vector<int> *out) const
+{
+    out->clear();
+    if (Everywhere())
+    {
+        for (int s = 0; s < m_servers; s++)
+            out->push_back(s);
+        return;
+    }
+
+    auto it = std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(position(hash, true), 0));
+    while ((int)out->size() < m_replicas)
+    {
+        if (it == m_ring.end())
+            it = m_ring.begin();
+        if (std::find(out->begin(), out->end(), it->second) == out->end())
+            out->push_back(it->second);
+        ++it;
+    }
+}
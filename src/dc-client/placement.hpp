@@ -0,0 +1,32 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+/**
+ * Consistent hashing of record names onto DC servers.
+ * Each server owns PLACEMENT_VNODES points of a ring; a record's replica set is the first `replicas`
+ * distinct servers found walking the ring from the record's position. Adding or removing a server
+ * only moves the records next to its points.
+ * With replicas = 0, or at least as many as there are servers, every server holds every record.
+ */
+class Placement
+{
+public:
+    Placement(const std::vector<std::string> &servers, int replicas);
+
+    bool Everywhere() const { return m_replicas == m_servers; }
+    // indices of the servers holding hash, into the list given to the constructor
+    void ReplicaSet(const std::string &hash, std::vector<int> *out) const;
+
+private:
+    static uint64_t position(const std::string &key, bool hashed);
+
+    std::vector<std::pair<uint64_t, int> > m_ring; // (point, server), sorted
+    int m_servers;
+    int m_replicas;
+};
+#endif // PLACEMENT_H
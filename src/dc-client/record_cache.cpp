@@ -0,0 +1,48 @@
+#include "record_cache.hpp"
+
+DCRecordCache::DCRecordCache(uint64_t capacity) : m_shard_capacity(capacity / RECORD_CACHE_SHARDS)
+{}
+
+std::shared_ptr<const std::string> DCRecordCache::Get(const std::string &hash, bool metaonly)
+{
+    key k(hash, metaonly);
+    shard &s = shardOf(k);
+    std::lock_guard<std::mutex> lk(s.m);
+
+    auto match = s.map.find(k);
+    if (match == s.map.end())
+        return nullptr;
+
+    s.lru.splice(s.lru.begin(), s.lru, match->second);
+    return match->second->srl_pdu;
+}
+
+void DCRecordCache::Put(const std::string &hash, bool metaonly, std::shared_ptr<const std::string> srl_pdu)
+{
+    entry e{key(hash, metaonly), srl_pdu};
+    uint64_t size = entrySize(e);
+    if (size > m_shard_capacity)
+        return;
+
+    shard &s = shardOf(e.k);
+    std::lock_guard<std::mutex> lk(s.m);
+
+    auto match = s.map.find(e.k);
+    if (match != s.map.end())
+        evict(s, match->second);
+
+    while (s.size + size > m_shard_capacity)
+        evict(s, std::prev(s.lru.end()));
+
+    s.lru.push_front(e);
+    s.map[e.k] = s.lru.begin();
+    s.size += size;
+}
+
+// caller holds s.m
+void DCRecordCache::evict(shard &s, std::list<entry>::iterator it)
+{
+    s.size -= entrySize(*it);
+    s.map.erase(it->k);
+    s.lru.erase(it);
+}
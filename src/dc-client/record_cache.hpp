@@ -0,0 +1,52 @@
+#ifndef DC_RECORD_CACHE_H
+#define DC_RECORD_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <stdint.h>
+
+#include "dc_config.hpp"
+
+/**
+ * Bounded LRU cache of Get responses, content-addressed by record hash (and whether only the metadata was asked for).
+ * Records never change under a hash, so entries are only evicted, never invalidated.
+ * The budget is split over RECORD_CACHE_SHARDS shards, each behind its own mutex;
+ * a response that does not fit in a shard is not cached. Evicted responses live on while a reader holds them.
+ */
+class DCRecordCache
+{
+public:
+    DCRecordCache(uint64_t capacity); // in bytes, 0 = no caching
+
+    std::shared_ptr<const std::string> Get(const std::string &hash, bool metaonly);
+    void Put(const std::string &hash, bool metaonly, std::shared_ptr<const std::string> srl_pdu);
+
+private:
+    typedef std::pair<std::string, bool> key;
+    struct key_hash {
+        size_t operator()(const key &k) const { return std::hash<std::string>()(k.first) ^ k.second; }
+    };
+    struct entry {
+        key k;
+        std::shared_ptr<const std::string> srl_pdu;
+    };
+    struct shard {
+        std::mutex m;
+        std::list<entry> lru; // front = most recently used
+        std::unordered_map<key, std::list<entry>::iterator, key_hash> map;
+        uint64_t size = 0;
+    };
+
+    static uint64_t entrySize(const entry &e) { return e.k.first.size() + e.srl_pdu->size(); }
+    void evict(shard &s, std::list<entry>::iterator it);
+    shard &shardOf(const key &k) { return m_shards[key_hash()(k) % RECORD_CACHE_SHARDS]; }
+
+    const uint64_t m_shard_capacity;
+    shard m_shards[RECORD_CACHE_SHARDS];
+};
+
+#endif // DC_RECORD_CACHE_H
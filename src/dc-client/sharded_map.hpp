@@ -0,0 +1,104 @@
+#ifndef SHARDED_MAP_H
+#define SHARDED_MAP_H
+
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
+/**
+ * Hash map split into shards, each behind its own mutex, so that threads working on different keys
+ * rarely wait for each other. Operations are atomic per key; values are copied out, so they should be
+ * cheap to copy (shared_ptr to the entry's state).
+ */
+template <typename K, typename V, typename Hash = std::hash<K>, size_t Shards = 16>
+class ShardedMap
+{
+public:
+    // inserts value unless key is present; returns the value now in the map and whether it was inserted
+    std::pair<V, bool> Emplace(const K &key, const V &value)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        auto res = s.map.insert({key, value});
+        return std::make_pair(res.first->second, res.second);
+    }
+
+    bool Find(const K &key, V *value)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+        *value = it->second;
+        return true;
+    }
+
+    // removes key and returns its value
+    bool Take(const K &key, V *value)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return false;
+        *value = std::move(it->second);
+        s.map.erase(it);
+        return true;
+    }
+
+    bool Erase(const K &key)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        return s.map.erase(key) > 0;
+    }
+
+    // runs f on the entry of key, created with V() if missing, under the shard lock; f returns false to erase it
+    template <typename F>
+    void Update(const K &key, F f)
+    {
+        shard &s = shardOf(key);
+        std::lock_guard<std::mutex> lk(s.m);
+        auto it = s.map.emplace(key, V()).first;
+        if (!f(it->second))
+            s.map.erase(it);
+    }
+
+    // removes the entries whose value f selects and returns them
+    template <typename F>
+    std::vector<V> TakeIf(F f)
+    {
+        std::vector<V> taken;
+        for (shard &s : m_shards) {
+            std::lock_guard<std::mutex> lk(s.m);
+            for (auto it = s.map.begin(); it != s.map.end();) {
+                if (f(it->second)) {
+                    taken.push_back(std::move(it->second));
+                    it = s.map.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return taken;
+    }
+
+private:
+    struct shard
+    {
+        std::mutex m;
+        std::unordered_map<K, V, Hash> map;
+    };
+
+    shard &shardOf(const K &key)
+    {
+        return m_shards[Hash()(key) % Shards];
+    }
+
+    shard m_shards[Shards];
+};
+#endif // SHARDED_MAP_H
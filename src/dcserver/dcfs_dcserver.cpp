@@ -0,0 +1,363 @@
+/**
+ * dcfs-dcserver: loopback DC server
+ * Stands in for the DC servers dcfs-client reaches with --dcserver_ip, speaking the same ZMQ protocol, so the
+ * whole client stack runs on one machine. Server id i (from INIT_DC_SERVER_ID) takes CapsulePDU pushes on
+ * NET_DC_SERVER_BASE_PORT + i, acked with a REPLICATION_ACK to the record's replyAddr, and ClientGetRequests
+ * on NET_SERVE_PORT + i, answered to the request's replyAddr.
+ * Records are kept in a DCServer store (--store). The protocol names a record by its header hash alone,
+ * so every record goes to one DataCapsule of the store.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <zmq.hpp>
+
+#include "fs/backend.hpp"
+#include "dc-client/dc_config.hpp"
+#include "util/logging.hpp"
+#include "util/encode.hpp"
+
+#define DCSERVER_DIR "/tmp/dcfs-dcserver" // --dir
+#define DCSERVER_MAX_RECORD_SIZE (1024 * 1024) // larger records are refused by gets
+#define DCSERVER_PUT_BATCH 64 // pushes taken at once, so a group sync covers all of them
+
+static std::atomic<bool> end_signal(false);
+
+/**
+ * DC server keeping records in memory; a view pins the record instead of copying it
+*/
+class MemStore : public DCServer {
+public:
+	err_t ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+		record_ref_t ref;
+		err_t ret = ViewRecord(dcname, recordname, desc->size, &ref);
+		if (ret < 0)
+			return ret;
+		memcpy(desc->buf, ref.buf, ref.size);
+		*read_size = ref.size;
+		return NO_ERR;
+	}
+
+	err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+		auto record = std::make_shared<const std::string>(desc->buf, desc->size);
+		std::unique_lock<std::shared_mutex> lock(m_);
+		records_[recordname] = record;
+		return NO_ERR;
+	}
+
+	err_t ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+		std::shared_lock<std::shared_mutex> lock(m_);
+		auto it = records_.find(recordname);
+		if (it == records_.end())
+			return ERR_NOT_FOUND;
+		if (it->second->size() > max_size)
+			return ERR_BUF_TOO_SMALL;
+		ref->buf = it->second->c_str();
+		ref->size = it->second->size();
+		ref->pin = it->second;
+		return NO_ERR;
+	}
+
+private:
+	std::unordered_map<std::string, std::shared_ptr<const std::string>> records_;
+	std::shared_mutex m_;
+};
+
+/**
+ * One DC server id. Every server receives every record (the client multicasts puts), so each keeps
+ * its own view of the heads: records no other record names as a prevHash, returned to fresh requests.
+ * Heads only cover records received since start, as the store cannot be listed.
+*/
+class LoopbackServer {
+public:
+	LoopbackServer(zmq::context_t *context, DCServer *store, std::string dcname, std::string bind_ip, int server_id)
+		: context_(context), store_(store), dcname_(dcname), server_id_(server_id),
+		put_sock_(*context, ZMQ_PULL), get_sock_(*context, ZMQ_PULL) {
+		put_sock_.bind("tcp://" + bind_ip + ":" + std::to_string(NET_DC_SERVER_BASE_PORT + server_id));
+		get_sock_.bind("tcp://" + bind_ip + ":" + std::to_string(NET_SERVE_PORT + server_id));
+	}
+
+	~LoopbackServer() {
+		for (auto &p : reply_socks_)
+			delete p.second;
+	}
+
+	void Serve() {
+		std::vector<zmq::pollitem_t> pollitems = {
+			{static_cast<void *>(put_sock_), 0, ZMQ_POLLIN, 0},
+			{static_cast<void *>(get_sock_), 0, ZMQ_POLLIN, 0},
+		};
+
+		while (!end_signal.load()) {
+			zmq::poll(pollitems.data(), pollitems.size(), 10);
+			if (pollitems[0].revents & ZMQ_POLLIN)
+				handlePuts();
+			if (pollitems[1].revents & ZMQ_POLLIN)
+				handleGet();
+		}
+	}
+
+private:
+	zmq::context_t *context_;
+	DCServer *store_;
+	std::string dcname_;
+	int server_id_;
+	zmq::socket_t put_sock_;
+	zmq::socket_t get_sock_;
+	std::unordered_map<std::string, zmq::socket_t *> reply_socks_; // by replyAddr
+	std::unordered_set<std::string> heads_;
+	std::unordered_set<std::string> linked_; // named as a prevHash by some record
+
+	zmq::socket_t *replySocket(const std::string &addr) {
+		auto it = reply_socks_.find(addr);
+		if (it != reply_socks_.end())
+			return it->second;
+
+		zmq::socket_t *sock = new zmq::socket_t(*context_, ZMQ_PUSH);
+		sock->connect("tcp://" + addr);
+		reply_socks_.emplace(addr, sock);
+		return sock;
+	}
+
+	void sendAck(const std::string &addr, const std::string &recordname) {
+		capsule::CapsulePDU ack;
+		ack.mutable_header()->set_sender(server_id_);
+		ack.mutable_header()->set_msgtype(REPLICATION_ACK);
+		ack.set_header_hash(recordname);
+
+		zmq::message_t msg(ack.ByteSizeLong());
+		ack.SerializeToArray(msg.data(), msg.size());
+		replySocket(addr)->send(msg);
+	}
+
+	/**
+	 * Stores a batch of pushed records through SubmitWrite, then acks each once WaitWrite returns,
+	 * so a store syncing records (DCServerSeg with --durability) makes one sync for the batch.
+	 * A record that cannot be stored gets no ack, as the protocol has no negative one.
+	*/
+	void handlePuts() {
+		struct pending {
+			std::string recordname;
+			std::string reply_addr;
+		};
+		std::vector<pending> batch;
+		google::protobuf::Arena arena;
+
+		for (int i = 0; i < DCSERVER_PUT_BATCH; i++) {
+			zmq::message_t msg;
+			if (!put_sock_.recv(&msg, ZMQ_DONTWAIT))
+				break;
+
+			record_view_t view;
+			if (parse_record((const char *)msg.data(), msg.size(), &arena, &view) < 0 || view.header_hash == NULL) {
+				Logger::log(WARNING, "dcfs-dcserver: dropped a malformed record");
+				continue;
+			}
+			std::string recordname(view.header_hash, view.header_hash_size);
+
+			buf_desc_t desc;
+			desc.buf = (char *)msg.data();
+			desc.size = msg.size();
+			if (store_->SubmitWrite(dcname_, recordname, &desc) < 0) {
+				Logger::log(ERROR, "dcfs-dcserver: cannot store record "
+						+ Util::binary_to_hex_string(recordname.c_str(), recordname.size()));
+				continue;
+			}
+
+			if (linked_.count(recordname) == 0)
+				heads_.insert(recordname);
+			for (const std::string &prev : view.header->prevhash()) {
+				linked_.insert(prev);
+				heads_.erase(prev);
+			}
+			batch.push_back({recordname, view.header->replyaddr()});
+		}
+
+		for (auto &p : batch) {
+			if (store_->WaitWrite(dcname_, p.recordname) < 0) {
+				Logger::log(ERROR, "dcfs-dcserver: cannot store record "
+						+ Util::binary_to_hex_string(p.recordname.c_str(), p.recordname.size()));
+				continue;
+			}
+			if (!p.reply_addr.empty())
+				sendAck(p.reply_addr, p.recordname);
+		}
+	}
+
+	/**
+	 * The response is written by hand around the stored record, which is embedded as it is:
+	 * ClientGetResponse.record has the wire format of the CapsulePDU bytes, so nothing is reparsed.
+	 * A metaonly response leaves out the payload_in_transit field.
+	*/
+	void handleGet() {
+		using google::protobuf::io::CodedOutputStream;
+		using google::protobuf::internal::WireFormatLite;
+
+		zmq::message_t in;
+		if (!get_sock_.recv(&in))
+			return;
+		capsule::ClientGetRequest req;
+		if (!req.ParseFromArray(in.data(), in.size()) || req.replyaddr().empty()) {
+			Logger::log(WARNING, "dcfs-dcserver: dropped a malformed get request");
+			return;
+		}
+
+		capsule::ClientGetResponse resp;
+		resp.set_hash(req.hash());
+		if (req.fresh_req()) {
+			resp.set_success(true);
+			resp.set_fresh_resp(true);
+			for (const std::string &head : heads_)
+				resp.add_fresh_hashes(head);
+		}
+
+		// spans of the stored record that make up the response record
+		const char *parts[2] = {NULL, NULL};
+		uint64_t part_sizes[2] = {0, 0};
+		record_ref_t ref;
+		err_t ret = req.fresh_req() ? NO_ERR : store_->ViewRecord(dcname_, req.hash(), DCSERVER_MAX_RECORD_SIZE, &ref);
+		// clients read a failed get as "not held here", so a record that cannot be read is not answered for
+		if (ret < 0 && ret != ERR_NOT_FOUND) {
+			Logger::log(ERROR, "dcfs-dcserver: cannot read record "
+					+ Util::binary_to_hex_string(req.hash().c_str(), req.hash().size()));
+			return;
+		}
+		if (!req.fresh_req() && ret == NO_ERR) {
+			parts[0] = ref.buf;
+			part_sizes[0] = ref.size;
+
+			google::protobuf::Arena arena;
+			record_view_t view;
+			if (req.metaonly_req() && parse_record(ref.buf, ref.size, &arena, &view) == NO_ERR && view.payload != NULL) {
+				const char *field = view.payload - 1 - CodedOutputStream::VarintSize64(view.payload_size);
+				part_sizes[0] = field - ref.buf;
+				parts[1] = view.payload + view.payload_size;
+				part_sizes[1] = ref.buf + ref.size - parts[1];
+			}
+			resp.set_success(true);
+		}
+
+		uint64_t record_size = part_sizes[0] + part_sizes[1];
+		uint64_t size = resp.ByteSizeLong();
+		if (resp.success() && !req.fresh_req())
+			size += 1 + CodedOutputStream::VarintSize64(record_size) + record_size;
+
+		zmq::message_t out(size);
+		uint8_t *target = resp.SerializeWithCachedSizesToArray((uint8_t *)out.data());
+		if (resp.success() && !req.fresh_req()) {
+			target = WireFormatLite::WriteTagToArray(capsule::ClientGetResponse::kRecordFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+			target = CodedOutputStream::WriteVarint64ToArray(record_size, target);
+			for (int i = 0; i < 2; i++)
+				target = CodedOutputStream::WriteRawToArray(parts[i], part_sizes[i], target);
+		}
+		replySocket(req.replyaddr())->send(out);
+	}
+};
+
+static void show_help(const char *progname) {
+	printf("usage: %s [options]\n\n", progname);
+	printf("Options:\n"
+	       "    --store=mem|seg|files  keep records in memory, appended to segment\n"
+	       "                           files, or one file per record, under --dir\n"
+	       "                           (default: mem)\n"
+	       "    --dir=<path>           directory of the store (default: %s)\n"
+	       "    --durability=none|group|each\n"
+	       "                           for --store=seg, as in dcfs-midd (default: none)\n"
+	       "    --servers=<n>          DC servers to run, ids %d to %d+n-1; clients\n"
+	       "                           reach them with --dcserver_ip=<ip>:<n>\n"
+	       "                           (default: %d)\n"
+	       "    --bind=<ip>            address the servers listen on (default: 127.0.0.1)\n"
+	       "\n", DCSERVER_DIR, INIT_DC_SERVER_ID, INIT_DC_SERVER_ID, LOCAL_DC_SERVER_COUNT);
+}
+
+static bool parse_option(const char *arg, const char *name, std::string *value) {
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return false;
+	*value = std::string(arg + len + 1);
+	return true;
+}
+
+static void handle_signal(int) {
+	end_signal.store(true);
+}
+
+int main(int argc, char *argv[]) {
+	std::string store_type = "mem";
+	std::string dir = DCSERVER_DIR;
+	std::string durability = "none";
+	std::string bind_ip = "127.0.0.1";
+	int servers = LOCAL_DC_SERVER_COUNT;
+	std::string value;
+
+	for (int i = 1; i < argc; i++) {
+		if (parse_option(argv[i], "--store", &store_type) || parse_option(argv[i], "--dir", &dir)
+				|| parse_option(argv[i], "--durability", &durability) || parse_option(argv[i], "--bind", &bind_ip)) {
+			continue;
+		} else if (parse_option(argv[i], "--servers", &value)) {
+			servers = std::stoi(value);
+		} else {
+			show_help(argv[0]);
+			return (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) ? 0 : 1;
+		}
+	}
+
+	durability_mode sync_mode;
+	if (!parse_durability_mode(durability, &sync_mode) || servers < 1) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	DCServer *store;
+	if (store_type == "mem") {
+		store = new MemStore();
+	} else if (store_type == "seg") {
+		store = new DCServerSeg(dir, sync_mode);
+	} else if (store_type == "files") {
+		fs::create_directories(dir);
+		store = new DCServerSim(dir);
+	} else {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	// the DataCapsule holding every record, registered as the stores expect: a record named after it
+	std::string dcname(HASHLEN_IN_BYTES, '\0');
+	buf_desc_t empty;
+	empty.buf = NULL;
+	empty.size = 0;
+	if (store->WriteRecord(dcname, dcname, &empty) < 0) {
+		fprintf(stderr, "cannot open the %s store under %s\n", store_type.c_str(), dir.c_str());
+		return 1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	zmq::context_t context(1);
+	std::vector<std::unique_ptr<LoopbackServer>> dcservers;
+	for (int id = INIT_DC_SERVER_ID; id < INIT_DC_SERVER_ID + servers; id++)
+		dcservers.emplace_back(new LoopbackServer(&context, store, dcname, bind_ip, id));
+
+	std::vector<std::thread> threads;
+	for (auto &dcserver : dcservers)
+		threads.emplace_back(&LoopbackServer::Serve, dcserver.get());
+	printf("dcfs-dcserver: %d server(s) on %s, ports %d and %d onwards\n", servers, bind_ip.c_str(),
+			NET_DC_SERVER_BASE_PORT + INIT_DC_SERVER_ID, NET_SERVE_PORT + INIT_DC_SERVER_ID);
+	fflush(stdout);
+
+	for (auto &t : threads)
+		t.join();
+	dcservers.clear();
+	delete store;
+	return 0;
+}
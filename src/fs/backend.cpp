@@ -1,11 +1,20 @@
 #include <fstream>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include "backend.hpp"
 #include "util/encode.hpp"
 
-void init_backend(StorageBackend **backend) {
+err_t init_backend(StorageBackend **backend) {
 	*backend = new StorageBackend(BACKEND_MNT_POINT);
+	if (!(*backend)->Ready()) {
+		delete *backend;
+		*backend = NULL;
+		return ERR_NO_CONN;
+	}
+	return NO_ERR;
 }
 
 void alloc_buf_desc(buf_desc_t *desc, uint64_t size) {
@@ -17,9 +26,236 @@ void dealloc_buf_desc(buf_desc_t *desc) {
 	delete[] desc->buf;
 }
 
-/**
- * Disclaimer: No signature is used in this implementation
-*/
+err_t parse_record(const char *buf, uint64_t size, google::protobuf::Arena *arena, record_view_t *view) {
+	using google::protobuf::io::CodedInputStream;
+	using google::protobuf::internal::WireFormatLite;
+
+	capsule::CapsuleHeader *header = google::protobuf::Arena::CreateMessage<capsule::CapsuleHeader>(arena);
+	view->header = header;
+	view->header_hash = NULL;
+	view->header_hash_size = 0;
+	view->payload = NULL;
+	view->payload_size = 0;
+
+	CodedInputStream in((const uint8_t *)buf, size);
+	in.SetTotalBytesLimit(INT_MAX);
+	uint32_t tag;
+	while ((tag = in.ReadTag()) != 0) {
+		int field = WireFormatLite::GetTagFieldNumber(tag);
+		if (WireFormatLite::GetTagWireType(tag) != WireFormatLite::WIRETYPE_LENGTH_DELIMITED
+				|| (field != capsule::CapsulePDU::kHeaderFieldNumber 
+					&& field != capsule::CapsulePDU::kHeaderHashFieldNumber 
+					&& field != capsule::CapsulePDU::kPayloadInTransitFieldNumber)) {
+			if (!WireFormatLite::SkipField(&in, tag))
+				return ERR_IO;
+			continue;
+		}
+
+		uint32_t len;
+		if (!in.ReadVarint32(&len) || (uint64_t)in.CurrentPosition() + len > size)
+			return ERR_IO;
+		const char *field_buf = buf + in.CurrentPosition();
+
+		if (field == capsule::CapsulePDU::kHeaderFieldNumber) {
+			if (!header->ParseFromArray(field_buf, len))
+				return ERR_IO;
+		} else if (field == capsule::CapsulePDU::kHeaderHashFieldNumber) {
+			view->header_hash = field_buf;
+			view->header_hash_size = len;
+		} else {
+			view->payload = field_buf;
+			view->payload_size = len;
+		}
+		in.Skip(len);
+	}
+	if (in.CurrentPosition() != (int)size)
+		return ERR_IO;
+
+	return NO_ERR;
+}
+
+err_t read_blockmap(DCServer *dcserver, std::string dcname, std::string recordname, std::vector<char> *hashes, blockmap_chain_t *chain) {
+	struct delta_t {
+		record_ref_t ref; // keeps payload readable
+		const char *payload;
+		uint64_t size;
+	};
+	std::vector<delta_t> deltas; // newest first
+	std::string cur = recordname;
+
+	*chain = blockmap_chain_t();
+	hashes->clear();
+	while (cur != dcname) { // a chain without a full blockmap starts from an empty map
+		record_ref_t ref;
+		err_t ret = dcserver->ViewRecord(dcname, cur, std::max(MAX_BLOCKMAP_RECORD_SIZE, MAX_BLOCKMAP_DELTA_RECORD_SIZE), &ref);
+		if (ret < 0)
+			return ret;
+
+		char arena_block[RECORD_ARENA_BLOCK_SIZE];
+		google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+		record_view_t view;
+		if (parse_record(ref.buf, ref.size, &arena, &view) < 0 || view.header->prevhash_size() < 2)
+			return ERR_IO;
+		if (cur == recordname)
+			chain->latest_data_hash = view.header->prevhash(1);
+
+		if (view.header->msgtype() != record_type_to_string(BLOCKMAP_DELTA)) {
+			hashes->assign(view.payload, view.payload + view.payload_size);
+			chain->full_hash = cur;
+			break;
+		}
+		// the middleware writes a full blockmap by then, so a longer chain is not one it wrote
+		if (deltas.size() >= BLOCKMAP_DELTA_MAX_CHAIN) {
+			Logger::log(ERROR, "read_blockmap: delta chain longer than BLOCKMAP_DELTA_MAX_CHAIN");
+			return ERR_IO;
+		}
+
+		deltas.push_back({ref, view.payload, view.payload_size});
+		chain->delta_bytes += view.payload_size;
+		cur = view.header->prevhash(0);
+	}
+	chain->deltas = deltas.size();
+
+	// apply oldest first
+	for (auto it = deltas.rbegin(); it != deltas.rend(); it++) {
+		if (it->size < BLOCKMAP_DELTA_ENTRY_OFFSET || (it->size - BLOCKMAP_DELTA_ENTRY_OFFSET) % BLOCKMAP_DELTA_ENTRY_SIZE)
+			return ERR_IO;
+
+		uint64_t nblocks;
+		memcpy(&nblocks, it->payload + BLOCKMAP_DELTA_NBLOCKS_OFFSET, sizeof(uint64_t));
+		if (nblocks > BLOCKMAP_COVER) // before it sizes the map
+			return ERR_IO;
+		hashes->resize(nblocks * HASHLEN_IN_BYTES, 0);
+
+		for (size_t off = BLOCKMAP_DELTA_ENTRY_OFFSET; off < it->size; off += BLOCKMAP_DELTA_ENTRY_SIZE) {
+			uint64_t blk_idx;
+			memcpy(&blk_idx, it->payload + off, sizeof(uint64_t));
+			if (blk_idx >= nblocks)
+				return ERR_IO;
+			memcpy(hashes->data() + blk_idx * HASHLEN_IN_BYTES, it->payload + off + sizeof(uint64_t), HASHLEN_IN_BYTES);
+		}
+	}
+
+	return NO_ERR;
+}
+
+err_t read_checkpoint(DCServer *dcserver, std::string dcname, std::string recordname, checkpoint_t *cp) {
+	record_ref_t ref;
+	err_t ret = dcserver->ViewRecord(dcname, recordname, MAX_CHECKPOINT_RECORD_SIZE, &ref);
+	if (ret < 0)
+		return ret;
+
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	record_view_t view;
+	ret = parse_record(ref.buf, ref.size, &arena, &view);
+	if (ret < 0 || view.header->msgtype() != record_type_to_string(CHECKPOINT)
+			|| view.header->prevhash_size() < 5 || view.payload_size < CHECKPOINT_PAYLOAD_SIZE)
+		return ERR_IO;
+
+	memcpy(&cp->seq, view.payload + CHECKPOINT_SEQ_OFFSET, sizeof(uint64_t));
+	memcpy(&cp->version, view.payload + CHECKPOINT_VERSION_OFFSET, sizeof(uint64_t));
+	memcpy(&cp->isize, view.payload + CHECKPOINT_ISIZE_OFFSET, sizeof(uint64_t));
+	cp->prev = view.header->prevhash(0);
+	cp->inode_hash = view.header->prevhash(1);
+	cp->blockmap_hash = view.header->prevhash(2);
+	cp->data_hash = view.header->prevhash(3);
+	cp->full_blockmap_hash = view.header->prevhash(4);
+
+	if (cp->version != (cp->seq + 1) * CHECKPOINT_INTERVAL - 1)
+		return ERR_VERIFY;
+
+	return NO_ERR;
+}
+
+/* streamed, so block payloads are never copied just to be signed */
+err_t digest_modify_args(std::string dcname, const std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key, unsigned char *digest) {
+	SHA256_CTX ctx;
+	if (!SHA256_Init(&ctx))
+		return ERR_HASH;
+
+	SHA256_Update(&ctx, dcname.c_str(), dcname.length());
+	for (auto &desc : *descs) {
+		if (desc.payload_hash.size() > 0)
+			SHA256_Update(&ctx, desc.payload_hash.c_str(), desc.payload_hash.size());
+		else if (desc.size > 0)
+			SHA256_Update(&ctx, desc.buf, desc.size);
+		SHA256_Update(&ctx, desc.recordname.c_str(), desc.recordname.length());
+	}
+	SHA256_Update(&ctx, inode_recordname.c_str(), inode_recordname.length());
+	SHA256_Update(&ctx, aes_key.c_str(), aes_key.length());
+
+	if (!SHA256_Final(digest, &ctx))
+		return ERR_HASH;
+	return NO_ERR;
+}
+
+err_t digest_modify_batch(const std::vector<modify_req_t> *reqs, unsigned char *digest) {
+	SHA256_CTX ctx;
+	if (!SHA256_Init(&ctx))
+		return ERR_HASH;
+
+	uint64_t count = reqs->size();
+	SHA256_Update(&ctx, &count, sizeof(count));
+	for (auto &req : *reqs) {
+		unsigned char req_digest[SHA256_DIGEST_LENGTH];
+		err_t ret = digest_modify_args(req.dcname, req.descs, req.inode_hash, req.aes_key, req_digest);
+		if (ret < 0)
+			return ret;
+		SHA256_Update(&ctx, req_digest, SHA256_DIGEST_LENGTH);
+	}
+
+	if (!SHA256_Final(digest, &ctx))
+		return ERR_HASH;
+	return NO_ERR;
+}
+
+err_t StorageBackend::openSession() {
+	unsigned char nonce[AES_KEY_LEN];
+	if (Util::generate_symmetric_key(nonce) != 1)
+		return ERR_CRYPTO;
+
+	// the handshake is always ECDSA-signed; session_mac_key_ is empty at this point
+	std::string signature;
+	err_t ret = signRequest(nonce, AES_KEY_LEN, &signature);
+	if (ret < 0)
+		return ret;
+
+	std::string mac_key;
+	ret = middleware_->OpenSession(std::string((char *)nonce, AES_KEY_LEN), &mac_key, (const unsigned char *)signature.c_str(), signature.size());
+	if (ret < 0)
+		return ret;
+
+	session_mac_key_ = mac_key;
+	return NO_ERR;
+}
+
+err_t StorageBackend::signRequest(const void *args, size_t len, std::string *sig) {
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	if (!Util::hash256((void *)args, len, hash))
+		return ERR_HASH;
+
+	return signDigest(hash, sig);
+}
+
+err_t StorageBackend::signDigest(const unsigned char *hash, std::string *sig) {
+	if (session_mac_key_.size() > 0) {
+		unsigned char tag[HMAC_TAG_LEN];
+		if (!Util::hmac256((const unsigned char *)session_mac_key_.c_str(), session_mac_key_.size(), hash, SHA256_DIGEST_LENGTH, tag))
+			return ERR_SIGN;
+		*sig = std::string((char *)tag, HMAC_TAG_LEN);
+		return NO_ERR;
+	}
+
+	int siglen = 0;
+	unsigned char *signature = Util::sign(client_key_pair_, (unsigned char *)hash, SHA256_DIGEST_LENGTH, &siglen);
+	if (signature == NULL)
+		return ERR_SIGN;
+	*sig = std::string((char *)signature, siglen);
+	delete[] signature;
+
+	return NO_ERR;
+}
 
 // assumption: desc is allocated
 err_t StorageBackend::ReadFileMeta(std::string hashname, 
@@ -30,47 +266,208 @@ err_t StorageBackend::ReadFileMeta(std::string hashname,
 					{
 	err_t ret = NO_ERR;
 
-	char *buf = new char[hashname.size()];
-	memcpy(buf, hashname.c_str(), hashname.size());
-	unsigned char* hash = Util::hash256(buf, hashname.size(), NULL);
-	
-	int siglen = 0;
-	unsigned char * signature = Util::sign(client_key_pair_, hash, SHA256_DIGEST_LENGTH, &siglen);
-	if (signature == NULL) {
-		return ERR_SIGN;
+	std::string signature;
+	ret = signRequest(hashname.c_str(), hashname.size(), &signature);
+	if (ret < 0)
+		return ret;
+
+	ret = middleware_->GetInodeName(hashname, recordname, (const unsigned char *)signature.c_str(), signature.size());
+	if (ret < 0)
+		return ret;
+
+	VersionIndex::entry_t e;
+	std::string checkpoint_hash;
+	ret = readInode(hashname, *recordname, &e, &checkpoint_hash);
+	if (ret < 0)
+		return ret;
+
+	*blockmap_hash = std::string(e.blockmap, HASHLEN_IN_BYTES);
+	*i_size = e.i_size;
+
+	indexHead(hashname, e, checkpoint_hash);
+
+	return unwrapKey(hashname, *recordname, std::string(e.wrapped_key, sizeof(e.wrapped_key)), aes_key);
+}
+
+err_t StorageBackend::ReadFileVersion(std::string hashname,
+					uint64_t version,
+					std::string *recordname,
+					uint64_t *i_size,
+					std::string *aes_key,
+					std::string *blockmap_hash)
+					{
+	VersionIndex::entry_t e;
+	if (!version_index_->Get(hashname, version, &e)) {
+		err_t ret = findVersion(hashname, version, &e);
+		if (ret < 0)
+			return ret;
 	}
 
-	delete[] buf;	
+	*recordname = std::string(e.recordname, HASHLEN_IN_BYTES);
+	*blockmap_hash = std::string(e.blockmap, HASHLEN_IN_BYTES);
+	*i_size = e.i_size;
 
+	return unwrapKey(hashname, *recordname, std::string(e.wrapped_key, sizeof(e.wrapped_key)), aes_key);
+}
 
-	ret = middleware_->GetInodeName(hashname, recordname, signature, siglen);
+err_t StorageBackend::readInode(std::string hashname, std::string recordname, VersionIndex::entry_t *e, std::string *checkpoint_hash) {
+	record_ref_t ref;
+	err_t ret = dcserver_->ViewRecord(hashname, recordname, MAX_INODE_RECORD_SIZE, &ref);
 	if (ret < 0)
 		return ret;
 
-	buf_desc_t desc;
-	alloc_buf_desc(&desc, MAX_INODE_RECORD_SIZE);
-	uint64_t read_size = 0;	
-	ret = dcserver_->ReadRecord(hashname, *recordname, &desc, &read_size);
+	//parse
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	record_view_t view;
+	ret = parse_record(ref.buf, ref.size, &arena, &view);
+	if (ret < 0 || view.header->prevhash_size() < 2 || view.payload_size < INODE_PAYLOAD_SIZE
+			|| recordname.size() != HASHLEN_IN_BYTES || view.header->prevhash(0).size() != HASHLEN_IN_BYTES
+			|| view.header->prevhash(1).size() != HASHLEN_IN_BYTES)
+		return ERR_IO;
+
+	memcpy(e->recordname, recordname.c_str(), HASHLEN_IN_BYTES);
+	memcpy(e->prev, view.header->prevhash(0).c_str(), HASHLEN_IN_BYTES);
+	memcpy(e->blockmap, view.header->prevhash(1).c_str(), HASHLEN_IN_BYTES);
+	e->timestamp = view.header->timestamp();
+	memcpy(&e->i_size, view.payload + INODE_ISIZE_OFFSET, sizeof(uint64_t));
+	memcpy(&e->version, view.payload + INODE_VERSION_OFFSET, sizeof(uint64_t));
+	memcpy(e->wrapped_key, view.payload + INODE_AES_KEY_OFFSET, sizeof(e->wrapped_key));
+	if (checkpoint_hash)
+		*checkpoint_hash = view.header->prevhash_size() > 2 ? view.header->prevhash(2) : "";
 
+	return NO_ERR;
+}
 
-	//parse
-	unsigned char encrypted_aes_key_buf[AES_KEY_LEN + AES_PAD_LEN];
+/* every version seen is indexed, so opening it again later needs no DC read */
+void StorageBackend::indexHead(std::string hashname, const VersionIndex::entry_t &head, std::string checkpoint_hash) {
+	// a head off the indexed chain (the file was rolled back or forked) invalidates what was indexed for it
+	VersionIndex::entry_t known;
+	if ((version_index_->Get(hashname, head.version, &known) && memcmp(known.recordname, head.recordname, HASHLEN_IN_BYTES) != 0)
+			|| (head.version > 0 && version_index_->Get(hashname, head.version - 1, &known)
+				&& memcmp(known.recordname, head.prev, HASHLEN_IN_BYTES) != 0)) {
+		Logger::log(WARNING, "StorageBackend: head of " + Util::binary_to_hex_string(hashname.c_str(), hashname.size())
+				+ " is not on the indexed chain, dropping its version index");
+		version_index_->Reset(hashname);
+	}
+	version_index_->Put(hashname, {head});
+
+	// the checkpoint the head carries is read once, when it is new
+	uint64_t seq = (head.version + 1) / CHECKPOINT_INTERVAL;
+	VersionIndex::checkpoint_entry_t cp;
+	if (seq > 0 && checkpoint_hash != "" && !(version_index_->FindCheckpoint(hashname, seq - 1, &cp) && cp.seq == seq - 1))
+		findCheckpoint(hashname, seq - 1, checkpoint_hash, &cp);
+}
 
-	capsule::CapsulePDU pdu;
-	pdu.ParseFromArray(desc.buf, read_size);
+/**
+ * The checkpoint with the smallest seq >= seq, from the index, or read walking back from the nearest indexed one
+ * above it (from head_checkpoint if there is none). Every checkpoint read is indexed, so each is read once.
+*/
+err_t StorageBackend::findCheckpoint(std::string hashname, uint64_t seq, std::string head_checkpoint, VersionIndex::checkpoint_entry_t *cp) {
+	VersionIndex::checkpoint_entry_t known;
+	bool found = version_index_->FindCheckpoint(hashname, seq, &known);
+	if (found && known.seq == seq) {
+		*cp = known;
+		return NO_ERR;
+	}
 
-	assert(pdu.header().prevhash_size() == 2);
-	*blockmap_hash = pdu.header().prevhash(1);
+	std::string next = found ? std::string(known.prev, HASHLEN_IN_BYTES) : head_checkpoint;
+	uint64_t above = found ? known.seq : UINT64_MAX;
+	std::vector<VersionIndex::checkpoint_entry_t> read;
+	while (next != "" && next != hashname && next.size() == HASHLEN_IN_BYTES) {
+		checkpoint_t c;
+		if (read_checkpoint(dcserver_, hashname, next, &c) < 0 || c.seq >= above
+				|| c.prev.size() != HASHLEN_IN_BYTES || c.inode_hash.size() != HASHLEN_IN_BYTES)
+			break; // not a checkpoint of this chain: seqs only go down
+		VersionIndex::checkpoint_entry_t e;
+		memcpy(e.recordname, next.c_str(), HASHLEN_IN_BYTES);
+		memcpy(e.prev, c.prev.c_str(), HASHLEN_IN_BYTES);
+		memcpy(e.inode, c.inode_hash.c_str(), HASHLEN_IN_BYTES);
+		e.seq = c.seq;
+		read.push_back(e);
+		if (c.seq <= seq)
+			break;
+		above = c.seq;
+		next = c.prev;
+	}
+	version_index_->PutCheckpoints(hashname, read);
+
+	// a checkpoint lost when it was written leaves a gap, the next one above then covers seq
+	for (auto it = read.rbegin(); it != read.rend(); it++) {
+		if (it->seq >= seq) {
+			*cp = *it;
+			return NO_ERR;
+		}
+	}
+	if (!found)
+		return ERR_NOT_FOUND;
+	*cp = known;
+	return NO_ERR;
+}
 
-	memcpy(i_size, pdu.payload_in_transit().data(), sizeof(uint64_t));
-	memcpy(encrypted_aes_key_buf, pdu.payload_in_transit().data() + INODE_AES_KEY_OFFSET, AES_KEY_LEN + AES_PAD_LEN);
-	
-	std::string encrypted_aes_key = std::string((char *)encrypted_aes_key_buf, AES_KEY_LEN + AES_PAD_LEN);
-	middleware_->DecryptAESKey(*recordname, encrypted_aes_key, aes_key, NULL, 0);
+err_t StorageBackend::findVersion(std::string hashname, uint64_t version, VersionIndex::entry_t *e) {
+	std::string signature;
+	err_t ret = signRequest(hashname.c_str(), hashname.size(), &signature);
+	if (ret < 0)
+		return ret;
 
+	std::string latest;
+	ret = middleware_->GetInodeName(hashname, &latest, (const unsigned char *)signature.c_str(), signature.size());
+	if (ret < 0)
+		return ret;
+	if (latest.size() == 0)
+		return ERR_NOT_FOUND;
 
-	
-	return ret;
+	VersionIndex::entry_t cur;
+	std::string cp_hash;
+	ret = readInode(hashname, latest, &cur, &cp_hash);
+	if (ret < 0)
+		return ret;
+	indexHead(hashname, cur, cp_hash);
+	if (version > cur.version)
+		return ERR_NOT_FOUND;
+
+	// checkpoint seq names the inode record of version (seq + 1) * CHECKPOINT_INTERVAL - 2, the first at or after version
+	if (cur.version - version >= CHECKPOINT_INTERVAL) {
+		VersionIndex::checkpoint_entry_t cp;
+		VersionIndex::entry_t start;
+		if (findCheckpoint(hashname, (version + 1) / CHECKPOINT_INTERVAL, cp_hash, &cp) == NO_ERR
+				&& readInode(hashname, std::string(cp.inode, HASHLEN_IN_BYTES), &start, NULL) == NO_ERR
+				&& start.version == (cp.seq + 1) * CHECKPOINT_INTERVAL - 2 && start.version >= version && start.version < cur.version)
+			cur = start;
+	}
+
+	std::vector<VersionIndex::entry_t> walked(1, cur);
+	while (cur.version > version) {
+		std::string prev(cur.prev, HASHLEN_IN_BYTES);
+		VersionIndex::entry_t next;
+		if (!version_index_->Get(hashname, cur.version - 1, &next) || memcmp(next.recordname, cur.prev, HASHLEN_IN_BYTES) != 0) {
+			ret = readInode(hashname, prev, &next, NULL);
+			if (ret < 0)
+				return ret;
+			if (next.version != cur.version - 1)
+				return ERR_IO;
+			walked.push_back(next);
+		}
+		cur = next;
+	}
+	version_index_->Put(hashname, walked);
+
+	*e = cur;
+	return NO_ERR;
+}
+
+err_t StorageBackend::unwrapKey(std::string hashname, std::string recordname, std::string wrapped_key, std::string *aes_key) {
+	// the wrapped key usually survives inode version changes; only unwrap on a miss
+	if (key_cache_->Get(hashname, wrapped_key, aes_key))
+		return NO_ERR;
+
+	err_t ret = middleware_->DecryptAESKey(recordname, wrapped_key, aes_key, NULL, 0);
+	if (ret < 0)
+		return ret;
+	key_cache_->Put(hashname, wrapped_key, *aes_key);
+
+	return NO_ERR;
 }
 
 err_t StorageBackend::ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
@@ -84,25 +481,199 @@ err_t StorageBackend::ReadRecord(std::string dcname, std::string recordname, buf
 	return NO_ERR;
 }
 
-err_t StorageBackend::ReadRecordData(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
-	buf_desc_t full_desc;
-	uint64_t full_read_size;
+err_t StorageBackend::ReadBlockMap(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+	std::vector<char> hashes;
+	blockmap_chain_t chain;
+
+	err_t ret = read_blockmap(dcserver_, dcname, recordname, &hashes, &chain);
+	if (ret < 0)
+		return ret;
 
-	alloc_buf_desc(&full_desc, desc->size + RECORD_HEADER_SIZE + SPARE_HASH_SPACE);
-	err_t ret = dcserver_->ReadRecord(dcname, recordname, &full_desc, &full_read_size);
+	*read_size = std::min((uint64_t)hashes.size(), desc->size);
+	memcpy(desc->buf, hashes.data(), *read_size);
+
+	return NO_ERR;
+}
+
+err_t StorageBackend::ReadRecordData(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+	record_ref_t ref;
+	err_t ret = dcserver_->ViewRecord(dcname, recordname, desc->size + RECORD_HEADER_SIZE + SPARE_HASH_SPACE, &ref);
 	if (ret < 0)
 		return ret;
 	
-	capsule::CapsulePDU pdu;
-	pdu.ParseFromArray(full_desc.buf, full_read_size);
-	*read_size = pdu.payload_in_transit().size();
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	record_view_t view;
+	ret = parse_record(ref.buf, ref.size, &arena, &view);
+	if (ret < 0)
+		return ret;
+	*read_size = view.payload_size;
 
 	if (*read_size > desc->size)
 		return ERR_BUF_TOO_SMALL;
 	
-	memcpy(desc->buf, pdu.payload_in_transit().data(), *read_size);
+	memcpy(desc->buf, view.payload, *read_size);
+
+	return NO_ERR;
+}
+
+void StorageBackend::initConvergent() {
+	// blocks written by earlier mounts are only readable with the same secret, so it is not kept in /tmp
+	std::string path = Util::load_convergence_secret();
+	if (path.size() == 0 && getenv("HOME"))
+		path = std::string(getenv("HOME")) + "/" + CONVERGENCE_SECRET_FILE;
+	if (path.size() == 0 || load_convergence_secret(path, convergence_secret_) < 0) {
+		Logger::log(WARNING, "StorageBackend: cannot read or create the convergence secret at " + path + ", convergent encryption disabled");
+		return;
+	}
+	convergent_ = true;
+
+	dedup_index_ = new DedupIndex(DEDUP_INDEX_DIR, DEDUP_INDEX_ENTRIES);
+	if (dedup_index_->Load() < 0) {
+		Logger::log(WARNING, "StorageBackend: cannot load the dedup index, duplicate blocks are uploaded again");
+		delete dedup_index_;
+		dedup_index_ = NULL;
+	}
+
+	// separate wrap key so the HMAC key is never used as an AES key
+	unsigned char wrap_key[HMAC_TAG_LEN];
+	const char label[] = "dcfs convergent wrap key";
+	Util::hmac256(convergence_secret_, HMAC_KEY_LEN, label, sizeof(label), wrap_key);
+	memcpy(convergence_wrap_key_, wrap_key, AES_KEY_LEN);
+	OPENSSL_cleanse(wrap_key, HMAC_TAG_LEN);
+}
+
+err_t StorageBackend::SealBlock(std::string dcname, std::string aes_key, const char *block, uint64_t size, buf_desc_t *desc) {
+	int outlen = 0;
+	unsigned char digest[HASHLEN_IN_BYTES];
+
+	if (!convergent_) {
+		allocPayload(desc, size + AES_PAD_LEN);
+		if (Util::encrypt_symmetric_hash256((unsigned char *)aes_key.c_str(), NULL, (unsigned char *)block, size, (unsigned char *)desc->buf, &outlen, NULL, 0, digest) <= 0) {
+			ReleaseBlock(desc);
+			return ERR_CRYPTO;
+		}
+		desc->size = outlen;
+		desc->payload_hash = std::string((char *)digest, HASHLEN_IN_BYTES);
+		return NO_ERR;
+	}
+
+	unsigned char block_key[HMAC_TAG_LEN];
+	if (!Util::hmac256(convergence_secret_, HMAC_KEY_LEN, block, size, block_key))
+		return ERR_HASH;
+
+	// zero IV: both the wrapped key and the ciphertext are deterministic for a given plaintext
+	unsigned char wrapped_key[CDATA_WRAPPED_KEY_LEN];
+	if (Util::encrypt_symmetric(convergence_wrap_key_, NULL, block_key, AES_KEY_LEN, wrapped_key, &outlen) <= 0) {
+		OPENSSL_cleanse(block_key, HMAC_TAG_LEN);
+		return ERR_CRYPTO;
+	}
+	assert(outlen == CDATA_WRAPPED_KEY_LEN);
+
+	desc->convergent = true;
+	std::string content_id((char *)wrapped_key, CDATA_WRAPPED_KEY_LEN);
+	if (dedup_index_ && dedup_index_->Find(dcname, content_id, &desc->recordname)) {
+		OPENSSL_cleanse(block_key, HMAC_TAG_LEN);
+		desc->buf = NULL;
+		desc->size = 0;
+		return NO_ERR;
+	}
 
-	dealloc_buf_desc(&full_desc);
+	allocPayload(desc, CDATA_WRAPPED_KEY_LEN + size + AES_PAD_LEN);
+	memcpy(desc->buf, wrapped_key, CDATA_WRAPPED_KEY_LEN);
+	int ret = Util::encrypt_symmetric_hash256(block_key, NULL, (unsigned char *)block, size, (unsigned char *)desc->buf + CDATA_WRAPPED_KEY_LEN, &outlen,
+					wrapped_key, CDATA_WRAPPED_KEY_LEN, digest);
+	OPENSSL_cleanse(block_key, HMAC_TAG_LEN);
+	if (ret <= 0) {
+		ReleaseBlock(desc);
+		return ERR_CRYPTO;
+	}
+	desc->size = CDATA_WRAPPED_KEY_LEN + outlen;
+	desc->payload_hash = std::string((char *)digest, HASHLEN_IN_BYTES);
+
+	return NO_ERR;
+}
+
+void StorageBackend::ReleaseBlock(buf_desc_t *desc) {
+	if (desc->buf)
+		middleware_->FreePayload(desc->buf);
+	desc->buf = NULL;
+	desc->size = 0;
+}
+
+void StorageBackend::allocPayload(buf_desc_t *desc, uint64_t size) {
+	desc->buf = middleware_->AllocPayload(size);
+	desc->size = size;
+}
+
+err_t StorageBackend::ReadBlock(std::string dcname, std::string recordname, std::string aes_key, buf_desc_t *desc, uint64_t *read_size) {
+	record_ref_t ref;
+	err_t ret = dcserver_->ViewRecord(dcname, recordname, desc->size + CDATA_WRAPPED_KEY_LEN + RECORD_HEADER_SIZE + SPARE_HASH_SPACE, &ref);
+	if (ret < 0)
+		return ret;
+
+	return openBlock(ref, aes_key, desc, read_size);
+}
+
+err_t StorageBackend::ReadBlocks(std::string dcname, const std::vector<std::string> &recordnames, std::string aes_key,
+				std::vector<buf_desc_t> *descs, std::vector<uint64_t> *read_sizes) {
+	std::vector<record_ref_t> refs(recordnames.size()); // in place until waited for
+	std::vector<err_t> submitted(recordnames.size());
+	read_sizes->assign(recordnames.size(), 0);
+
+	for (size_t i = 0; i < recordnames.size(); i++) {
+		submitted[i] = dcserver_->SubmitRead(dcname, recordnames[i],
+				(*descs)[i].size + CDATA_WRAPPED_KEY_LEN + RECORD_HEADER_SIZE + SPARE_HASH_SPACE, &refs[i]);
+	}
+
+	err_t ret = NO_ERR;
+	for (size_t i = 0; i < recordnames.size(); i++) {
+		err_t block_ret = submitted[i];
+		if (block_ret == NO_ERR)
+			block_ret = dcserver_->WaitRead(&refs[i]);
+		if (block_ret == NO_ERR)
+			block_ret = openBlock(refs[i], aes_key, &(*descs)[i], &(*read_sizes)[i]);
+		if (block_ret < 0 && ret == NO_ERR)
+			ret = block_ret;
+	}
+
+	return ret;
+}
+
+/* decrypts straight out of the record, in the page cache when the DC server is a local segment store */
+err_t StorageBackend::openBlock(const record_ref_t &ref, std::string aes_key, buf_desc_t *desc, uint64_t *read_size) {
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	record_view_t view;
+	err_t ret = parse_record(ref.buf, ref.size, &arena, &view);
+	if (ret < 0)
+		return ret;
+
+	unsigned char *key = (unsigned char *)aes_key.c_str();
+	const char *data = view.payload;
+	uint64_t data_size = view.payload_size;
+
+	unsigned char block_key[AES_KEY_LEN + AES_PAD_LEN];
+	int outlen = 0;
+	if (view.header->msgtype() == record_type_to_string(CDATABLOCK)) {
+		if (!convergent_ || data_size < CDATA_WRAPPED_KEY_LEN) // convergence secret is needed to unwrap
+			ret = ERR_CRYPTO;
+		else if (Util::decrypt_symmetric(convergence_wrap_key_, NULL, (unsigned char *)data, CDATA_WRAPPED_KEY_LEN, block_key, &outlen) <= 0)
+			ret = ERR_CRYPTO;
+		key = block_key;
+		data += CDATA_WRAPPED_KEY_LEN;
+		data_size -= CDATA_WRAPPED_KEY_LEN;
+	}
+
+	if (ret == NO_ERR && data_size > desc->size)
+		ret = ERR_BUF_TOO_SMALL;
+
+	if (ret == NO_ERR && Util::decrypt_symmetric(key, NULL, (unsigned char *)data, data_size, (unsigned char *)desc->buf, &outlen) <= 0)
+		ret = ERR_CRYPTO;
+	OPENSSL_cleanse(block_key, sizeof(block_key));
+	if (ret < 0)
+		return ret;
+	*read_size = outlen;
 
 	return NO_ERR;
 }
@@ -111,36 +682,119 @@ err_t StorageBackend::WriteRecord(std::string dcname, std::vector<buf_desc_t> *d
 	if (descs->size() == 0)
 		return NO_ERR;
 
-	size_t len = dcname.length() + inode_recordname.length() + aes_key.length();
-	for (auto desc : *descs) {
-		len += desc.size;
-	}
+	if (group_commit_us_ > 0)
+		return groupCommit(dcname, descs, inode_recordname, aes_key);
 
-	char *args = new char[len];
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	err_t ret = digest_modify_args(dcname, descs, inode_recordname, aes_key, digest);
+	if (ret < 0)
+		return ret;
 
-	size_t offset = 0;
-	memcpy(args + offset, dcname.c_str(), dcname.length());
-	offset += dcname.length();
-	for (size_t i = 0; i < descs->size(); i++) {
-		memcpy(args + offset, descs->at(i).buf, descs->at(i).size);
-		offset += descs->at(i).size;
-	}
-	memcpy(args + offset, inode_recordname.c_str(), inode_recordname.length());
-	offset += inode_recordname.length();
-	memcpy(args + offset, aes_key.c_str(), aes_key.length());
-	
-	unsigned char* hash = Util::hash256((void*)args, len, NULL);
+	std::string signature;
+	ret = signDigest(digest, &signature);
+	if (ret < 0)
+		return ret;
 
-	int siglen = 0;
-	unsigned char * signature = Util::sign(client_key_pair_, hash, SHA256_DIGEST_LENGTH, &siglen);
-	if (signature == NULL) {
-		return ERR_SIGN;
+	ret = middleware_->Modify(dcname, descs, inode_recordname, aes_key, (const unsigned char *)signature.c_str(), signature.size());
+	if (ret < 0)
+		return ret;
+
+	afterModify(dcname, descs);
+
+	return NO_ERR;
+}
+
+void StorageBackend::afterModify(std::string dcname, std::vector<buf_desc_t> *descs) {
+	// newly uploaded convergent records can now be referenced by later writes
+	if (dedup_index_ && dcname.size() == HASHLEN_IN_BYTES) {
+		std::vector<DedupIndex::entry_t> entries;
+		std::unordered_set<std::string> seen; // duplicates within the batch share one record
+		for (auto &desc : *descs) {
+			if (!desc.convergent || desc.size == 0 || desc.recordname.size() != HASHLEN_IN_BYTES
+					|| !seen.insert(desc.recordname).second)
+				continue;
+			DedupIndex::entry_t e;
+			memcpy(e.content_id, desc.buf, CDATA_WRAPPED_KEY_LEN);
+			memcpy(e.dcname, dcname.c_str(), HASHLEN_IN_BYTES);
+			memcpy(e.recordname, desc.recordname.c_str(), HASHLEN_IN_BYTES);
+			entries.push_back(e);
+		}
+		// not indexed, the records are merely uploaded again by later writes
+		if (dedup_index_->Insert(entries) < 0)
+			Logger::log(WARNING, "StorageBackend: failed to index convergent records");
 	}
+}
 
+/**
+ * Leader/follower group commit. The first writer to find no leader waits up to group_commit_us_
+ * (or until GROUP_COMMIT_MAX_BATCH writers queued up), takes the queue and commits it with one ModifyBatch.
+ * Writers arriving meanwhile, and those whose file already has a request in the batch, queue up for the next leader.
+*/
+err_t StorageBackend::groupCommit(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key) {
+	commit_waiter_t self;
+	self.req.dcname = dcname;
+	self.req.descs = descs;
+	self.req.inode_hash = inode_recordname;
+	self.req.aes_key = aes_key;
+
+	std::unique_lock<std::mutex> lk(gc_mutex_);
+	gc_queue_.push_back(&self);
+	if (gc_queue_.size() >= GROUP_COMMIT_MAX_BATCH)
+		gc_cv_.notify_all(); // a full batch does not wait out the window
+
+	while (!self.done) {
+		if (gc_leader_) {
+			gc_cv_.wait(lk);
+			continue;
+		}
+
+		gc_leader_ = true;
+		gc_cv_.wait_for(lk, std::chrono::microseconds(group_commit_us_), 
+				[this] { return gc_queue_.size() >= GROUP_COMMIT_MAX_BATCH; });
+		// one request per file: a later one chains to the head the earlier one leaves, so it waits for the next batch
+		std::vector<commit_waiter_t *> batch, rest;
+		std::unordered_set<std::string> dcnames;
+		for (auto w : gc_queue_) {
+			if (batch.size() < GROUP_COMMIT_MAX_BATCH && dcnames.insert(w->req.dcname).second)
+				batch.push_back(w);
+			else
+				rest.push_back(w);
+		}
+		gc_queue_.swap(rest);
+		lk.unlock();
+
+		commitBatch(&batch);
+
+		lk.lock();
+		for (auto w : batch)
+			w->done = true;
+		gc_leader_ = false;
+		gc_cv_.notify_all();
+	}
 
-	delete[] args;	
+	return self.req.ret;
+}
 
-	return middleware_->Modify(dcname, descs, inode_recordname, aes_key, signature, siglen);
+void StorageBackend::commitBatch(std::vector<commit_waiter_t *> *batch) {
+	err_t ret;
+	std::vector<modify_req_t> reqs;
+	for (auto w : *batch)
+		reqs.push_back(w->req);
+
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	std::string signature;
+	ret = digest_modify_batch(&reqs, digest);
+	if (ret == NO_ERR)
+		ret = signDigest(digest, &signature);
+	if (ret == NO_ERR)
+		ret = middleware_->ModifyBatch(&reqs, (const unsigned char *)signature.c_str(), signature.size());
+
+	for (size_t i = 0; i < batch->size(); i++) {
+		commit_waiter_t *w = (*batch)[i];
+		w->req.ret = (ret < 0) ? ret : reqs[i].ret;
+		if (w->req.ret == NO_ERR)
+			afterModify(w->req.dcname, w->req.descs);
+	}
 }	
 
 err_t StorageBackend::CreateNewFile(std::string *hashname, std::string *aes_key) {
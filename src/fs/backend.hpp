@@ -3,18 +3,41 @@
 
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
 #include <filesystem>
 
 #include <stdint.h>
 #include <cassert>
 #include <thread>
 #include <openssl/evp.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <linux/io_uring.h>
 
 #include "const.hpp"
 #include "dir.hpp"
+#include "key_cache.hpp"
+#include "dedup_index.hpp"
+#include "version_index.hpp"
+#include "record_signer.hpp"
+#include "group_sync.hpp"
+#include "netem.hpp"
+#include "mid_index.hpp"
+#include "mid_ipc.hpp"
 
 #include "dc-client/dc_client.hpp"
 #include "util/crypto.hpp"
+#include "util/options.hpp"
+#include "util/logging.hpp"
 /* local file but xx style*/
 
 enum record_type {
@@ -23,6 +46,9 @@ enum record_type {
 	INODE,
 	BLOCKMAP,
 	DATABLOCK,
+	CDATABLOCK, // convergent-encrypted data block
+	BLOCKMAP_DELTA, // changed blockmap entries since the previous blockmap record
+	CHECKPOINT, // heads of the inode/blockmap/data chains every CHECKPOINT_INTERVAL inode versions
 };
 
 
@@ -38,6 +64,12 @@ inline std::string record_type_to_string(record_type type) {
 			return "BLOCKMAP";
 		case DATABLOCK:
 			return "DATABLOCK";
+		case CDATABLOCK:
+			return "CDATABLOCK";
+		case BLOCKMAP_DELTA:
+			return "BLOCKMAP_DELTA";
+		case CHECKPOINT:
+			return "CHECKPOINT";
 		default:
 			assert(0);
 	}
@@ -47,12 +79,45 @@ inline std::string record_type_to_string(record_type type) {
 #define RECORD_HEADER_SIZE (256)
 #define MAX_INODE_RECORD_SIZE (1024) 
 #define MAX_BLOCKMAP_RECORD_SIZE (1024 + 32 * BLOCKMAP_COVER)
+#define RECORD_ARENA_BLOCK_SIZE (1024) // stack block backing the arena of one record header
 
 
 
 #define INODE_ISIZE_OFFSET 0
 #define INODE_AES_KEY_OFFSET 8
-#define INODE_PAYLOAD_SIZE (8 + AES_KEY_LEN + AES_PAD_LEN)
+#define INODE_VERSION_OFFSET (8 + AES_KEY_LEN + AES_PAD_LEN) // 0 for the first inode record of a DC
+#define INODE_PAYLOAD_SIZE (INODE_VERSION_OFFSET + 8)
+
+/** CDATABLOCK payload
+ * WRAPPED BLOCK KEY (AES_KEY_LEN + AES_PAD_LEN) -- block key encrypted under the convergence wrap key
+ * DATA -- block encrypted under the block key
+*/
+#define CDATA_WRAPPED_KEY_LEN (AES_KEY_LEN + AES_PAD_LEN)
+
+/** BLOCKMAP_DELTA payload
+ * NBLOCKS (8) -- length of the whole blockmap in blocks after this delta
+ * ENTRIES -- block index (8) and data record hash (HASHLEN_IN_BYTES) of each changed block
+ * prevhash(0) is the previous blockmap record (full or delta), prevhash(1) the latest data record
+ * and prevhash(2) the full BLOCKMAP record the delta chain starts from.
+*/
+#define BLOCKMAP_DELTA_NBLOCKS_OFFSET 0
+#define BLOCKMAP_DELTA_ENTRY_OFFSET 8
+#define BLOCKMAP_DELTA_ENTRY_SIZE (8 + HASHLEN_IN_BYTES)
+#define MAX_BLOCKMAP_DELTA_RECORD_SIZE (1024 + BLOCKMAP_DELTA_ENTRY_OFFSET + BLOCKMAP_DELTA_ENTRY_SIZE * BLOCKMAP_COVER)
+
+/** CHECKPOINT payload
+ * SEQ (8) -- checkpoint number, checkpoint SEQ summarizes inode version (SEQ + 1) * CHECKPOINT_INTERVAL - 1
+ * VERSION (8) -- version of the summarized inode record
+ * ISIZE (8) -- its file size
+ * prevhash(0) is the previous checkpoint (the DC meta record for the first one), then the heads of the chains at
+ * that version: the previous inode record, the blockmap record, the latest data record and the full BLOCKMAP record.
+ * The inode record of VERSION and every later one carry the latest checkpoint as prevhash(2).
+*/
+#define CHECKPOINT_SEQ_OFFSET 0
+#define CHECKPOINT_VERSION_OFFSET 8
+#define CHECKPOINT_ISIZE_OFFSET 16
+#define CHECKPOINT_PAYLOAD_SIZE 24
+#define MAX_CHECKPOINT_RECORD_SIZE (1024)
 
 namespace fs = std::filesystem;
 
@@ -68,23 +133,95 @@ struct buf_desc_t {
 	char *buf;
 	uint64_t size;
 	uint64_t file_offset; // used in WriteRecord
+	bool convergent = false; // used in WriteRecord, buf is a CDATABLOCK payload
+	std::string recordname; // used in WriteRecord. in: if set, reference this existing record instead of writing buf. out: data record name
+	std::string payload_hash; // SHA-256 of buf if already computed (empty otherwise); the middleware checks it against buf
 };
 
 void alloc_buf_desc(buf_desc_t *desc, uint64_t size);
 void dealloc_buf_desc(buf_desc_t *desc);
 
+/**
+ * Record borrowed from a DC server (see DCServer::ViewRecord). buf stays valid while pin is held,
+ * even past the DC server itself; copies of the ref share the pin.
+*/
+struct record_ref_t {
+	const char *buf = NULL;
+	uint64_t size = 0;
+	std::shared_ptr<const void> pin;
+};
+
+/**
+ * CapsulePDU parsed without copying its payload: the header is parsed onto an arena,
+ * header_hash and payload point into the parsed buffer. Valid while both the buffer and the arena live.
+*/
+struct record_view_t {
+	const capsule::CapsuleHeader *header;
+	const char *header_hash;
+	uint64_t header_hash_size;
+	const char *payload;
+	uint64_t payload_size;
+};
+
+err_t parse_record(const char *buf, uint64_t size, google::protobuf::Arena *arena, record_view_t *view);
+
+/**
+ * Digest of Modify arguments, authenticated by the client and verified by the middleware.
+ * dcname || per block (payload_hash if present, else buf) || recordname || inode_recordname || aes_key
+ * payload_hash only saves the client a second pass over buf; the middleware rehashes buf before trusting it.
+*/
+err_t digest_modify_args(std::string dcname, const std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key, unsigned char *digest);
+
+/**
+ * One file's modification within a ModifyBatch; fields are as in DCFSMid::Modify.
+ * ret is the per-file result filled in by the middleware.
+*/
+struct modify_req_t {
+	std::string dcname;
+	std::vector<buf_desc_t> *descs;
+	std::string inode_hash;
+	std::string aes_key;
+	err_t ret = NO_ERR;
+};
+
+/* digest authenticated by a ModifyBatch signature: over the digest_modify_args digest of every request, in order */
+err_t digest_modify_batch(const std::vector<modify_req_t> *reqs, unsigned char *digest);
+
+/**
+ * Request authentication
+ * Every request carries (sig, siglen) computed over the digest of its arguments.
+ * - strict mode: sig is an ECDSA signature by the client key (one sign + one verify per request).
+ * - session mode (default): the client runs a single ECDSA-signed OpenSession handshake,
+ *   and the following requests carry an HMAC-SHA256 tag under the session MAC key.
+*/
 class DCFSMid {
 public:
+	virtual ~DCFSMid() {}
+
+	// Establish an authenticated session. Only the handshake is ECDSA-signed (over the digest of nonce).
+	virtual err_t OpenSession(std::string nonce, // in
+					std::string *mac_key, // out
+					const unsigned char *sig, size_t siglen) // sig-in
+					= 0;
+
 	virtual err_t CreateNew(std::string *hashname, // out
 					std::string *aes_key, // out
 					const unsigned char *sig, size_t siglen) // sig-in
 					= 0;
 	virtual err_t Modify(std::string hashname, // in
-				const std::vector<buf_desc_t> *desc_vec, // in
+				std::vector<buf_desc_t> *desc_vec, // in/out, recordname of each block is filled in
 				std::string inode_hash, // in
 				std::string aes_key, // in
 				const unsigned char *sig, size_t siglen) = 0;
 
+	/**
+	 * Group commit: modifications of different files verified with one signature and written together,
+	 * data records of all files pipelined. Each file keeps its own hash chains; at most one request per file.
+	 * Returns an error only if the batch is rejected as a whole, per-file results are in reqs[i].ret.
+	*/
+	virtual err_t ModifyBatch(std::vector<modify_req_t> *reqs, // in/out
+				const unsigned char *sig, size_t siglen) = 0;
+
 	// client expect MW gives the record name of the latest inode record.
 	virtual err_t GetInodeName(std::string hashname, // in
 				std::string *recordname, // out
@@ -99,10 +236,18 @@ public:
 					std::string *aes_key, // out
 					const unsigned char *sig, size_t siglen) = 0; // sig-in	
 
+	/**
+	 * Buffers for the payloads passed to Modify. A middleware in another process hands out memory it shares
+	 * with the client, so that data blocks reach it without a copy. Any buffer works with any middleware.
+	*/
+	virtual char *AllocPayload(uint64_t size) { return new char[size]; }
+	virtual void FreePayload(char *buf) { delete[] buf; }
 };
 
 class DCServer {
 public:
+	virtual ~DCServer() {}
+
 	/**
 	 * Read a record from DCServer using hashname
 	 * will be used by clients/MW
@@ -114,26 +259,121 @@ public:
 	 * will be used by MW
 	*/
 	virtual err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) = 0;
+
+	/**
+	 * Read a record in place where the server keeps it in memory (DCServerSeg maps its segments):
+	 * ref borrows the server's copy instead of receiving one. Records larger than max_size are refused.
+	 * The default reads into a buffer owned by ref.
+	*/
+	virtual err_t ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+		std::shared_ptr<char> buf(new char[max_size], std::default_delete<char[]>());
+		buf_desc_t desc;
+		desc.buf = buf.get();
+		desc.size = max_size;
+		uint64_t read_size;
+		err_t ret = ReadRecord(dcname, recordname, &desc, &read_size);
+		if (ret < 0)
+			return ret;
+
+		ref->buf = buf.get();
+		ref->size = read_size;
+		ref->pin = buf;
+		return NO_ERR;
+	}
+
+	/**
+	 * Pipelined write: SubmitWrite sends a record without waiting for its ack, WaitWrite collects the ack.
+	 * desc can be released as soon as SubmitWrite returns. Every submitted record must be waited for exactly once.
+	 * The default falls back to a synchronous WriteRecord.
+	*/
+	virtual err_t SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+		return WriteRecord(dcname, recordname, desc);
+	}
+	virtual err_t WaitWrite(std::string dcname, std::string recordname) {
+		return NO_ERR;
+	}
+
+	/**
+	 * Asynchronous read: SubmitRead starts reading a record into ref, WaitRead returns once ref holds it.
+	 * ref must stay in place until then. Every read SubmitRead accepted must be waited for exactly once.
+	 * The default reads synchronously in SubmitRead, through ViewRecord.
+	*/
+	virtual err_t SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+		return ViewRecord(dcname, recordname, max_size, ref);
+	}
+	virtual err_t WaitRead(record_ref_t *ref) {
+		return NO_ERR;
+	}
+};
+
+/**
+ * Where a blockmap record sits in its delta chain.
+*/
+struct blockmap_chain_t {
+	std::string latest_data_hash; // prevhash(1) of the blockmap record
+	std::string full_hash; // full BLOCKMAP record the chain starts from
+	uint64_t deltas = 0; // BLOCKMAP_DELTA records on top of full_hash
+	uint64_t delta_bytes = 0; // their payload size
+};
+
+/**
+ * Rebuild the flat blockmap (HASHLEN_IN_BYTES per block) named by recordname,
+ * following BLOCKMAP_DELTA records back to the full BLOCKMAP they start from.
+ * Shared by the middleware and the client.
+*/
+err_t read_blockmap(DCServer *dcserver, std::string dcname, std::string recordname, std::vector<char> *hashes, blockmap_chain_t *chain);
+
+/**
+ * Parsed CHECKPOINT record.
+*/
+struct checkpoint_t {
+	uint64_t seq;
+	uint64_t version;
+	uint64_t isize;
+	std::string prev; // previous checkpoint record
+	std::string inode_hash; // inode record of version - 1
+	std::string blockmap_hash;
+	std::string data_hash;
+	std::string full_blockmap_hash;
 };
 
+/**
+ * Checkpoints are stored under their header hash like any other record, and are found from
+ * prevhash(2) of an inode record, then back through their own prevhash(0) chain.
+ * Shared by the middleware and the client.
+*/
+err_t read_checkpoint(DCServer *dcserver, std::string dcname, std::string recordname, checkpoint_t *cp);
+
 
 class DCFSMidSim : public DCFSMid {
 public:
 
-	DCFSMidSim(DCServer *dcserver, EC_KEY *client_key_pair) : dcserver_(dcserver), client_key_pair_(client_key_pair) {
-		Util::generate_ECDSA_key(&middlewareWriterKey_);
-		Util::generate_symmetric_key(symmetric_middleware_key_);
+	DCFSMidSim(DCServer *dcserver, EC_KEY *client_key_pair, bool strict_auth, std::string index_dir, record_sign_mode sign_mode) : 
+			dcserver_(dcserver), index_(index_dir), client_key_pair_(client_key_pair), strict_auth_(strict_auth), session_open_(false),
+			sign_mode_(sign_mode), signer_(NULL) {
+		if (loadKeys(index_dir) < 0) { // files written now cannot be read back after a restart
+			Util::generate_ECDSA_key(&middlewareWriterKey_);
+			Util::generate_symmetric_key(symmetric_middleware_key_);
+		}
+		if (sign_mode_ != RECORD_SIGN_OFF)
+			signer_ = new RecordSigner(middlewareWriterKey_, RECORD_SIGN_WORKERS);
+		loadIndex();
+	}
+	~DCFSMidSim() {
+		delete signer_;
 	}
 	// DCFSMidSim(DCServer *dcserver);
 
+	err_t OpenSession(std::string nonce, std::string *mac_key, const unsigned char *sig, size_t siglen);
 	err_t CreateNew(std::string *hashname, std::string *aes_key, const unsigned char *sig, size_t siglen);
 	err_t GetRoot(std::string *hashname, std::string *recordname, const unsigned char *sig, size_t siglen);
  	err_t GetInodeName(std::string hashname, std::string *recordname, const unsigned char *sig, size_t siglen);
 	err_t Modify(std::string dcname, 
-			const std::vector<buf_desc_t> *descs, 
+			std::vector<buf_desc_t> *descs, 
 			std::string inode_hash, 
 			std::string aes_key, 
 			const unsigned char *sig, size_t siglen);
+	err_t ModifyBatch(std::vector<modify_req_t> *reqs, const unsigned char *sig, size_t siglen);
 	err_t DecryptAESKey(std::string recordname, 
 					std::string encrypted_key, 
 					std::string *aes_key, 
@@ -141,36 +381,185 @@ public:
 	
 private:
 	struct InodeRecord {
-		InodeRecord() : isize(0), blockmap_hash("") {}
+		InodeRecord() : isize(0), version(0), blockmap_hash(""), checkpoint_hash("") {}
 
 		uint64_t isize;
+		uint64_t version;
 		std::string blockmap_hash;
+		std::string checkpoint_hash; // latest CHECKPOINT record, "" before the first
 		char key[AES_KEY_LEN];
 	};
 
 	struct BlockMapRecord {
 		BlockMapRecord() : hash_to_latest_data_block("") {}
 
-		std::vector<std::string> data_hashes;
+		std::vector<char> data_hashes; // flat, HASHLEN_IN_BYTES per data block
 		std::string hash_to_latest_data_block;
+		blockmap_chain_t chain; // deltas written since the last full blockmap
+	};
+
+	/**
+	 * Parsed state of the latest inode/blockmap records of a DataCapsule, kept after Modify writes them.
+	 * An entry is valid only while inode_recordname is the latest one in index_.
+	*/
+	struct FileState {
+		std::string inode_recordname;
+		InodeRecord inode;
+		BlockMapRecord blockmap;
+	};
+
+	bool takeFileState(std::string dcname, std::string inode_recordname, FileState *state); // removes the entry
+	void putFileState(std::string dcname, std::string inode_recordname, FileState *state);
+	err_t loadFileState(std::string dcname, std::string inode_recordname, FileState *state); // read back from DC server
+
+	/**
+	 * Progress of one file's Modify. Files of a batch advance through the write phases together:
+	 * data records -> blockmap records -> inode records, each phase pipelined across files.
+	*/
+	struct modify_ctx_t {
+		modify_req_t *req;
+		std::string latest_inode_hash;
+		FileState state;
+		std::vector<std::pair<uint64_t, std::string>> new_data_blocks;
+		std::string data_block_hashname;
+		std::string new_blockmap_hashname;
+		std::string new_inode_hashname;
+		bool prepared = false; // new inode record logged in index_
+	};
+	struct pending_write_t {
+		modify_ctx_t *ctx;
+		std::string recordname;
+	};
+	struct staged_write_t {
+		modify_ctx_t *ctx;
+		std::string recordname;
+		buf_desc_t record_desc;
+		uint64_t sig_offset;
+	};
+	/**
+	 * Records of one modifyFiles call on their way to the DC server:
+	 * composed records waiting for their signature, signed together (up to MID_WRITE_WINDOW at a time) by signer_,
+	 * then records in flight.
+	*/
+	struct write_pipe_t {
+		std::vector<staged_write_t> staged;
+		std::deque<pending_write_t> outstanding; // oldest first
 	};
 
+	err_t modifyFiles(std::vector<modify_req_t> *reqs);
+	err_t beginModify(modify_ctx_t *ctx);
+	err_t writeDataRecords(modify_ctx_t *ctx, write_pipe_t *pipe);
+	err_t writeBlockMap(modify_ctx_t *ctx, write_pipe_t *pipe);
+	err_t writeInode(modify_ctx_t *ctx, write_pipe_t *pipe);
+	void finishModify(modify_ctx_t *ctx);
+	err_t writeCheckpoint(modify_ctx_t *ctx);
+
+	// takes record_desc over; a record with a signature slot is staged until signed
+	err_t submitWrite(modify_ctx_t *ctx, std::string recordname, buf_desc_t *record_desc, uint64_t sig_offset, write_pipe_t *pipe);
+	void signStaged(write_pipe_t *pipe); // sign and send the staged records, failures go to their file
+	void drainWrites(write_pipe_t *pipe); // wait for all pipelined writes, failures go to their file
+
+	// sign a record outside of modifyFiles
+	err_t signRecord(buf_desc_t *record_desc, uint64_t sig_offset, std::string hashname);
+
+	void loadIndex(); // load the durable index and resolve updates interrupted by a restart
+	err_t loadKeys(std::string dir); // middleware keys kept with the index, created on first use
+
+
+	// verify sig over digest; HMAC in session mode, ECDSA otherwise
+	bool verifyRequest(const unsigned char *digest, const unsigned char *sig, size_t siglen);
+	err_t checkPayloadHashes(const std::vector<buf_desc_t> *descs); // a client-supplied payload_hash must be that of buf
 
 	err_t composeRecord(record_type type, // in
 					std::vector<std::string> *hashes, // in, hashes this record will point
 					buf_desc_t *in_desc, // in, data to be written
 					buf_desc_t *out_desc, // out, composed record
-					std::string *hashname); // out, hash of the record
+					std::string *hashname, // out, hash of the record
+					uint64_t *sig_offset); // out, signature slot for signer_ in out_desc->buf, 0 if the record is not to be signed
 
 	DCServer *dcserver_;
-	std::map<std::string, std::string> index_; // dcname to latest inode recordname
-	std::pair<std::string, std::string> root_; // hashname and recordname of root directory
+	MidIndex index_; // dcname to latest inode recordname, and root directory
+	std::unordered_map<std::string, FileState> state_cache_; // dcname to latest FileState
+	std::mutex state_cache_mutex_;
 	EC_KEY *middlewareWriterKey_;
 	EC_KEY *client_key_pair_; //hardcoded for now
 	unsigned char symmetric_middleware_key_[AES_KEY_LEN];
+
+	const bool strict_auth_; // per-request ECDSA only; sessions are refused
+	bool session_open_;
+	unsigned char session_mac_key_[HMAC_KEY_LEN];
+
+	const record_sign_mode sign_mode_; // writer signatures on composed records
+	RecordSigner *signer_; // NULL if sign_mode_ is RECORD_SIGN_OFF
 };
 
 
+/**
+ * Middleware running in a separate process (dcfs-midd), reached over shared memory (see mid_ipc.hpp).
+ * Payloads from AllocPayload live in the shared arena and are passed by offset; other payload buffers
+ * are copied into the arena for the duration of the call. When the arena is exhausted AllocPayload falls
+ * back to the heap, and a Modify that cannot stage its copies fails with ERR_NO_SPACE once no other
+ * request is in flight to free arena space.
+*/
+class DCFSMidIPC : public DCFSMid {
+public:
+	DCFSMidIPC(std::string sock_path, EC_KEY *client_key_pair);
+	~DCFSMidIPC();
+
+	bool Connected() { return shm_ != NULL; }
+
+	err_t OpenSession(std::string nonce, std::string *mac_key, const unsigned char *sig, size_t siglen);
+	err_t CreateNew(std::string *hashname, std::string *aes_key, const unsigned char *sig, size_t siglen);
+	err_t GetRoot(std::string *hashname, std::string *recordname, const unsigned char *sig, size_t siglen);
+	err_t GetInodeName(std::string hashname, std::string *recordname, const unsigned char *sig, size_t siglen);
+	err_t Modify(std::string dcname, 
+			std::vector<buf_desc_t> *descs, 
+			std::string inode_hash, 
+			std::string aes_key, 
+			const unsigned char *sig, size_t siglen);
+	err_t ModifyBatch(std::vector<modify_req_t> *reqs, const unsigned char *sig, size_t siglen);
+	err_t DecryptAESKey(std::string recordname, 
+					std::string encrypted_key, 
+					std::string *aes_key, 
+					const unsigned char *sig, size_t siglen);
+
+	char *AllocPayload(uint64_t size);
+	void FreePayload(char *buf);
+
+private:
+	err_t connect(std::string sock_path, EC_KEY *client_key_pair);
+	void disconnect();
+
+	// run one request: args are copied into the slot (or the arena), the reply comes back in *reply
+	err_t call(uint32_t opcode, const std::string &args, std::string *reply);
+	void completionLoop(); // wakes requesters that went to sleep, detects a dead daemon
+
+	// payloads are passed as arena offsets, buffers outside the arena are staged in *copies
+	err_t putDescs(MidIpcWriter *w, std::vector<buf_desc_t> *descs, std::vector<uint64_t> *copies);
+	bool getDescs(MidIpcReader *r, std::vector<buf_desc_t> *descs);
+	void freeCopies(std::vector<uint64_t> *copies);
+	bool inArena(const char *buf) { return buf >= arena_ && buf < arena_ + MID_IPC_ARENA_SIZE; }
+
+	int sock_;
+	int req_efd_; // daemon waits on it
+	int cpl_efd_; // completionLoop waits on it
+	mid_ipc_shm *shm_; // NULL if not connected
+	char *arena_;
+	MidIpcArena arena_alloc_;
+
+	std::mutex m_; // slots, inflight_, dead_
+	std::condition_variable slot_cv_; // a slot was released
+	std::condition_variable done_cv_[MID_IPC_SLOTS];
+	std::condition_variable arena_cv_; // arena space was released
+	std::vector<uint32_t> free_slots_;
+	uint64_t inflight_;
+	bool dead_;
+	std::mutex sq_mutex_; // single producer of the submission ring
+
+	std::thread *completion_thread_;
+	std::atomic<bool> end_signal_;
+};
+
 class DCServerSim : public DCServer {
 public:
 	DCServerSim(std::string mnt_point): mnt_point_(mnt_point) {
@@ -184,6 +573,189 @@ private:
 	std::string mnt_point_;
 };
 
+/**
+ * Local DC server storing records in a log of large segment files under dir instead of one file per record.
+ * Records are appended to the active segment; an in-memory index (dcname, recordname) -> (segment, offset, size)
+ * serves reads with one pread. A sealed segment gets a hint file with its index entries, so a restart loads
+ * the hints and only scans what was appended after them. Segments are not compacted: a rewritten record
+ * leaves its previous copy behind.
+ * Appended bytes never change, so ViewRecord hands out views into a read-only mapping of the segment,
+ * which lives as long as the views do.
+ * A write is acked as durability asks (see GroupSync); SubmitWrite appends at once and leaves the wait
+ * for the sync to WaitWrite, so a pipelined batch of records shares one.
+*/
+class DCServerSeg : public DCServer {
+public:
+	DCServerSeg(std::string dir, durability_mode durability = DURABILITY_NONE, uint64_t sync_window_us = SYNC_WINDOW_US);
+	~DCServerSeg();
+
+	err_t ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size);
+	err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t WaitWrite(std::string dcname, std::string recordname);
+	err_t ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+
+protected:
+	struct record_hdr { // precedes each record in a segment
+		uint32_t magic;
+		uint32_t size; // of the record
+		uint64_t checksum; // over the names and the record
+		char dcname[HASHLEN_IN_BYTES];
+		char recordname[HASHLEN_IN_BYTES];
+	};
+	struct hint_entry {
+		char dcname[HASHLEN_IN_BYTES];
+		char recordname[HASHLEN_IN_BYTES];
+		uint64_t offset; // of the record, past its header
+		uint64_t size;
+	};
+	struct location {
+		uint32_t seg; // in segs_
+		uint32_t size;
+		uint64_t offset;
+	};
+	struct mapping {
+		const char *base;
+		uint64_t len;
+		~mapping();
+	};
+	struct segment {
+		uint32_t id;
+		int fd;
+		std::shared_ptr<mapping> map; // created on first view, guarded by map_m_
+	};
+
+	/**
+	 * An append is reserve (under write_m_), writing the header and record at offset, then publish.
+	 * Appends may be written out of order, so sealing the active segment first waits for quiesce.
+	*/
+	err_t reserve(const std::string &dcname, const std::string &recordname, uint64_t size, uint32_t *seg, uint64_t *offset);
+	void publish(uint32_t seg, uint64_t offset, const record_hdr &h);
+	virtual void quiesce() {} // returns once every reserved append is published; caller holds write_m_
+	static void fillHeader(record_hdr *h, const std::string &dcname, const std::string &recordname, const char *buf, uint64_t size);
+	err_t locate(const std::string &dcname, const std::string &recordname, location *loc, uint32_t *seg_id, int *fd);
+	std::string segmentPath(uint32_t id);
+
+	std::vector<segment> segs_; // the last one is active
+	std::shared_mutex m_; // guards segs_, index_ and dcs_
+	std::mutex write_m_; // serializes reservations, guards tail_
+	GroupSync sync_; // syncs the active segment; reserve syncs a segment before sealing it
+
+private:
+	err_t append(const std::string &dcname, const std::string &recordname, const buf_desc_t *desc, uint64_t *ticket);
+	bool syncActive();
+	err_t load();
+	uint64_t loadSegment(uint32_t seg, uint64_t size, std::vector<hint_entry> *entries);
+	err_t openSegment(uint32_t id, bool create);
+	err_t writeHint(uint32_t seg);
+	std::shared_ptr<mapping> mapSegment(uint32_t seg, uint64_t min_len);
+	void index(uint32_t seg, const hint_entry &e);
+
+	const std::string dir_;
+	std::unordered_map<std::string, location> index_; // dcname + recordname -> location
+	std::unordered_set<std::string> dcs_; // dcnames with a first record
+	std::mutex map_m_;
+
+	uint64_t tail_; // end of the active segment
+	std::vector<hint_entry> active_hints_; // index entries of the active segment
+	std::mutex hint_m_; // guards active_hints_
+
+	std::unordered_multimap<std::string, uint64_t> tickets_; // by recordname, submitted and not waited for
+	std::mutex tickets_m_;
+};
+
+/**
+ * DCServerSeg whose asynchronous reads and writes go through an io_uring (raw syscalls, no liburing).
+ * Submissions are queued on the ring and handed to the kernel in batches: when URING_SUBMIT_BATCH are
+ * queued, or when a caller waits. Waiting callers reap the completions and publish written records.
+ * Records are staged in a pool of URING_BUFS buffers registered with the ring. Without direct, a read
+ * views the mapped segment as ViewRecord does; with direct, reads bypass the page cache (O_DIRECT)
+ * and the ref pins the buffer the record was read into.
+ * The synchronous methods are DCServerSeg's.
+*/
+class DCServerUring : public DCServerSeg {
+public:
+	DCServerUring(std::string dir, bool direct, durability_mode durability = DURABILITY_NONE, uint64_t sync_window_us = SYNC_WINDOW_US);
+	~DCServerUring();
+
+	err_t SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t WaitWrite(std::string dcname, std::string recordname);
+	err_t SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+	err_t WaitRead(record_ref_t *ref);
+
+protected:
+	void quiesce();
+
+private:
+	struct buf_pool {
+		char *mem; // URING_BUFS * URING_BUF_SIZE, aligned for O_DIRECT
+		std::vector<uint32_t> free_slots;
+		std::mutex m;
+		~buf_pool();
+	};
+	struct staging {
+		char *buf;
+		int slot; // in pool_, -1 for a heap buffer
+		std::shared_ptr<const void> pin;
+	};
+	struct op_t {
+		bool write;
+		err_t ret = NO_ERR;
+		bool done = false;
+		staging st;
+		uint64_t len; // bytes to transfer; a read may come back shorter, down to min_len
+		uint64_t min_len;
+		uint32_t seg; // write: where the record goes
+		uint64_t offset;
+		record_hdr hdr;
+		const char *data = NULL; // read: the record in st.buf
+		uint64_t size = 0;
+		uint64_t ticket = 0; // write: in sync_, once written
+	};
+
+	int setupRing();
+	bool getStaging(uint64_t len, staging *st);
+	void admit();
+	void queue(op_t *op, int fd, uint64_t offset);
+	void submit();
+	void flush();
+	err_t wait(op_t *op);
+	bool reap(std::unique_lock<std::mutex> &lock, const std::function<bool()> &done);
+	void complete(op_t *op, int res);
+	int directFd(uint32_t seg, uint32_t seg_id);
+
+	int ring_fd_;
+	void *sq_ring_, *cq_ring_;
+	size_t sq_ring_size_, cq_ring_size_;
+	struct io_uring_sqe *sqes_;
+	size_t sqes_size_;
+	unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+	unsigned *cq_head_, *cq_tail_, *cq_mask_;
+	struct io_uring_cqe *cqes_;
+	unsigned sq_entries_, cq_entries_;
+	unsigned to_submit_; // queued, not yet handed to the kernel
+	bool fixed_; // pool_ is registered with the ring
+	std::mutex ring_m_; // guards the submission queue
+
+	std::shared_ptr<buf_pool> pool_; // shared with the refs pinning its buffers
+
+	bool direct_; // guarded by direct_m_
+	std::vector<int> direct_fds_; // by segment, opened on first read
+	std::mutex direct_m_;
+
+	std::unordered_multimap<std::string, op_t *> writes_; // by recordname, until waited for
+	std::unordered_map<record_ref_t *, op_t *> reads_;
+	unsigned inflight_; // submitted ops not completed, at most cq_entries_
+	unsigned inflight_writes_;
+	std::mutex ops_m_; // guards the op tables, counters, and op results
+	std::condition_variable ops_cv_;
+	bool reaping_; // a caller is reaping completions, guarded by ops_m_
+	// guarded by ops_m_: the scan on load stops at the hole a failed write leaves, so no write past it is acked
+	std::set<std::pair<uint32_t, uint64_t>> unwritten_; // (seg, offset) of submitted writes not completed
+	bool hole_;
+	std::pair<uint32_t, uint64_t> hole_at_; // first failed write
+};
+
 class DCServerNet : public DCServer {
 public:
 	/* Server IP address, port, and other configs are defined in dc_config.hpp.
@@ -194,11 +766,60 @@ public:
 	~DCServerNet();
 	err_t ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size);
 	err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t WaitWrite(std::string dcname, std::string recordname);
+	// records are viewed in DCClient's responses, pinned by the ref
+	err_t ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+	err_t SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+	err_t WaitRead(record_ref_t *ref);
 
 private:
+	struct pending_read {
+		DCFuture get;
+		std::string recordname;
+		uint64_t max_size;
+	};
+
+	err_t viewResponse(const DCFuture &get, const std::string &recordname, uint64_t max_size, record_ref_t *ref);
+
 	DCClient *dcclient_;
 	std::thread *listen_thread_;
 	std::atomic<bool> end_signal_;	
+	std::unordered_map<const record_ref_t *, pending_read> reads_;
+	std::mutex reads_m_;
+};
+
+/**
+ * DC server behind an emulated network (see NetemLink): wraps another DC server, which it owns, and holds
+ * every request until its response would have arrived. The wrapped server serves the request at once,
+ * so its own latency overlaps the emulated one. Pipelined writes and asynchronous reads are held in
+ * WaitWrite and WaitRead, so those in flight together overlap their round trips.
+*/
+class DCServerNetem : public DCServer {
+public:
+	DCServerNetem(DCServer *dcserver, const netem_config &config);
+	~DCServerNetem();
+	err_t ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size);
+	err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+	err_t SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc);
+	err_t WaitWrite(std::string dcname, std::string recordname);
+	err_t SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref);
+	err_t WaitRead(record_ref_t *ref);
+
+private:
+	struct pending_write {
+		NetemLink::clock::time_point done; // the ack arrives
+		bool lost;
+	};
+
+	err_t finishRead(NetemLink::clock::time_point start, err_t ret, uint64_t size);
+
+	DCServer *dcserver_;
+	NetemLink link_;
+	std::unordered_multimap<std::string, pending_write> writes_; // by recordname, submitted and not waited for
+	std::unordered_map<const record_ref_t *, NetemLink::clock::time_point> reads_; // submitted at
+	std::mutex m_;
 };
 
 /**
@@ -211,15 +832,59 @@ private:
 class StorageBackend {
 public:
 	StorageBackend(std::string mnt_point) {
+		bool strict_auth = Util::load_strict_auth();
+		record_sign_mode sign_mode;
+		if (!parse_record_sign_mode(Util::load_record_signing(), &sign_mode)) {
+			Logger::log(WARNING, "StorageBackend: unknown record_signing " + Util::load_record_signing() + ", using batch");
+			sign_mode = RECORD_SIGN_BATCH;
+		}
+
 		Util::generate_ECDSA_key(&client_key_pair_);
+		key_cache_ = new KeyCache(KEY_CACHE_ENTRIES);
+		version_index_ = new VersionIndex(VERSION_INDEX_DIR, VERSION_INDEX_FILES);
+		dedup_index_ = NULL;
+		convergent_ = false;
+		if (Util::load_convergent())
+			initConvergent();
+		group_commit_us_ = Util::load_group_commit_us();
+		gc_leader_ = false;
 		dcserver_ = new DCServerNet();
-		//dcserver_ = new DCServerSim(mnt_point);
-		middleware_ = new DCFSMidSim(dcserver_, client_key_pair_);
+		//dcserver_ = new DCServerSeg(SEGMENT_DIR);
+		std::string netem = Util::load_netem();
+		if (netem.size() > 0) {
+			netem_config config;
+			if (parse_netem_config(netem, &config))
+				dcserver_ = new DCServerNetem(dcserver_, config);
+			else
+				Logger::log(WARNING, "StorageBackend: cannot parse netem " + netem + ", running without it");
+		}
+		middleware_ = NULL;
+		std::string mid_socket = Util::load_middleware_socket();
+		if (mid_socket.size() > 0) {
+			// the middleware keys are kept out of this process: never fall back to an in-process middleware
+			DCFSMidIPC *ipc = new DCFSMidIPC(mid_socket, client_key_pair_);
+			if (!ipc->Connected()) {
+				Logger::log(ERROR, "StorageBackend: middleware daemon at " + mid_socket + " unreachable");
+				delete ipc;
+				return;
+			}
+			middleware_ = ipc;
+		} else {
+			middleware_ = new DCFSMidSim(dcserver_, client_key_pair_, strict_auth, MID_INDEX_DIR, sign_mode);
+		}
+
+		if (!strict_auth && openSession() < 0)
+			Logger::log(WARNING, "StorageBackend: failed to open middleware session, falling back to per-request signatures");
 	}
 
+	bool Ready() { return middleware_ != NULL; } // false if the middleware could not be reached
+
 	~StorageBackend() {
-		delete dcserver_;
 		delete middleware_;
+		delete dcserver_;
+		delete key_cache_;
+		delete version_index_;
+		delete dedup_index_;
 	}
 	/** 
 	 * Ask DCFS middleware to give file metadata necessary for later file operations e.g. list of blockmap hashes
@@ -230,6 +895,17 @@ public:
 				std::string *aes_key,
 				std::string *blockmap_hash);
 
+	/**
+	 * Same as ReadFileMeta for a past version of the file; version 0 is its first InodeRecord.
+	 * Served from the version index, or found through the checkpoints of the file and indexed.
+	*/
+	err_t ReadFileVersion(std::string hashname,
+				uint64_t version,
+				std::string *recordname,
+				uint64_t *i_size,
+				std::string *aes_key,
+				std::string *blockmap_hash);
+
 	/**
 	 * Read a record from DCServer using recordname
 	*/
@@ -240,6 +916,36 @@ public:
 	*/
 	err_t ReadRecordData(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size);
 
+	/**
+	 * Read a blockmap (full or delta) as a flat array of data record hashes, truncated to desc->size.
+	*/
+	err_t ReadBlockMap(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size);
+
+	/**
+	 * Read a data record and decrypt it into buf (buf->size >= block size + AES_PAD_LEN).
+	 * DATABLOCK records are decrypted with the per-file key, CDATABLOCK records with their own wrapped block key.
+	*/
+	err_t ReadBlock(std::string dcname, std::string recordname, std::string aes_key, buf_desc_t *desc, uint64_t *read_size);
+
+	/**
+	 * ReadBlock for several data records, all submitted before any is waited for, so that
+	 * a DC server reading asynchronously (DCServerUring) overlaps them. Returns the first error.
+	*/
+	err_t ReadBlocks(std::string dcname, const std::vector<std::string> &recordnames, std::string aes_key,
+				std::vector<buf_desc_t> *descs, std::vector<uint64_t> *read_sizes);
+
+	/**
+	 * Encrypt a plaintext block into a new WriteRecord descriptor (desc->buf is allocated here).
+	 * In convergent mode, the key is derived from the block content, and a block already known to exist
+	 * in the file's DataCapsule (dcname) comes back as a reference (desc->recordname set, no payload).
+	*/
+	err_t SealBlock(std::string dcname, std::string aes_key, const char *block, uint64_t size, buf_desc_t *desc);
+
+	/**
+	 * Release a descriptor filled in by SealBlock. Its buffer comes from the middleware (see DCFSMid::AllocPayload).
+	*/
+	void ReleaseBlock(buf_desc_t *desc);
+
 	/**
 	 * Ask DCFS middleware to write a contiguous block to the file identified by hashname.
 	 * Middleware will handle the details of writing to the correct DataCapsule.
@@ -262,11 +968,68 @@ public:
 
 
 private:
+	/**
+	 * Handshake with the middleware; on success, later requests are authenticated by HMAC
+	*/
+	err_t openSession();
+
+	/**
+	 * Authenticate request arguments for the middleware.
+	 * HMAC tag if a session is open, ECDSA signature otherwise.
+	*/
+	err_t signRequest(const void *args, size_t len, std::string *sig);
+	err_t signDigest(const unsigned char *digest, std::string *sig);
+
+	void allocPayload(buf_desc_t *desc, uint64_t size);
+	err_t openBlock(const record_ref_t &ref, std::string aes_key, buf_desc_t *desc, uint64_t *read_size);
+
+	/**
+	 * Version index maintenance. readInode parses an InodeRecord into an index entry, and the latest checkpoint it carries.
+	 * indexHead indexes a head read from the middleware and the checkpoint it carries.
+	 * findVersion walks the prevhash chain back to version, starting from the checkpoint covering it (looked up by seq
+	 * in the index, at most CHECKPOINT_INTERVAL versions away), and indexes what it passed.
+	*/
+	err_t readInode(std::string hashname, std::string recordname, VersionIndex::entry_t *e, std::string *checkpoint_hash);
+	void indexHead(std::string hashname, const VersionIndex::entry_t &head, std::string checkpoint_hash);
+	err_t findCheckpoint(std::string hashname, uint64_t seq, std::string head_checkpoint, VersionIndex::checkpoint_entry_t *cp);
+	err_t findVersion(std::string hashname, uint64_t version, VersionIndex::entry_t *e);
+	err_t unwrapKey(std::string hashname, std::string recordname, std::string wrapped_key, std::string *aes_key);
+
+	struct commit_waiter_t {
+		modify_req_t req;
+		bool done = false; // guarded by gc_mutex_
+	};
+	void afterModify(std::string dcname, std::vector<buf_desc_t> *descs);
+	err_t groupCommit(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key);
+	void commitBatch(std::vector<commit_waiter_t *> *batch);
+
+	/**
+	 * Convergent encryption (opt-in, --convergent)
+	 * block key = HMAC(convergence secret, plaintext)[0:AES_KEY_LEN].
+	 * The secret is created on first use at --convergence_secret (default $HOME/CONVERGENCE_SECRET_FILE), so later
+	 * mounts can read the blocks; clients sharing a dedup domain must be provisioned with the same one.
+	*/
+	void initConvergent();
+
 	DCFSMid *middleware_;
 	DCServer *dcserver_;
 	EC_KEY *client_key_pair_;	
+	std::string session_mac_key_; // empty if no session
+	KeyCache *key_cache_; // unwrapped per-file keys, skips DecryptAESKey on revalidation
+	VersionIndex *version_index_; // InodeRecord chain of each file, for versioned reads
+
+	bool convergent_; // convergence secret loaded
+	DedupIndex *dedup_index_; // NULL unless convergent mode; without it, duplicates are uploaded again
+
+	uint64_t group_commit_us_; // batching window of WriteRecord, 0 = no group commit
+	std::mutex gc_mutex_;
+	std::condition_variable gc_cv_;
+	std::vector<commit_waiter_t *> gc_queue_;
+	bool gc_leader_;
+	unsigned char convergence_secret_[HMAC_KEY_LEN];
+	unsigned char convergence_wrap_key_[AES_KEY_LEN];
 };
 
 
-void init_backend(StorageBackend **backend);
+err_t init_backend(StorageBackend **backend);
 #endif
\ No newline at end of file
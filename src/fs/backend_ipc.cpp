@@ -0,0 +1,411 @@
+#include <cstring>
+#include <chrono>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "backend.hpp"
+#include "util/logging.hpp"
+
+#define NO_ARENA_OFFSET UINT64_MAX // descriptor without payload (reference to an existing record)
+
+DCFSMidIPC::DCFSMidIPC(std::string sock_path, EC_KEY *client_key_pair) :
+		sock_(-1), req_efd_(-1), cpl_efd_(-1), shm_(NULL), arena_(NULL), arena_alloc_(MID_IPC_ARENA_SIZE),
+		inflight_(0), dead_(false), completion_thread_(NULL), end_signal_(false) {
+	for (uint32_t i = 0; i < MID_IPC_SLOTS; i++)
+		free_slots_.push_back(MID_IPC_SLOTS - 1 - i);
+
+	if (connect(sock_path, client_key_pair) < 0) {
+		disconnect();
+		return;
+	}
+	completion_thread_ = new std::thread(&DCFSMidIPC::completionLoop, this);
+}
+
+DCFSMidIPC::~DCFSMidIPC() {
+	if (completion_thread_) {
+		end_signal_ = true;
+		uint64_t one = 1;
+		ssize_t n = write(cpl_efd_, &one, sizeof(one));
+		(void)n;
+		completion_thread_->join();
+		delete completion_thread_;
+	}
+	disconnect();
+}
+
+err_t DCFSMidIPC::connect(std::string sock_path, EC_KEY *client_key_pair) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (sock_path.size() >= sizeof(addr.sun_path))
+		return ERR_NO_CONN;
+	memcpy(addr.sun_path, sock_path.c_str(), sock_path.size());
+
+	sock_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock_ < 0 || ::connect(sock_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		Logger::log(ERROR, "DCFSMidIPC: cannot connect to " + sock_path);
+		return ERR_NO_CONN;
+	}
+
+	// the daemon verifies our requests against this key
+	unsigned char *key = NULL;
+	int key_len = i2o_ECPublicKey(client_key_pair, &key);
+	if (key_len <= 0)
+		return ERR_CRYPTO;
+	mid_ipc_hello hello = { MID_IPC_MAGIC, MID_IPC_VERSION, NO_ERR, 0, (uint64_t)key_len };
+	err_t ret = mid_ipc_write_full(sock_, &hello, sizeof(hello));
+	if (ret == NO_ERR)
+		ret = mid_ipc_write_full(sock_, key, key_len);
+	OPENSSL_free(key);
+	if (ret < 0)
+		return ret;
+
+	int fds[3];
+	ret = mid_ipc_recv_fds(sock_, &hello, sizeof(hello), fds, 3);
+	if (ret < 0) {
+		if (hello.ret == ERR_BUSY) // sent without a shared region
+			Logger::log(ERROR, "DCFSMidIPC: " + sock_path + " is serving another client");
+		return ret;
+	}
+	int memfd = fds[0];
+	req_efd_ = fds[1];
+	cpl_efd_ = fds[2];
+	if (hello.magic != MID_IPC_MAGIC || hello.version != MID_IPC_VERSION || hello.ret < 0 || hello.region_size != MID_IPC_REGION_SIZE) {
+		Logger::log(ERROR, "DCFSMidIPC: handshake rejected by " + sock_path);
+		close(memfd);
+		return ERR_NO_CONN;
+	}
+
+	void *region = mmap(NULL, MID_IPC_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, memfd, 0);
+	close(memfd);
+	if (region == MAP_FAILED)
+		return ERR_NO_SPACE;
+	shm_ = (mid_ipc_shm *)region;
+	arena_ = (char *)region + MID_IPC_ARENA_OFFSET;
+	if (shm_->magic != MID_IPC_MAGIC || shm_->nslots != MID_IPC_SLOTS || shm_->arena_offset != MID_IPC_ARENA_OFFSET) {
+		Logger::log(ERROR, "DCFSMidIPC: unexpected shared region layout");
+		return ERR_NO_CONN;
+	}
+
+	Logger::log(INFO, "DCFSMidIPC: connected to middleware daemon at " + sock_path);
+	return NO_ERR;
+}
+
+void DCFSMidIPC::disconnect() {
+	if (shm_)
+		munmap(shm_, MID_IPC_REGION_SIZE);
+	shm_ = NULL;
+	arena_ = NULL;
+	for (int fd : {sock_, req_efd_, cpl_efd_}) {
+		if (fd >= 0)
+			close(fd);
+	}
+	sock_ = req_efd_ = cpl_efd_ = -1;
+}
+
+err_t DCFSMidIPC::call(uint32_t opcode, const std::string &args, std::string *reply) {
+	if (!shm_)
+		return ERR_NO_CONN;
+
+	uint32_t idx;
+	{
+		std::unique_lock<std::mutex> lock(m_);
+		slot_cv_.wait(lock, [this] { return !free_slots_.empty() || dead_; });
+		if (dead_)
+			return ERR_NO_CONN;
+		idx = free_slots_.back();
+		free_slots_.pop_back();
+		inflight_++;
+	}
+
+	mid_ipc_slot *slot = &shm_->slots[idx];
+	uint64_t args_offset = MID_IPC_ARGS_INLINE;
+	char *args_buf = slot->args;
+	uint64_t cap = MID_IPC_SLOT_ARGS_SIZE;
+	err_t ret = NO_ERR;
+	if (args.size() > cap) {
+		if (!arena_alloc_.Alloc(args.size(), &args_offset)) {
+			ret = ERR_NO_SPACE;
+			goto release;
+		}
+		args_buf = arena_ + args_offset;
+		cap = args.size();
+	}
+
+	memcpy(args_buf, args.c_str(), args.size());
+	slot->opcode = opcode;
+	slot->ret = NO_ERR;
+	slot->args_offset = args_offset;
+	slot->args_size = args.size();
+	slot->args_cap = cap;
+	slot->sleeping.store(0, std::memory_order_relaxed);
+	slot->state.store(SLOT_SUBMITTED, std::memory_order_release);
+	{
+		std::lock_guard<std::mutex> lock(sq_mutex_);
+		mid_ipc_push(&shm_->sq, idx, req_efd_);
+	}
+
+	{
+		// most requests finish within the spin window; otherwise sleep until completionLoop wakes us
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(mid_ipc_spin_us());
+		while (slot->state.load(std::memory_order_acquire) != SLOT_DONE && std::chrono::steady_clock::now() < deadline)
+			;
+		if (slot->state.load(std::memory_order_acquire) != SLOT_DONE) {
+			std::unique_lock<std::mutex> lock(m_);
+			slot->sleeping.store(1, std::memory_order_seq_cst);
+			done_cv_[idx].wait(lock, [this, slot] { return slot->state.load(std::memory_order_seq_cst) == SLOT_DONE || dead_; });
+			if (slot->state.load(std::memory_order_acquire) != SLOT_DONE) {
+				// the daemon is gone, the slot and its arena args are never reused
+				inflight_--;
+				arena_cv_.notify_all();
+				return ERR_NO_CONN;
+			}
+		}
+	}
+
+	ret = slot->ret;
+	if (reply)
+		reply->assign(args_buf, std::min(slot->args_size, cap));
+
+release:
+	if (args_offset != MID_IPC_ARGS_INLINE)
+		arena_alloc_.Free(args_offset);
+	slot->state.store(SLOT_FREE, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		free_slots_.push_back(idx);
+		inflight_--;
+		arena_cv_.notify_all();
+	}
+	slot_cv_.notify_one();
+	return ret;
+}
+
+void DCFSMidIPC::completionLoop() {
+	mid_ipc_ring *cq = &shm_->cq;
+
+	while (!end_signal_) {
+		uint32_t idx;
+		while (mid_ipc_pop(cq, &idx)) {
+			if (idx >= MID_IPC_SLOTS)
+				continue;
+			std::lock_guard<std::mutex> lock(m_);
+			done_cv_[idx].notify_one();
+		}
+
+		cq->waiting.store(1, std::memory_order_seq_cst);
+		if (cq->head.load(std::memory_order_seq_cst) != cq->tail.load(std::memory_order_seq_cst)) {
+			cq->waiting.store(0, std::memory_order_relaxed);
+			continue;
+		}
+
+		struct pollfd pfds[2] = { { cpl_efd_, POLLIN, 0 }, { sock_, POLLIN, 0 } };
+		int n = poll(pfds, 2, -1);
+		cq->waiting.store(0, std::memory_order_relaxed);
+		if (n < 0)
+			continue;
+		if (pfds[0].revents & POLLIN) {
+			uint64_t cnt;
+			ssize_t r = read(cpl_efd_, &cnt, sizeof(cnt));
+			(void)r;
+		}
+		if (pfds[1].revents) {
+			// the daemon never writes after the handshake: readable means closed
+			Logger::log(ERROR, "DCFSMidIPC: middleware daemon disconnected");
+			std::lock_guard<std::mutex> lock(m_);
+			dead_ = true;
+			for (auto &cv : done_cv_)
+				cv.notify_all();
+			slot_cv_.notify_all();
+			break;
+		}
+	}
+}
+
+char *DCFSMidIPC::AllocPayload(uint64_t size) {
+	uint64_t offset;
+	if (shm_ && arena_alloc_.Alloc(size, &offset))
+		return arena_ + offset;
+	return new char[size];
+}
+
+void DCFSMidIPC::FreePayload(char *buf) {
+	if (shm_ && inArena(buf)) {
+		arena_alloc_.Free(buf - arena_);
+		std::lock_guard<std::mutex> lock(m_); // pairs with the wait in putDescs
+		arena_cv_.notify_all();
+	} else {
+		delete[] buf;
+	}
+}
+
+err_t DCFSMidIPC::putDescs(MidIpcWriter *w, std::vector<buf_desc_t> *descs, std::vector<uint64_t> *copies) {
+	w->PutU64(descs->size());
+	for (auto &desc : *descs) {
+		uint64_t offset = NO_ARENA_OFFSET;
+		if (desc.buf && inArena(desc.buf)) {
+			offset = desc.buf - arena_;
+		} else if (desc.buf) {
+			std::unique_lock<std::mutex> lock(m_);
+			while (!arena_alloc_.Alloc(desc.size, &offset)) {
+				if (inflight_ == 0 || dead_)
+					return ERR_NO_SPACE;
+				arena_cv_.wait(lock);
+			}
+			lock.unlock();
+			memcpy(arena_ + offset, desc.buf, desc.size);
+			copies->push_back(offset);
+		}
+		w->PutU64(desc.file_offset);
+		w->PutU32(desc.convergent);
+		w->PutString(desc.recordname);
+		w->PutString(desc.payload_hash);
+		w->PutU64(offset);
+		w->PutU64(desc.buf ? desc.size : 0);
+	}
+	return NO_ERR;
+}
+
+bool DCFSMidIPC::getDescs(MidIpcReader *r, std::vector<buf_desc_t> *descs) {
+	uint64_t n;
+	if (!r->GetU64(&n) || n != descs->size())
+		return false;
+	for (auto &desc : *descs) {
+		if (!r->GetString(&desc.recordname))
+			return false;
+	}
+	return true;
+}
+
+void DCFSMidIPC::freeCopies(std::vector<uint64_t> *copies) {
+	for (uint64_t offset : *copies)
+		arena_alloc_.Free(offset);
+	if (copies->size() > 0) {
+		std::lock_guard<std::mutex> lock(m_);
+		arena_cv_.notify_all();
+	}
+}
+
+err_t DCFSMidIPC::OpenSession(std::string nonce, std::string *mac_key, const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	MidIpcWriter w(&args);
+	w.PutString(nonce);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = call(MID_OPEN_SESSION, args, &reply);
+	if (ret < 0)
+		return ret;
+	MidIpcReader r(reply.c_str(), reply.size());
+	return r.GetString(mac_key) ? NO_ERR : ERR_IO;
+}
+
+err_t DCFSMidIPC::CreateNew(std::string *hashname, std::string *aes_key, const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	MidIpcWriter w(&args);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = call(MID_CREATE_NEW, args, &reply);
+	if (ret < 0)
+		return ret;
+	MidIpcReader r(reply.c_str(), reply.size());
+	return (r.GetString(hashname) && r.GetString(aes_key)) ? NO_ERR : ERR_IO;
+}
+
+err_t DCFSMidIPC::GetRoot(std::string *hashname, std::string *recordname, const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	MidIpcWriter w(&args);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = call(MID_GET_ROOT, args, &reply);
+	if (ret < 0)
+		return ret;
+	MidIpcReader r(reply.c_str(), reply.size());
+	return (r.GetString(hashname) && r.GetString(recordname)) ? NO_ERR : ERR_IO;
+}
+
+err_t DCFSMidIPC::GetInodeName(std::string hashname, std::string *recordname, const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	MidIpcWriter w(&args);
+	w.PutString(hashname);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = call(MID_GET_INODE_NAME, args, &reply);
+	if (ret < 0)
+		return ret;
+	MidIpcReader r(reply.c_str(), reply.size());
+	return r.GetString(recordname) ? NO_ERR : ERR_IO;
+}
+
+err_t DCFSMidIPC::Modify(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_hash, std::string aes_key,
+			const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	std::vector<uint64_t> copies;
+	MidIpcWriter w(&args);
+	w.PutString(dcname);
+	w.PutString(inode_hash);
+	w.PutString(aes_key);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = putDescs(&w, descs, &copies);
+	if (ret == NO_ERR)
+		ret = call(MID_MODIFY, args, &reply);
+	freeCopies(&copies);
+	if (ret < 0)
+		return ret;
+
+	MidIpcReader r(reply.c_str(), reply.size());
+	return getDescs(&r, descs) ? NO_ERR : ERR_IO;
+}
+
+err_t DCFSMidIPC::ModifyBatch(std::vector<modify_req_t> *reqs, const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	std::vector<uint64_t> copies;
+	MidIpcWriter w(&args);
+	w.PutBytes((const char *)sig, siglen);
+	w.PutU64(reqs->size());
+
+	err_t ret = NO_ERR;
+	for (auto &req : *reqs) {
+		w.PutString(req.dcname);
+		w.PutString(req.inode_hash);
+		w.PutString(req.aes_key);
+		ret = putDescs(&w, req.descs, &copies);
+		if (ret < 0)
+			break;
+	}
+	if (ret == NO_ERR)
+		ret = call(MID_MODIFY_BATCH, args, &reply);
+	freeCopies(&copies);
+	if (ret < 0)
+		return ret;
+
+	MidIpcReader r(reply.c_str(), reply.size());
+	for (auto &req : *reqs) {
+		uint32_t req_ret;
+		if (!r.GetU32(&req_ret))
+			return ERR_IO;
+		req.ret = (err_t)req_ret;
+		if (!getDescs(&r, req.descs))
+			return ERR_IO;
+	}
+	return NO_ERR;
+}
+
+err_t DCFSMidIPC::DecryptAESKey(std::string recordname, std::string encrypted_key, std::string *aes_key,
+				const unsigned char *sig, size_t siglen) {
+	std::string args, reply;
+	MidIpcWriter w(&args);
+	w.PutString(recordname);
+	w.PutString(encrypted_key);
+	w.PutBytes((const char *)sig, siglen);
+
+	err_t ret = call(MID_DECRYPT_AES_KEY, args, &reply);
+	if (ret < 0)
+		return ret;
+	MidIpcReader r(reply.c_str(), reply.size());
+	return r.GetString(aes_key) ? NO_ERR : ERR_IO;
+}
@@ -0,0 +1,110 @@
+#include <thread>
+
+#include "errno.hpp"
+#include "backend.hpp"
+
+DCServerNetem::DCServerNetem(DCServer *dcserver, const netem_config &config) : dcserver_(dcserver), link_(config) {
+}
+
+DCServerNetem::~DCServerNetem() {
+	delete dcserver_;
+}
+
+/**
+ * A read is timed once its size is known: a small request up, the record down.
+*/
+err_t DCServerNetem::finishRead(NetemLink::clock::time_point start, err_t ret, uint64_t size) {
+	NetemLink::clock::time_point done;
+	bool delivered = link_.Exchange(start, NETEM_MSG_BYTES, NETEM_MSG_BYTES + (ret < 0 ? 0 : size), &done);
+	std::this_thread::sleep_until(done);
+	return delivered ? ret : ERR_IO;
+}
+
+err_t DCServerNetem::ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+	NetemLink::clock::time_point start = NetemLink::clock::now();
+	err_t ret = dcserver_->ReadRecord(dcname, recordname, desc, read_size);
+	return finishRead(start, ret, ret < 0 ? 0 : *read_size);
+}
+
+err_t DCServerNetem::ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	NetemLink::clock::time_point start = NetemLink::clock::now();
+	err_t ret = dcserver_->ViewRecord(dcname, recordname, max_size, ref);
+	ret = finishRead(start, ret, ref->size);
+	if (ret < 0)
+		*ref = record_ref_t();
+	return ret;
+}
+
+err_t DCServerNetem::SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	NetemLink::clock::time_point start = NetemLink::clock::now();
+	err_t ret = dcserver_->SubmitRead(dcname, recordname, max_size, ref);
+	if (ret < 0)
+		return ret;
+
+	std::lock_guard<std::mutex> lock(m_);
+	reads_[ref] = start;
+	return NO_ERR;
+}
+
+err_t DCServerNetem::WaitRead(record_ref_t *ref) {
+	err_t ret = dcserver_->WaitRead(ref);
+	NetemLink::clock::time_point start;
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		auto it = reads_.find(ref);
+		if (it == reads_.end())
+			return ret;
+		start = it->second;
+		reads_.erase(it);
+	}
+
+	ret = finishRead(start, ret, ref->size);
+	if (ret < 0)
+		*ref = record_ref_t();
+	return ret;
+}
+
+/**
+ * A write is timed before it is handed on, so a record whose every attempt is lost is never stored.
+*/
+err_t DCServerNetem::WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	NetemLink::clock::time_point done;
+	if (!link_.Exchange(NetemLink::clock::now(), desc->size, NETEM_MSG_BYTES, &done)) {
+		std::this_thread::sleep_until(done);
+		return ERR_IO;
+	}
+
+	err_t ret = dcserver_->WriteRecord(dcname, recordname, desc);
+	std::this_thread::sleep_until(done);
+	return ret;
+}
+
+err_t DCServerNetem::SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	pending_write w;
+	w.lost = !link_.Exchange(NetemLink::clock::now(), desc->size, NETEM_MSG_BYTES, &w.done);
+	if (!w.lost) {
+		err_t ret = dcserver_->SubmitWrite(dcname, recordname, desc);
+		if (ret < 0)
+			return ret;
+	}
+
+	std::lock_guard<std::mutex> lock(m_);
+	writes_.insert(std::make_pair(recordname, w));
+	return NO_ERR;
+}
+
+err_t DCServerNetem::WaitWrite(std::string dcname, std::string recordname) {
+	pending_write w;
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		auto it = writes_.find(recordname);
+		if (it == writes_.end())
+			return dcserver_->WaitWrite(dcname, recordname);
+		w = it->second;
+		writes_.erase(it);
+	}
+
+	err_t ret = w.lost ? ERR_IO : dcserver_->WaitWrite(dcname, recordname);
+	std::this_thread::sleep_until(w.done);
+	return ret;
+}
@@ -25,8 +25,11 @@ DCServerNet::~DCServerNet() {
 }
 
 err_t DCServerNet::ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
-	std::string *out = dcclient_->Get(recordname, DCGetOptions{false, false});
+	DCFuture get = dcclient_->GetAsync(recordname, DCGetOptions{false, false});
+	std::shared_ptr<const std::string> out = get.Result();
 	if (out == NULL) {
+		if (get.Error() == DC_OP_NOT_FOUND)
+			return ERR_NOT_FOUND;
 		Logger::log(ERROR, "DCServerNet::ReadRecord: Failed to read record" 
 				+ Util::binary_to_hex_string(recordname.c_str(), recordname.length()) 
 				+ "from DC server");
@@ -43,7 +46,69 @@ err_t DCServerNet::ReadRecord(std::string dcname, std::string recordname, buf_de
 
 
 err_t DCServerNet::WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) {
-	dcclient_->Put(recordname, std::string(desc->buf, desc->size));
+	if (!dcclient_->Put(recordname, desc->buf, desc->size))
+		return ERR_IO;
+
+	return NO_ERR;
+}
+
+err_t DCServerNet::SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	dcclient_->SubmitPut(recordname, desc->buf, desc->size);
+
+	return NO_ERR;
+}
+
+err_t DCServerNet::WaitWrite(std::string dcname, std::string recordname) {
+	if (!dcclient_->WaitPut(recordname)) {
+		Logger::log(ERROR, "DCServerNet::WaitWrite: Failed to write record" 
+				+ Util::binary_to_hex_string(recordname.c_str(), recordname.length()) 
+				+ "to DC server");
+		return ERR_IO;
+	}
+
+	return NO_ERR;
+}
 
+err_t DCServerNet::viewResponse(const DCFuture &get, const std::string &recordname, uint64_t max_size, record_ref_t *ref) {
+	std::shared_ptr<const std::string> out = get.Result();
+	if (out == NULL) {
+		if (get.Error() == DC_OP_NOT_FOUND)
+			return ERR_NOT_FOUND;
+		Logger::log(ERROR, "DCServerNet::ViewRecord: Failed to read record"
+				+ Util::binary_to_hex_string(recordname.c_str(), recordname.length())
+				+ "from DC server");
+		return ERR_IO;
+	}
+	if (out->length() > max_size)
+		return ERR_BUF_TOO_SMALL;
+
+	ref->buf = out->c_str();
+	ref->size = out->length();
+	ref->pin = out;
 	return NO_ERR;
-}
\ No newline at end of file
+}
+
+err_t DCServerNet::ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	return viewResponse(dcclient_->GetAsync(recordname, DCGetOptions{false, false}), recordname, max_size, ref);
+}
+
+err_t DCServerNet::SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	pending_read read = {dcclient_->GetAsync(recordname, DCGetOptions{false, false}), recordname, max_size};
+
+	std::lock_guard<std::mutex> lock(reads_m_);
+	reads_[ref] = read;
+	return NO_ERR;
+}
+
+err_t DCServerNet::WaitRead(record_ref_t *ref) {
+	pending_read read;
+	{
+		std::lock_guard<std::mutex> lock(reads_m_);
+		auto it = reads_.find(ref);
+		if (it == reads_.end())
+			return ERR_NOT_FOUND;
+		read = it->second;
+		reads_.erase(it);
+	}
+	return viewResponse(read.get, read.recordname, read.max_size, ref);
+}
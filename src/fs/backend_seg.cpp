@@ -0,0 +1,438 @@
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "backend.hpp"
+#include "util/logging.hpp"
+
+#define SEG_RECORD_MAGIC 0x64726373U // "scrd"
+#define SEG_HINT_MAGIC 0x746e6968676573ULL // "seghint"
+
+struct hint_hdr {
+	uint64_t magic;
+	uint64_t end; // segment bytes covered by the entries
+	uint64_t count;
+	uint64_t checksum; // over the entries
+};
+
+/* FNV-1a over 8-byte words, so that checksumming a record costs little next to writing it */
+static uint64_t seg_checksum(const void *data, size_t len, uint64_t h = 0xcbf29ce484222325ULL) {
+	const char *p = (const char *)data;
+	uint64_t word;
+	for (; len >= sizeof(word); p += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		h = (h ^ word) * 0x100000001b3ULL;
+	}
+	for (; len > 0; p++, len--)
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t record_checksum(const char *names, const char *buf, uint64_t size) {
+	return seg_checksum(buf, size, seg_checksum(names, 2 * HASHLEN_IN_BYTES));
+}
+
+static std::string index_key(const char *dcname, const char *recordname) {
+	return std::string(dcname, HASHLEN_IN_BYTES) + std::string(recordname, HASHLEN_IN_BYTES);
+}
+
+DCServerSeg::DCServerSeg(std::string dir, durability_mode durability, uint64_t sync_window_us) : sync_(durability,
+		sync_window_us, [this] { return syncActive(); }), dir_(dir), tail_(0) {
+	if (load() < 0)
+		Logger::log(ERROR, "DCServerSeg: cannot load segments in " + dir_);
+}
+
+DCServerSeg::~DCServerSeg() {
+	std::lock_guard<std::mutex> wlock(write_m_);
+
+	// spares the next start a scan of the active segment
+	if (!segs_.empty() && writeHint(segs_.size() - 1) < 0)
+		Logger::log(WARNING, "DCServerSeg: cannot write the hint of " + segmentPath(segs_.back().id));
+	for (auto &s : segs_)
+		close(s.fd);
+}
+
+std::string DCServerSeg::segmentPath(uint32_t id) {
+	char name[32];
+	snprintf(name, sizeof(name), "/segment.%08u", id);
+	return dir_ + name;
+}
+
+err_t DCServerSeg::openSegment(uint32_t id, bool create) {
+	int fd = open(segmentPath(id).c_str(), O_RDWR | (create ? O_CREAT : 0), 0600);
+	if (fd < 0)
+		return ERR_IO;
+
+	// syncing a segment does not sync its name
+	if (create && sync_.Mode() != DURABILITY_NONE) {
+		int dir_fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+		bool ok = dir_fd >= 0 && fsync(dir_fd) == 0;
+		if (dir_fd >= 0)
+			close(dir_fd);
+		if (!ok) {
+			close(fd);
+			return ERR_IO;
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(m_);
+	segs_.push_back({id, fd});
+	return NO_ERR;
+}
+
+/* caller holds m_ exclusively, or has the store to itself */
+void DCServerSeg::index(uint32_t seg, const hint_entry &e) {
+	index_[index_key(e.dcname, e.recordname)] = {seg, (uint32_t)e.size, e.offset};
+	if (memcmp(e.dcname, e.recordname, HASHLEN_IN_BYTES) == 0)
+		dcs_.insert(std::string(e.dcname, HASHLEN_IN_BYTES));
+}
+
+err_t DCServerSeg::load() {
+	std::error_code ec;
+	fs::create_directories(dir_, ec);
+	if (ec)
+		return ERR_IO;
+
+	std::vector<uint32_t> ids;
+	for (auto &f : fs::directory_iterator(dir_, ec)) {
+		unsigned int id;
+		char trailing;
+		if (sscanf(f.path().filename().c_str(), "segment.%u%c", &id, &trailing) == 1)
+			ids.push_back(id);
+	}
+	if (ec)
+		return ERR_IO;
+	std::sort(ids.begin(), ids.end());
+
+	for (uint32_t id : ids) {
+		if (openSegment(id, false) < 0)
+			return ERR_IO;
+
+		uint32_t seg = segs_.size() - 1;
+		bool active = (id == ids.back());
+		struct stat st;
+		if (fstat(segs_[seg].fd, &st) < 0)
+			return ERR_IO;
+
+		std::vector<hint_entry> entries;
+		uint64_t end = loadSegment(seg, st.st_size, &entries);
+		for (auto &e : entries)
+			index(seg, e);
+
+		if (end != (uint64_t)st.st_size) {
+			// a torn tail of the active segment is what a crash leaves behind; anywhere else it is damage
+			Logger::log(WARNING, "DCServerSeg: " + segmentPath(id) + " is readable up to " + std::to_string(end)
+					+ " of " + std::to_string(st.st_size) + " bytes");
+			if (active && ftruncate(segs_[seg].fd, end) < 0)
+				return ERR_IO;
+		}
+		if (active) {
+			tail_ = end;
+			active_hints_ = std::move(entries);
+		}
+	}
+
+	if (segs_.empty())
+		return openSegment(0, true);
+	return NO_ERR;
+}
+
+/**
+ * Index entries of segment seg: those of its hint file, then those found by scanning the rest of it.
+ * Returns where the last valid record ends.
+*/
+uint64_t DCServerSeg::loadSegment(uint32_t seg, uint64_t size, std::vector<hint_entry> *entries) {
+	uint64_t end = 0;
+
+	int hint_fd = open((segmentPath(segs_[seg].id) + ".hint").c_str(), O_RDONLY);
+	if (hint_fd >= 0) {
+		hint_hdr h;
+		struct stat st;
+		if (pread(hint_fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == SEG_HINT_MAGIC && h.end <= size
+				&& fstat(hint_fd, &st) == 0 && (uint64_t)st.st_size == sizeof(h) + h.count * sizeof(hint_entry)) {
+			entries->resize(h.count);
+			ssize_t len = h.count * sizeof(hint_entry);
+			if (pread(hint_fd, entries->data(), len, sizeof(h)) == len && seg_checksum(entries->data(), len) == h.checksum)
+				end = h.end;
+			else
+				entries->clear();
+		}
+		close(hint_fd);
+	}
+
+	int fd = segs_[seg].fd;
+	std::vector<char> buf;
+	while (end + sizeof(record_hdr) <= size) {
+		record_hdr h;
+		if (pread(fd, &h, sizeof(h), end) != sizeof(h) || h.magic != SEG_RECORD_MAGIC
+				|| end + sizeof(h) + h.size > size)
+			break;
+		buf.resize(h.size);
+		if (pread(fd, buf.data(), h.size, end + sizeof(h)) != (ssize_t)h.size
+				|| record_checksum(h.dcname, buf.data(), h.size) != h.checksum)
+			break;
+
+		hint_entry e;
+		memcpy(e.dcname, h.dcname, HASHLEN_IN_BYTES);
+		memcpy(e.recordname, h.recordname, HASHLEN_IN_BYTES);
+		e.offset = end + sizeof(h);
+		e.size = h.size;
+		entries->push_back(e);
+		end = e.offset + e.size;
+	}
+
+	return end;
+}
+
+/* caller holds write_m_, and every append reserved in seg, the active segment, is published */
+err_t DCServerSeg::writeHint(uint32_t seg) {
+	std::string path = segmentPath(segs_[seg].id) + ".hint";
+	std::string tmp = path + ".tmp";
+
+	std::lock_guard<std::mutex> lock(hint_m_);
+	hint_hdr h;
+	h.magic = SEG_HINT_MAGIC;
+	h.end = tail_;
+	h.count = active_hints_.size();
+	h.checksum = seg_checksum(active_hints_.data(), h.count * sizeof(hint_entry));
+
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return ERR_IO;
+	struct iovec iov[2] = {{&h, sizeof(h)}, {active_hints_.data(), h.count * sizeof(hint_entry)}};
+	ssize_t len = iov[0].iov_len + iov[1].iov_len;
+	bool ok = pwritev(fd, iov, 2, 0) == len;
+	close(fd);
+
+	// a stale or missing hint only costs a longer scan, so it is not synced
+	if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return ERR_IO;
+	}
+	return NO_ERR;
+}
+
+err_t DCServerSeg::locate(const std::string &dcname, const std::string &recordname, location *loc, uint32_t *seg_id, int *fd) {
+	if (dcname.size() != HASHLEN_IN_BYTES || recordname.size() != HASHLEN_IN_BYTES)
+		return ERR_NOT_FOUND;
+
+	std::shared_lock<std::shared_mutex> lock(m_);
+	auto match = index_.find(index_key(dcname.c_str(), recordname.c_str()));
+	if (match == index_.end())
+		return ERR_NOT_FOUND;
+	*loc = match->second;
+	*seg_id = segs_[loc->seg].id;
+	*fd = segs_[loc->seg].fd;
+	return NO_ERR;
+}
+
+err_t DCServerSeg::ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+	location loc;
+	uint32_t seg_id;
+	int fd;
+	err_t ret = locate(dcname, recordname, &loc, &seg_id, &fd);
+	if (ret < 0)
+		return ret;
+
+	if (loc.size > desc->size)
+		return ERR_BUF_TOO_SMALL;
+
+	uint64_t done = 0;
+	while (done < loc.size) {
+		ssize_t n = pread(fd, desc->buf + done, loc.size - done, loc.offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return ERR_IO;
+		done += n;
+	}
+
+	*read_size = loc.size;
+	return NO_ERR;
+}
+
+DCServerSeg::mapping::~mapping() {
+	munmap((void *)base, len);
+}
+
+/**
+ * Read-only mapping of segment seg, at least min_len long. The active segment is mapped to its full
+ * SEGMENT_SIZE, so records appended later are visible through the same mapping.
+ * Caller holds m_ (shared is enough).
+*/
+std::shared_ptr<DCServerSeg::mapping> DCServerSeg::mapSegment(uint32_t seg, uint64_t min_len) {
+	std::lock_guard<std::mutex> lock(map_m_);
+	std::shared_ptr<mapping> &map = segs_[seg].map;
+	if (map && map->len >= min_len)
+		return map;
+
+	// only a record larger than SEGMENT_SIZE outgrows a mapping; views into the previous one keep it alive
+	uint64_t len = std::max((uint64_t)SEGMENT_SIZE, min_len);
+	void *base = mmap(NULL, len, PROT_READ, MAP_SHARED, segs_[seg].fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	map = std::shared_ptr<mapping>(new mapping{(const char *)base, len});
+	return map;
+}
+
+err_t DCServerSeg::ViewRecord(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	if (dcname.size() != HASHLEN_IN_BYTES || recordname.size() != HASHLEN_IN_BYTES)
+		return ERR_NOT_FOUND;
+
+	location loc;
+	std::shared_ptr<mapping> map;
+	{
+		std::shared_lock<std::shared_mutex> lock(m_);
+		auto match = index_.find(index_key(dcname.c_str(), recordname.c_str()));
+		if (match == index_.end())
+			return ERR_NOT_FOUND;
+		loc = match->second;
+		if (loc.size > max_size)
+			return ERR_BUF_TOO_SMALL;
+		map = mapSegment(loc.seg, loc.offset + loc.size);
+	}
+	if (!map)
+		return DCServer::ViewRecord(dcname, recordname, max_size, ref);
+
+	ref->buf = map->base + loc.offset;
+	ref->size = loc.size;
+	ref->pin = map;
+	return NO_ERR;
+}
+
+/**
+ * Claims space for a record of size bytes at the end of the active segment, sealing it first if full.
+ * As in DCServerSim, the first record of a DataCapsule is the one named after it.
+ * Caller holds write_m_.
+*/
+err_t DCServerSeg::reserve(const std::string &dcname, const std::string &recordname, uint64_t size, uint32_t *seg, uint64_t *offset) {
+	if (dcname.size() != HASHLEN_IN_BYTES || recordname.size() != HASHLEN_IN_BYTES || size > UINT32_MAX)
+		return ERR_IO;
+
+	{
+		std::unique_lock<std::shared_mutex> lock(m_);
+		if (dcname == recordname)
+			dcs_.insert(dcname);
+		else if (dcs_.count(dcname) == 0)
+			return ERR_IO;
+	}
+
+	uint64_t len = sizeof(record_hdr) + size;
+	if (tail_ > 0 && tail_ + len > SEGMENT_SIZE) {
+		quiesce();
+		if (sync_.Sync() < 0) // later groups only sync the next segment
+			return ERR_IO;
+		if (writeHint(segs_.size() - 1) < 0)
+			Logger::log(WARNING, "DCServerSeg: cannot write the hint of " + segmentPath(segs_.back().id));
+		if (openSegment(segs_.back().id + 1, true) < 0)
+			return ERR_IO;
+		tail_ = 0;
+		std::lock_guard<std::mutex> lock(hint_m_);
+		active_hints_.clear();
+	}
+
+	*seg = segs_.size() - 1;
+	*offset = tail_;
+	tail_ += len;
+	return NO_ERR;
+}
+
+void DCServerSeg::fillHeader(record_hdr *h, const std::string &dcname, const std::string &recordname, const char *buf, uint64_t size) {
+	h->magic = SEG_RECORD_MAGIC;
+	h->size = size;
+	memcpy(h->dcname, dcname.c_str(), HASHLEN_IN_BYTES);
+	memcpy(h->recordname, recordname.c_str(), HASHLEN_IN_BYTES);
+	h->checksum = record_checksum(h->dcname, buf, size);
+}
+
+/* makes the record written at offset (its header) of seg readable */
+void DCServerSeg::publish(uint32_t seg, uint64_t offset, const record_hdr &h) {
+	hint_entry e;
+	memcpy(e.dcname, h.dcname, HASHLEN_IN_BYTES);
+	memcpy(e.recordname, h.recordname, HASHLEN_IN_BYTES);
+	e.offset = offset + sizeof(h);
+	e.size = h.size;
+	{
+		std::lock_guard<std::mutex> lock(hint_m_);
+		active_hints_.push_back(e);
+	}
+
+	std::unique_lock<std::shared_mutex> lock(m_);
+	index(seg, e);
+}
+
+/* appends a record; it is durable once sync_ waited for ticket */
+err_t DCServerSeg::append(const std::string &dcname, const std::string &recordname, const buf_desc_t *desc, uint64_t *ticket) {
+	{
+		std::lock_guard<std::mutex> wlock(write_m_);
+		uint32_t seg;
+		uint64_t offset;
+		err_t ret = reserve(dcname, recordname, desc->size, &seg, &offset);
+		if (ret < 0)
+			return ret;
+
+		record_hdr h;
+		fillHeader(&h, dcname, recordname, desc->buf, desc->size);
+
+		// a failed append is the last reservation, so it is given back and the next record overwrites it
+		struct iovec iov[2] = {{&h, sizeof(h)}, {desc->buf, desc->size}};
+		if (pwritev(segs_[seg].fd, iov, 2, offset) != (ssize_t)(sizeof(h) + desc->size)) {
+			tail_ = offset;
+			return ERR_IO;
+		}
+
+		publish(seg, offset, h);
+	}
+	*ticket = sync_.Written(sizeof(record_hdr) + desc->size);
+	return NO_ERR;
+}
+
+err_t DCServerSeg::WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	uint64_t ticket;
+	err_t ret = append(dcname, recordname, desc, &ticket);
+	if (ret < 0)
+		return ret;
+	return sync_.Wait(ticket);
+}
+
+err_t DCServerSeg::SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	uint64_t ticket;
+	err_t ret = append(dcname, recordname, desc, &ticket);
+	if (ret < 0 || sync_.Mode() == DURABILITY_NONE)
+		return ret;
+
+	std::lock_guard<std::mutex> lock(tickets_m_);
+	tickets_.insert(std::make_pair(recordname, ticket));
+	return NO_ERR;
+}
+
+err_t DCServerSeg::WaitWrite(std::string dcname, std::string recordname) {
+	uint64_t ticket;
+	{
+		std::lock_guard<std::mutex> lock(tickets_m_);
+		auto match = tickets_.find(recordname);
+		if (match == tickets_.end())
+			return NO_ERR;
+		ticket = match->second;
+		tickets_.erase(match);
+	}
+	return sync_.Wait(ticket);
+}
+
+/* sync_ callback: a sync of the active segment covers every ticket, as reserve synced the sealed ones */
+bool DCServerSeg::syncActive() {
+	int fd;
+	{
+		std::shared_lock<std::shared_mutex> lock(m_);
+		if (segs_.empty())
+			return false;
+		fd = segs_.back().fd;
+	}
+	return fdatasync(fd) == 0;
+}
@@ -3,6 +3,10 @@
 #include <cassert>
 
 #include <chrono>
+#include <set>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "backend.hpp"
 #include "util/crypto.hpp"
@@ -83,65 +87,101 @@
 //EVP_PKEY *client_key_pair_ = Util::generate_evp_pkey_dsa();
 
 
+/**
+ * The record is serialized straight into out_desc->buf, with the same wire format as CapsulePDU::SerializeToArray:
+ * the header is built on a stack-backed arena and serialized in place (its hash is taken there),
+ * and the payload is copied once, from in_desc into the outgoing record.
+ * A record to be signed gets a zeroed RECORD_SIG_MAX-byte signature and a one-byte signature_len, filled in by signer_.
+*/
 err_t DCFSMidSim::composeRecord(record_type type,
 					std::vector<std::string> *hashes, 
 					buf_desc_t *in_desc, 
 					buf_desc_t *out_desc, 
-					std::string *hashname){
+					std::string *hashname,
+					uint64_t *sig_offset){
+	using google::protobuf::io::CodedOutputStream;
+	using google::protobuf::internal::WireFormatLite;
 	assert(out_desc);
 	assert(hashname);
 
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	capsule::CapsuleHeader *header = google::protobuf::Arena::CreateMessage<capsule::CapsuleHeader>(&arena);
 
-	capsule::CapsulePDU *pdu = new capsule::CapsulePDU();
-
-	pdu->mutable_header()->set_sender(0);
+	header->set_sender(0);
 	
 	if (hashes) {
-		for (auto hash : *hashes) {
-			pdu->mutable_header()->add_prevhash(hash);
+		for (auto &hash : *hashes) {
+			header->add_prevhash(hash);
 		}
 	}
 
-	if (in_desc) {
-		buf_desc_t desc;
-		desc.buf = in_desc->buf;
-		desc.size = in_desc->size;
-
+	if (in_desc && in_desc->payload_hash.size() == HASHLEN_IN_BYTES) {
+		// computed together with encryption by the client, checked against buf by checkPayloadHashes
+		header->set_hash(in_desc->payload_hash);
+	} else if (in_desc) {
 		unsigned char hash_buf[HASHLEN_IN_BYTES];
-		if(!Util::hash256((void *)desc.buf, desc.size, hash_buf)) {
+		if(!Util::hash256((void *)in_desc->buf, in_desc->size, hash_buf)) {
 			return ERR_HASH;
 		}
-		pdu->mutable_header()->set_hash(std::string((char *)hash_buf, HASHLEN_IN_BYTES));
+		header->set_hash((char *)hash_buf, HASHLEN_IN_BYTES);
 	} else {
-		pdu->mutable_header()->set_hash("0");
+		header->set_hash("0");
 	}
-	pdu->mutable_header()->set_timestamp(std::chrono::system_clock::now().time_since_epoch().count());
-	pdu->mutable_header()->set_msgtype(record_type_to_string(type));
-	pdu->mutable_header()->set_replyaddr(Util::load_client_ip() + std::string(":") + std::to_string(NET_CLIENT_RECV_ACK_PORT + CLIENT_ID));
+	header->set_timestamp(std::chrono::system_clock::now().time_since_epoch().count());
+	header->set_msgtype(record_type_to_string(type));
+	header->set_replyaddr(Util::load_client_ip() + std::string(":") + std::to_string(NET_CLIENT_RECV_ACK_PORT + CLIENT_ID));
+
+	bool sign = (sign_mode_ == RECORD_SIGN_EACH)
+			|| (sign_mode_ == RECORD_SIGN_BATCH && (type == INODE || type == CHECKPOINT || type == META));
+	std::string signature;
+	if (sign)
+		signature.assign(RECORD_SIG_MAX, 0);
+	else
+		signature = (sign_mode_ == RECORD_SIGN_BATCH) ? RECORD_SIG_IMPLIED : RECORD_SIG_NONE;
+	uint32_t header_size = header->ByteSizeLong();
+	uint64_t payload_size = in_desc ? in_desc->size : 0;
+
+	// CapsulePDU fields in field number order: header(1), header_hash(2), signature(3), signature_len(4), payload_in_transit(5)
+	out_desc->size = 1 + CodedOutputStream::VarintSize32(header_size) + header_size
+				+ 1 + CodedOutputStream::VarintSize32(HASHLEN_IN_BYTES) + HASHLEN_IN_BYTES
+				+ 1 + CodedOutputStream::VarintSize32(signature.size()) + signature.size();
+	if (sign)
+		out_desc->size += 2; // RECORD_SIG_MAX < 128, so signature_len is a one-byte varint
+	if (payload_size > 0)
+		out_desc->size += 1 + CodedOutputStream::VarintSize64(payload_size) + payload_size;
+	out_desc->buf = new char[out_desc->size];
 
-	buf_desc_t desc;
-	alloc_buf_desc(&desc, pdu->header().ByteSizeLong());
-	pdu->header().SerializeToArray(desc.buf, pdu->header().ByteSizeLong());
+	uint8_t *target = (uint8_t *)out_desc->buf;
+	target = WireFormatLite::WriteTagToArray(capsule::CapsulePDU::kHeaderFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+	target = CodedOutputStream::WriteVarint32ToArray(header_size, target);
+	uint8_t *header_start = target;
+	target = header->SerializeWithCachedSizesToArray(target);
 
 	unsigned char hash_buf[HASHLEN_IN_BYTES];
-	if(!Util::hash256((void *)desc.buf, desc.size, hash_buf)) {
+	if(!Util::hash256((void *)header_start, header_size, hash_buf)) {
+		dealloc_buf_desc(out_desc);
 		return ERR_HASH;
 	}
 	*hashname = std::string((char *)hash_buf, HASHLEN_IN_BYTES);
-	pdu->set_header_hash(*hashname);
-	dealloc_buf_desc(&desc);
-
-	pdu->set_signature("0"); // TODO: sign
-	if (in_desc)
-		pdu->set_payload_in_transit(in_desc->buf, in_desc->size);
 
-	out_desc->size = pdu->ByteSizeLong(); 
-	out_desc->buf = new char[out_desc->size];
-	pdu->SerializeToArray(out_desc->buf, out_desc->size);
+	target = WireFormatLite::WriteBytesToArray(capsule::CapsulePDU::kHeaderHashFieldNumber, *hashname, target);
+	target = WireFormatLite::WriteTagToArray(capsule::CapsulePDU::kSignatureFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+	target = CodedOutputStream::WriteVarint32ToArray(signature.size(), target);
+	*sig_offset = sign ? (char *)target - out_desc->buf : 0;
+	target = CodedOutputStream::WriteRawToArray(signature.c_str(), signature.size(), target);
+	if (sign)
+		target = WireFormatLite::WriteInt64ToArray(capsule::CapsulePDU::kSignatureLenFieldNumber, 0, target);
+	if (payload_size > 0) {
+		target = WireFormatLite::WriteTagToArray(capsule::CapsulePDU::kPayloadInTransitFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+		target = CodedOutputStream::WriteVarint64ToArray(payload_size, target);
+		target = CodedOutputStream::WriteRawToArray(in_desc->buf, payload_size, target);
+	}
+	assert((char *)target == out_desc->buf + out_desc->size);
 
 	Logger::log(LDEBUG, "composeRecord called for " + record_type_to_string(type));
 	Logger::log(LDEBUG, "composeRecord: hashname = " + Util::binary_to_hex_string(hashname->c_str(), hashname->size()));
-	for (auto hash : pdu->header().prevhash()) {
+	for (auto &hash : header->prevhash()) {
 		Logger::log(LDEBUG, "composeRecord: prevhash = " + Util::binary_to_hex_string(hash.c_str(), hash.size()));
 	}
 
@@ -150,15 +190,25 @@ err_t DCFSMidSim::composeRecord(record_type type,
 
 err_t DCFSMidSim::CreateNew(std::string *hashname, std::string *aes_key, const unsigned char *sig, size_t siglen) {	
 	buf_desc_t desc;
-	composeRecord(META, NULL, NULL, &desc, hashname);
+	uint64_t sig_offset;
+	err_t err = composeRecord(META, NULL, NULL, &desc, hashname, &sig_offset);
+	if (err < 0)
+		return err;
+	err = signRecord(&desc, sig_offset, *hashname);
+	if (err < 0) {
+		dealloc_buf_desc(&desc);
+		return err;
+	}
 		
-	err_t err = dcserver_->WriteRecord(*hashname,
+	err = dcserver_->WriteRecord(*hashname,
 		*hashname,
 		&desc);	
 	if (err < 0)
 		return err;
 
-	index_[*hashname] = "";
+	err = index_.Create(*hashname);
+	if (err < 0)
+		return err;
 
 	dealloc_buf_desc(&desc);
 	unsigned char aes_key_buf[AES_KEY_LEN];
@@ -169,141 +219,310 @@ err_t DCFSMidSim::CreateNew(std::string *hashname, std::string *aes_key, const u
 }
 
 err_t DCFSMidSim::GetRoot(std::string *hashname, std::string *recordname, const unsigned char *sig, size_t siglen) {
-	*hashname = root_.first;
-	*recordname = root_.second;
+	index_.GetRoot(hashname, recordname);
+	return NO_ERR;
+}
+
+/**
+ * The keys wrap every per-file key and sign records, so they must outlive the middleware as the index does.
+ * Stored as the AES key then the DER-encoded writer key, written to a temporary file and renamed in place.
+*/
+err_t DCFSMidSim::loadKeys(std::string dir) {
+	std::string path = dir + "/keys";
+	unsigned char buf[MID_KEYS_MAX_SIZE];
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		close(fd);
+		const unsigned char *der = buf + AES_KEY_LEN;
+		middlewareWriterKey_ = len > AES_KEY_LEN ? d2i_ECPrivateKey(NULL, &der, len - AES_KEY_LEN) : NULL;
+		memcpy(symmetric_middleware_key_, buf, AES_KEY_LEN);
+		OPENSSL_cleanse(buf, sizeof(buf));
+		if (!middlewareWriterKey_) {
+			Logger::log(ERROR, "DCFSMidSim: corrupted middleware keys " + path);
+			return ERR_IO;
+		}
+		return NO_ERR;
+	}
+	if (errno != ENOENT || Util::generate_ECDSA_key(&middlewareWriterKey_) < 0
+			|| Util::generate_symmetric_key(symmetric_middleware_key_) != 1) {
+		Logger::log(ERROR, "DCFSMidSim: cannot read or create the middleware keys " + path);
+		return ERR_IO;
+	}
+
+	memcpy(buf, symmetric_middleware_key_, AES_KEY_LEN);
+	unsigned char *der = buf + AES_KEY_LEN;
+	int der_len = i2d_ECPrivateKey(middlewareWriterKey_, NULL);
+	if (der_len <= 0 || der_len > (int)sizeof(buf) - AES_KEY_LEN || i2d_ECPrivateKey(middlewareWriterKey_, &der) != der_len)
+		return ERR_CRYPTO;
+	ssize_t len = AES_KEY_LEN + der_len;
+
+	std::string tmp_path = path + ".tmp";
+	fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ok = fd >= 0 && write(fd, buf, len) == len && fsync(fd) == 0;
+	if (fd >= 0)
+		close(fd);
+	OPENSSL_cleanse(buf, sizeof(buf));
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+		Logger::log(ERROR, "DCFSMidSim: cannot store the middleware keys " + path);
+		return ERR_IO;
+	}
+
+	int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return NO_ERR;
+}
+
+void DCFSMidSim::loadIndex() {
+	if (index_.Load() < 0) {
+		Logger::log(ERROR, "DCFSMidSim: failed to load the middleware index");
+		return;
+	}
+
+	// inode records prepared before a restart count only if they reached the DC server
+	index_.Recover([this](const std::string &dcname, const std::string &recordname) {
+		record_ref_t ref;
+		return dcserver_->ViewRecord(dcname, recordname, MAX_INODE_RECORD_SIZE, &ref);
+	});
+}
+
+bool DCFSMidSim::verifyRequest(const unsigned char *digest, const unsigned char *sig, size_t siglen) {
+	if (session_open_)
+		return Util::verify_hmac256(session_mac_key_, HMAC_KEY_LEN, digest, SHA256_DIGEST_LENGTH, sig, siglen);
+
+	return Util::verify(client_key_pair_, (unsigned char *)digest, SHA256_DIGEST_LENGTH, sig, siglen);
+}
+
+err_t DCFSMidSim::OpenSession(std::string nonce, std::string *mac_key, const unsigned char *sig, size_t siglen) {
+	if (strict_auth_)
+		return ERR_VERIFY;
+
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	if (!Util::hash256((void *)nonce.c_str(), nonce.size(), hash))
+		return ERR_HASH;
+	// handshake is never MAC-authenticated
+	if (!Util::verify(client_key_pair_, hash, SHA256_DIGEST_LENGTH, sig, siglen))
+		return ERR_VERIFY;
+
+	if (RAND_bytes(session_mac_key_, HMAC_KEY_LEN) != 1)
+		return ERR_CRYPTO;
+	session_open_ = true;
+
+	// in-process simulation: the key is handed back directly.
+	// an out-of-process middleware must return it over a confidential channel.
+	*mac_key = std::string((char *)session_mac_key_, HMAC_KEY_LEN);
+
 	return NO_ERR;
 }
 
 err_t DCFSMidSim::GetInodeName(std::string hashname, std::string *recordname, const unsigned char *sig, size_t siglen) {
-	char *buf = new char[hashname.size()];
-	memcpy(buf, hashname.c_str(), hashname.size());
-	unsigned char* hash = Util::hash256(buf, hashname.size(), NULL);
-	if (!Util::verify(client_key_pair_, hash, SHA256_DIGEST_LENGTH, sig, siglen)) {
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	if (!Util::hash256((void *)hashname.c_str(), hashname.size(), hash))
+		return ERR_HASH;
+	if (!verifyRequest(hash, sig, siglen)) {
 		return ERR_VERIFY;
 	}
 
-	delete[] buf;	
-
-	if (index_.find(hashname) == index_.end()) {
+	// the head is not known while an update from before a restart is unresolved
+	err_t ret = index_.Resolve(hashname);
+	if (ret < 0)
+		return ret;
+	if (!index_.Find(hashname, recordname)) {
 		// TODO: call freshness service if not available
 		return ERR_NOT_FOUND;
 	}
 	
-	*recordname = index_[hashname];
 	return NO_ERR;
 }
 
-err_t DCFSMidSim::Modify(std::string dcname, const std::vector<buf_desc_t> *descs, std::string inode_hash, std::string aes_key, const unsigned char *sig, size_t siglen) {	
-	// verify arguments
-	size_t len = dcname.length() + inode_hash.length() + aes_key.length();
-	for (auto desc : *descs) {
-		len += desc.size;
-	}
+bool DCFSMidSim::takeFileState(std::string dcname, std::string inode_recordname, FileState *state) {
+	std::lock_guard<std::mutex> lock(state_cache_mutex_);
 
-	char *args = new char[len];
+	auto match = state_cache_.find(dcname);
+	if (match == state_cache_.end())
+		return false;
 
-	size_t offset = 0;
-	memcpy(args + offset, dcname.c_str(), dcname.length());
-	offset += dcname.length();
-	for (size_t i = 0; i < descs->size(); i++) {
-		memcpy(args + offset, descs->at(i).buf, descs->at(i).size);
-		offset += descs->at(i).size;
-	}
-	memcpy(args + offset, inode_hash.c_str(), inode_hash.length());
-	offset += inode_hash.length();
-	memcpy(args + offset, aes_key.c_str(), aes_key.length());
-	
-	unsigned char* hash = Util::hash256((void*)args, len, NULL);
+	bool valid = (match->second.inode_recordname == inode_recordname);
+	if (valid)
+		*state = std::move(match->second);
+	state_cache_.erase(match);
 
-	/* Compute the hash of arg*/
-	if (!Util::verify(client_key_pair_, hash, SHA256_DIGEST_LENGTH, sig, siglen)) {
-		return ERR_VERIFY;
-	}
+	return valid;
+}
 
-	delete[] args;
+void DCFSMidSim::putFileState(std::string dcname, std::string inode_recordname, FileState *state) {
+	std::lock_guard<std::mutex> lock(state_cache_mutex_);
 
-	/* Check latest inode hash. If there is no latest inode hash, then assume this is the first modify. */
-	if (inode_hash != index_[dcname])  {
-		return -1; //CHANGE THE ERROR CODE: TODO
-	}
+	if (state_cache_.size() >= MID_STATE_CACHE_ENTRIES && state_cache_.find(dcname) == state_cache_.end())
+		state_cache_.erase(state_cache_.begin());
+
+	state->inode_recordname = inode_recordname;
+	state_cache_[dcname] = std::move(*state);
+}
 
-	std::vector<std::pair<uint64_t, std::string>> new_data_blocks;
+err_t DCFSMidSim::loadFileState(std::string dcname, std::string inode_recordname, FileState *state) {
 	err_t ret;
-	InodeRecord inode_record;
-	BlockMapRecord blockmap_record;
+	record_ref_t record;
+
+	// read the inode record
+	ret = dcserver_->ViewRecord(dcname, inode_recordname, MAX_INODE_RECORD_SIZE, &record);
+	if (ret < 0)
+		return ret;
+	char arena_block[RECORD_ARENA_BLOCK_SIZE];
+	google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+	record_view_t view;
+	ret = parse_record(record.buf, record.size, &arena, &view);
+	if (ret < 0 || view.header->prevhash_size() < 2 || view.payload_size < INODE_PAYLOAD_SIZE)
+		return ERR_IO;
+	state->inode.blockmap_hash = view.header->prevhash(1);
+	state->inode.checkpoint_hash = view.header->prevhash_size() > 2 ? view.header->prevhash(2) : "";
+	memcpy(&state->inode.isize, view.payload + INODE_ISIZE_OFFSET, sizeof(uint64_t));
+	memcpy(&state->inode.version, view.payload + INODE_VERSION_OFFSET, sizeof(uint64_t));
 
-	if (index_.find(dcname) == index_.end())
-		return ERR_NOT_FOUND;
+	// the stored key is wrapped with the middleware key
+	unsigned char key_buf[AES_KEY_LEN + AES_PAD_LEN];
+	int outlen = 0;
+	int dec = Util::decrypt_symmetric(symmetric_middleware_key_, NULL, (unsigned char *)view.payload + INODE_AES_KEY_OFFSET, 
+			AES_KEY_LEN + AES_PAD_LEN, key_buf, &outlen);
+	if (dec <= 0 || outlen != AES_KEY_LEN)
+		return ERR_CRYPTO;
+	memcpy(state->inode.key, key_buf, AES_KEY_LEN);
+	OPENSSL_cleanse(key_buf, sizeof(key_buf));
+
+	// read the blockmap record, through its delta chain
+	ret = read_blockmap(dcserver_, dcname, state->inode.blockmap_hash, &state->blockmap.data_hashes, &state->blockmap.chain);
+	if (ret < 0)
+		return ret;
+	state->blockmap.hash_to_latest_data_block = state->blockmap.chain.latest_data_hash;
 
-	/**
-	 * Read the necessary inode record, blockmap record
-	*/
+	return NO_ERR;
+}
 
-	//unsigned char key[16];
+err_t DCFSMidSim::submitWrite(modify_ctx_t *ctx, std::string recordname, buf_desc_t *record_desc, uint64_t sig_offset, write_pipe_t *pipe) {
+	if (sig_offset != 0) {
+		pipe->staged.push_back(staged_write_t{ctx, recordname, *record_desc, sig_offset});
+		if (pipe->staged.size() >= MID_WRITE_WINDOW)
+			signStaged(pipe);
+		return NO_ERR;
+	}
 
-	if (index_[dcname] != "") {	// inode record exist
-		// read the inode record
-		buf_desc_t record_desc;
-		uint64_t record_size;		
-		alloc_buf_desc(&record_desc, MAX_INODE_RECORD_SIZE);		
-		ret = dcserver_->ReadRecord(dcname, index_[dcname], &record_desc, &record_size);
+	/* records already hashed are independent of each other, so keep up to MID_WRITE_WINDOW in flight */
+	if (pipe->outstanding.size() >= MID_WRITE_WINDOW) {
+		pending_write_t &oldest = pipe->outstanding.front();
+		err_t ret = dcserver_->WaitWrite(oldest.ctx->req->dcname, oldest.recordname);
 		if (ret < 0)
-			return ret;
-		capsule::CapsulePDU ino_pdu;
-		ino_pdu.ParseFromArray(record_desc.buf, record_size);
-		inode_record.blockmap_hash = ino_pdu.header().prevhash(1);
-
-		memcpy(inode_record.key, ino_pdu.payload_in_transit().c_str() + INODE_AES_KEY_OFFSET, AES_KEY_LEN);
-		//memcpy(key, inode_record.key, 16);
+			oldest.ctx->req->ret = ret;
+		pipe->outstanding.pop_front();
+	}
 
-		// read the blockmap record
-		dealloc_buf_desc(&record_desc);
-		alloc_buf_desc(&record_desc, MAX_BLOCKMAP_RECORD_SIZE);
-		ret = dcserver_->ReadRecord(dcname, inode_record.blockmap_hash, &record_desc, &record_size);
-		if (ret < 0)
-			return ret;
+	err_t ret = dcserver_->SubmitWrite(ctx->req->dcname, recordname, record_desc);
+	dealloc_buf_desc(record_desc);
+	if (ret < 0)
+		return ret;
+	pipe->outstanding.push_back(pending_write_t{ctx, recordname});
 
-		capsule::CapsulePDU bm_pdu;
-		bm_pdu.ParseFromArray(record_desc.buf, record_size);
-		blockmap_record.hash_to_latest_data_block = bm_pdu.header().prevhash(1);
+	return NO_ERR;
+}
 
-		uint64_t offset = 0;	
-		while (offset < bm_pdu.payload_in_transit().size()) {
-			std::string hashname;
-			hashname = std::string(bm_pdu.payload_in_transit().data() + offset, HASHLEN_IN_BYTES);
-			blockmap_record.data_hashes.push_back(hashname);
-			offset += HASHLEN_IN_BYTES;
+void DCFSMidSim::signStaged(write_pipe_t *pipe) {
+	std::vector<RecordSigner::job_t> jobs;
+	for (auto &w : pipe->staged)
+		jobs.push_back(RecordSigner::job_t{w.record_desc.buf, w.sig_offset, w.recordname});
+	err_t signed_ret = signer_->Sign(&jobs);
+
+	std::vector<staged_write_t> staged;
+	staged.swap(pipe->staged);
+	for (auto &w : staged) {
+		if (signed_ret < 0)
+			w.ctx->req->ret = signed_ret;
+		if (w.ctx->req->ret < 0) {
+			dealloc_buf_desc(&w.record_desc);
+			continue;
 		}
+		err_t ret = submitWrite(w.ctx, w.recordname, &w.record_desc, 0, pipe);
+		if (ret < 0)
+			w.ctx->req->ret = ret;
+	}
+}
 
-		dealloc_buf_desc(&record_desc);
-	} else {
-		memcpy(inode_record.key, aes_key.c_str(), AES_KEY_LEN);
+void DCFSMidSim::drainWrites(write_pipe_t *pipe) {
+	signStaged(pipe);
+
+	// collect every ack even after a failure so no write is left pending on the DC server side
+	while (!pipe->outstanding.empty()) {
+		pending_write_t &oldest = pipe->outstanding.front();
+		err_t ret = dcserver_->WaitWrite(oldest.ctx->req->dcname, oldest.recordname);
+		if (ret < 0)
+			oldest.ctx->req->ret = ret;
+		pipe->outstanding.pop_front();
 	}
-	// else { 
-	//	memcpy(key, aes_key.c_str(), AES_KEY_LEN);
-	//}
+}
+
+err_t DCFSMidSim::signRecord(buf_desc_t *record_desc, uint64_t sig_offset, std::string hashname) {
+	if (sig_offset == 0)
+		return NO_ERR;
 
+	std::vector<RecordSigner::job_t> jobs(1, RecordSigner::job_t{record_desc->buf, sig_offset, hashname});
+	return signer_->Sign(&jobs);
+}
+
+err_t DCFSMidSim::beginModify(modify_ctx_t *ctx) {
+	err_t ret;
+	std::string dcname = ctx->req->dcname;
+
+	ret = index_.Resolve(dcname);
+	if (ret < 0)
+		return ret;
+	if (!index_.Find(dcname, &ctx->latest_inode_hash))
+		return ERR_NOT_FOUND;
 
-	// Push order: data blocks -> blockmap -> inode
+	/* Check latest inode hash. If there is no latest inode hash, then assume this is the first modify. */
+	if (ctx->req->inode_hash != ctx->latest_inode_hash)  {
+		return -1; //CHANGE THE ERROR CODE: TODO
+	}
 
-	// create and push new data blocks
-	std::string data_block_hashname = "";
+	/**
+	 * Take the latest inode/blockmap state out of the cache; read it back only on a miss.
+	 * It is reinserted only after the new inode record is published, so a failed Modify leaves no stale entry.
+	*/
+	if (ctx->latest_inode_hash != "") {	// inode record exist
+		if (!takeFileState(dcname, ctx->latest_inode_hash, &ctx->state)) {
+			ret = loadFileState(dcname, ctx->latest_inode_hash, &ctx->state);
+			if (ret < 0)
+				return ret;
+		}
+	} else {
+		memcpy(ctx->state.inode.key, ctx->req->aes_key.c_str(), AES_KEY_LEN);
+	}
 
-	// encrypt everything in descs
+	return NO_ERR;
+}
 
-	for (auto desc: *descs) {
-		/*
-		char* encrypted_buf = new char[desc.size];
-		char iv[16];
-		if (!Util::generate_symmetric_key(iv)) {
-			return -1; //UJJAINI FIX ERROR
-		};
-		// MILES: outlen should be something else?
-		if (!Util::encrypt_symmetric(key, iv, desc.buf, desc.size, encrypted_buf, desc.size)) {
-			return -1; //UJJAINI FIX ERROR TODO
+err_t DCFSMidSim::writeDataRecords(modify_ctx_t *ctx, write_pipe_t *pipe) {
+	err_t ret;
+	std::string dcname = ctx->req->dcname;
+	BlockMapRecord &blockmap_record = ctx->state.blockmap;
+	std::string &data_block_hashname = ctx->data_block_hashname;
+
+	// identical convergent blocks of one request: the first is written, the blockmap references it for the rest
+	std::unordered_map<std::string, std::string> convergent_records; // payload hash -> recordname
+
+	// descs are encrypted by the client
+	for (auto &desc: *ctx->req->descs) {
+		if (desc.recordname == "" && desc.convergent && desc.payload_hash.size() == HASHLEN_IN_BYTES) {
+			auto match = convergent_records.find(desc.payload_hash);
+			if (match != convergent_records.end())
+				desc.recordname = match->second;
+		}
+		// deduplicated block: the record already exists on the DC server, only the blockmap references it
+		if (desc.recordname != "") {
+			ctx->new_data_blocks.push_back(std::make_pair(desc.file_offset, desc.recordname));
+			continue;
 		}
-		desc.buf = encrypted_buf;
-		*/
+
 		std::vector<std::string> new_data_block_hashes;
 		if (data_block_hashname == "") {
 			if (blockmap_record.hash_to_latest_data_block != "")
@@ -315,96 +534,336 @@ err_t DCFSMidSim::Modify(std::string dcname, const std::vector<buf_desc_t> *desc
 			new_data_block_hashes.push_back(data_block_hashname);
 
 		buf_desc_t record_desc; 
-		ret = composeRecord(DATABLOCK, &new_data_block_hashes, &desc, &record_desc, &data_block_hashname);
+		uint64_t sig_offset;
+		ret = composeRecord(desc.convergent ? CDATABLOCK : DATABLOCK, &new_data_block_hashes, &desc, &record_desc, &data_block_hashname, &sig_offset);
 		if (ret < 0)
 			return ret;
-		ret = dcserver_->WriteRecord(dcname, data_block_hashname, &record_desc);
+		ret = submitWrite(ctx, data_block_hashname, &record_desc, sig_offset, pipe);
 		if (ret < 0)
 			return ret;
-		new_data_blocks.push_back(std::make_pair(desc.file_offset, data_block_hashname));
 
-		dealloc_buf_desc(&record_desc);
+		ctx->new_data_blocks.push_back(std::make_pair(desc.file_offset, data_block_hashname));
+		desc.recordname = data_block_hashname;
+		if (desc.convergent && desc.payload_hash.size() == HASHLEN_IN_BYTES)
+			convergent_records[desc.payload_hash] = data_block_hashname;
 	}
 
-	// update the blockmap record
-	std::string new_blockmap_hashname;
-	{
-		std::vector<std::string> new_blockmap_hashes;
-		if (inode_record.blockmap_hash != "")
-			new_blockmap_hashes.push_back(inode_record.blockmap_hash);
+	// the data chain only covers records written to this DataCapsule
+	if (data_block_hashname == "") {
+		if (blockmap_record.hash_to_latest_data_block != "")
+			data_block_hashname = blockmap_record.hash_to_latest_data_block;
 		else
-			new_blockmap_hashes.push_back(dcname); // points to the DC meta record if this is the first blockmap record
-		new_blockmap_hashes.push_back(new_data_blocks[new_data_blocks.size() - 1].second);
-
-		for (auto block: new_data_blocks) {
-			if (block.first < inode_record.isize) 
-				blockmap_record.data_hashes[block.first / (DEFAULT_BLOCK_SIZE_IN_KB * 1024)] = block.second;
-			else 
-				blockmap_record.data_hashes.push_back(block.second); 
-		}
-		buf_desc_t data_desc;
-		data_desc.size = blockmap_record.data_hashes.size() * HASHLEN_IN_BYTES;
-		data_desc.buf = new char[data_desc.size];
-		uint64_t offset = 0;
-		for (auto hash: blockmap_record.data_hashes) {
-			memcpy(data_desc.buf + offset, hash.c_str(), HASHLEN_IN_BYTES);
-			offset += HASHLEN_IN_BYTES;
-		}
+			data_block_hashname = dcname;
+	}
 
-		buf_desc_t record_desc;
-		ret = composeRecord(BLOCKMAP, &new_blockmap_hashes, &data_desc, &record_desc, &new_blockmap_hashname);
-		if (ret < 0)
-			return ret;
-		ret = dcserver_->WriteRecord(dcname, new_blockmap_hashname, &record_desc);
-		if (ret < 0)
-			return ret;
+	return NO_ERR;
+}
 
-		dealloc_buf_desc(&data_desc);
+err_t DCFSMidSim::writeBlockMap(modify_ctx_t *ctx, write_pipe_t *pipe) {
+	err_t ret;
+	std::string dcname = ctx->req->dcname;
+	InodeRecord &inode_record = ctx->state.inode;
+	BlockMapRecord &blockmap_record = ctx->state.blockmap;
+	std::string &data_block_hashname = ctx->data_block_hashname;
+	std::string &new_blockmap_hashname = ctx->new_blockmap_hashname;
+
+	std::vector<std::string> new_blockmap_hashes;
+	if (inode_record.blockmap_hash != "")
+		new_blockmap_hashes.push_back(inode_record.blockmap_hash);
+	else
+		new_blockmap_hashes.push_back(dcname); // points to the DC meta record if this is the first blockmap record
+	new_blockmap_hashes.push_back(data_block_hashname);
+
+	for (auto block: ctx->new_data_blocks) {
+		uint64_t blk_idx = block.first / (DEFAULT_BLOCK_SIZE_IN_KB * 1024);
+		if ((blk_idx + 1) * HASHLEN_IN_BYTES > blockmap_record.data_hashes.size())
+			blockmap_record.data_hashes.resize((blk_idx + 1) * HASHLEN_IN_BYTES, 0); // holes read as zero blocks
+		memcpy(blockmap_record.data_hashes.data() + blk_idx * HASHLEN_IN_BYTES, block.second.c_str(), HASHLEN_IN_BYTES);
+	}
+	blockmap_record.hash_to_latest_data_block = data_block_hashname;
+
+	// delta: only the changed entries, taken from the updated map so a block written twice appears once
+	std::set<uint64_t> changed;
+	for (auto block: ctx->new_data_blocks)
+		changed.insert(block.first / (DEFAULT_BLOCK_SIZE_IN_KB * 1024));
+
+	uint64_t nblocks = blockmap_record.data_hashes.size() / HASHLEN_IN_BYTES;
+	std::vector<char> delta(BLOCKMAP_DELTA_ENTRY_OFFSET + changed.size() * BLOCKMAP_DELTA_ENTRY_SIZE);
+	memcpy(delta.data() + BLOCKMAP_DELTA_NBLOCKS_OFFSET, &nblocks, sizeof(uint64_t));
+	char *entry = delta.data() + BLOCKMAP_DELTA_ENTRY_OFFSET;
+	for (auto blk_idx: changed) {
+		memcpy(entry, &blk_idx, sizeof(uint64_t));
+		memcpy(entry + sizeof(uint64_t), blockmap_record.data_hashes.data() + blk_idx * HASHLEN_IN_BYTES, HASHLEN_IN_BYTES);
+		entry += BLOCKMAP_DELTA_ENTRY_SIZE;
+	}
+
+	/**
+	 * Checkpoint with a full blockmap every BLOCKMAP_DELTA_MAX_CHAIN deltas, or once the deltas
+	 * since the last one would add up to more than a full blockmap, so readers replay a bounded chain.
+	*/
+	blockmap_chain_t &chain = blockmap_record.chain;
+	bool full = (inode_record.blockmap_hash == "" || chain.full_hash == ""
+			|| chain.deltas + 1 > BLOCKMAP_DELTA_MAX_CHAIN
+			|| chain.delta_bytes + delta.size() > blockmap_record.data_hashes.size());
+
+	buf_desc_t data_desc;
+	if (full) {
+		data_desc.buf = blockmap_record.data_hashes.data();
+		data_desc.size = blockmap_record.data_hashes.size();
+	} else {
+		new_blockmap_hashes.push_back(chain.full_hash);
+		data_desc.buf = delta.data();
+		data_desc.size = delta.size();
+	}
+
+	buf_desc_t record_desc;
+	uint64_t sig_offset;
+	ret = composeRecord(full ? BLOCKMAP : BLOCKMAP_DELTA, &new_blockmap_hashes, &data_desc, &record_desc, &new_blockmap_hashname, &sig_offset);
+	if (ret < 0)
+		return ret;
+	ret = submitWrite(ctx, new_blockmap_hashname, &record_desc, sig_offset, pipe);
+	if (ret < 0)
+		return ret;
+
+	if (full) {
+		chain.full_hash = new_blockmap_hashname;
+		chain.deltas = 0;
+		chain.delta_bytes = 0;
+	} else {
+		chain.deltas++;
+		chain.delta_bytes += delta.size();
+	}
+	chain.latest_data_hash = data_block_hashname;
+
+	return NO_ERR;
+}
+
+err_t DCFSMidSim::writeInode(modify_ctx_t *ctx, write_pipe_t *pipe) {
+	err_t ret;
+	std::string dcname = ctx->req->dcname;
+	InodeRecord &inode_record = ctx->state.inode;
+
+	std::vector<std::string> new_inode_hashes;
+	if (ctx->latest_inode_hash != "")
+		new_inode_hashes.push_back(ctx->latest_inode_hash);
+	else
+		new_inode_hashes.push_back(dcname); // points to the DC meta record if this is the first inode record
+	new_inode_hashes.push_back(ctx->new_blockmap_hashname);
+
+	for (auto block: ctx->new_data_blocks) {
+		if (inode_record.isize < block.first + DEFAULT_BLOCK_SIZE_IN_KB * 1024)
+			inode_record.isize = block.first + DEFAULT_BLOCK_SIZE_IN_KB * 1024;
+	}
+	inode_record.blockmap_hash = ctx->new_blockmap_hashname;
+	inode_record.version = (ctx->latest_inode_hash != "") ? inode_record.version + 1 : 0;
+
+	// losing a checkpoint only means the next one chains to the previous, the Modify itself goes on
+	if (inode_record.version % CHECKPOINT_INTERVAL == CHECKPOINT_INTERVAL - 1 && writeCheckpoint(ctx) < 0)
+		Logger::log(WARNING, "DCFSMidSim: failed to write checkpoint of " + Util::binary_to_hex_string(dcname.c_str(), dcname.size()));
+	if (inode_record.checkpoint_hash != "")
+		new_inode_hashes.push_back(inode_record.checkpoint_hash);
+
+	char payload[INODE_PAYLOAD_SIZE];
+	buf_desc_t data_desc;
+	data_desc.size = INODE_PAYLOAD_SIZE;
+	data_desc.buf = payload;
+	
+	memcpy(data_desc.buf, &inode_record.isize, sizeof(uint64_t));
+
+	// UJJAINI: add in the symmetric encrypt key to the inode -- likely needs to be encrypted with middleware sym key
+	unsigned char encryped_symmetric_key[AES_KEY_LEN + AES_PAD_LEN];
+	int outlen;
+	Util::encrypt_symmetric(symmetric_middleware_key_, NULL, (unsigned char *)inode_record.key, AES_KEY_LEN, encryped_symmetric_key, &outlen);
+	assert(outlen == AES_KEY_LEN + AES_PAD_LEN);
+	memcpy(data_desc.buf + INODE_AES_KEY_OFFSET, encryped_symmetric_key, AES_KEY_LEN + AES_PAD_LEN);
+	memcpy(data_desc.buf + INODE_VERSION_OFFSET, &inode_record.version, sizeof(uint64_t));
+
+	buf_desc_t record_desc;
+	uint64_t sig_offset;
+	ret = composeRecord(INODE, &new_inode_hashes, &data_desc, &record_desc, &ctx->new_inode_hashname, &sig_offset);
+	if (ret < 0)
+		return ret;
+
+	// the intent is durable before the record leaves, so a restart can find it on the DC server
+	ret = index_.Prepare(dcname, ctx->new_inode_hashname);
+	if (ret < 0) {
 		dealloc_buf_desc(&record_desc);
+		return ret;
+	}
+	ctx->prepared = true;
+
+	return submitWrite(ctx, ctx->new_inode_hashname, &record_desc, sig_offset, pipe);
+}
+
+void DCFSMidSim::finishModify(modify_ctx_t *ctx) {
+	std::string dcname = ctx->req->dcname;
+
+	if (!ctx->prepared)
+		return;
+
+	if (ctx->req->ret < 0) {
+		index_.Abort(dcname, ctx->new_inode_hashname);
+		return;
 	}
 
-	// update inode record
-	{		
-		std::string new_inode_hashname;
-		std::vector<std::string> new_inode_hashes;
-		if (index_[dcname] != "")
-			new_inode_hashes.push_back(index_[dcname]);
+	ctx->req->ret = index_.Commit(dcname, ctx->new_inode_hashname);
+	if (ctx->req->ret < 0)
+		return;
+	putFileState(dcname, ctx->new_inode_hashname, &ctx->state);
+}
+
+/**
+ * Summarize the chain heads of the inode record about to be written, which then links the checkpoint.
+ * Its blockmap and data records are acked by now and its predecessor is committed,
+ * so a checkpoint never points at a record that may not exist.
+*/
+err_t DCFSMidSim::writeCheckpoint(modify_ctx_t *ctx) {
+	std::string dcname = ctx->req->dcname;
+	InodeRecord &inode_record = ctx->state.inode;
+	uint64_t seq = inode_record.version / CHECKPOINT_INTERVAL;
+
+	std::vector<std::string> hashes;
+	hashes.push_back(inode_record.checkpoint_hash != "" ? inode_record.checkpoint_hash : dcname);
+	hashes.push_back(ctx->latest_inode_hash);
+	hashes.push_back(ctx->new_blockmap_hashname);
+	hashes.push_back(ctx->data_block_hashname);
+	hashes.push_back(ctx->state.blockmap.chain.full_hash);
+
+	char payload[CHECKPOINT_PAYLOAD_SIZE];
+	memcpy(payload + CHECKPOINT_SEQ_OFFSET, &seq, sizeof(uint64_t));
+	memcpy(payload + CHECKPOINT_VERSION_OFFSET, &inode_record.version, sizeof(uint64_t));
+	memcpy(payload + CHECKPOINT_ISIZE_OFFSET, &inode_record.isize, sizeof(uint64_t));
+	buf_desc_t data_desc;
+	data_desc.buf = payload;
+	data_desc.size = CHECKPOINT_PAYLOAD_SIZE;
+
+	buf_desc_t record_desc;
+	std::string hashname;
+	uint64_t sig_offset;
+	err_t ret = composeRecord(CHECKPOINT, &hashes, &data_desc, &record_desc, &hashname, &sig_offset);
+	if (ret < 0)
+		return ret;
+	ret = signRecord(&record_desc, sig_offset, hashname);
+	if (ret == NO_ERR)
+		ret = dcserver_->WriteRecord(dcname, hashname, &record_desc);
+	dealloc_buf_desc(&record_desc);
+	if (ret < 0)
+		return ret;
+	inode_record.checkpoint_hash = hashname;
+
+	return NO_ERR;
+}
+
+/**
+ * Push order per file: data blocks -> blockmap -> inode.
+ * Each phase runs over all files before its acks are collected, so a batch of files
+ * costs three write round trips instead of three per file.
+*/
+err_t DCFSMidSim::modifyFiles(std::vector<modify_req_t> *reqs) {
+	std::vector<modify_ctx_t> ctxs(reqs->size());
+	write_pipe_t pipe;
+	std::set<std::string> dcnames;
+
+	for (size_t i = 0; i < reqs->size(); i++) {
+		ctxs[i].req = &(*reqs)[i];
+		ctxs[i].req->ret = NO_ERR;
+		if (!dcnames.insert(ctxs[i].req->dcname).second) // the second request would not chain to the first
+			ctxs[i].req->ret = ERR_CONFLICT;
 		else
-			new_inode_hashes.push_back(dcname); // points to the DC meta record if this is the first inode record
-		new_inode_hashes.push_back(new_blockmap_hashname);
+			ctxs[i].req->ret = beginModify(&ctxs[i]);
+	}
 
-		if (inode_record.isize <= descs->size() * DEFAULT_BLOCK_SIZE_IN_KB * 1024) {
-			inode_record.isize = descs->size() * DEFAULT_BLOCK_SIZE_IN_KB * 1024;
-		}	
-		inode_record.blockmap_hash = new_blockmap_hashname;
+	for (auto &ctx : ctxs) {
+		if (ctx.req->ret == NO_ERR)
+			ctx.req->ret = writeDataRecords(&ctx, &pipe);
+	}
+	// every data record must be acked before the blockmap that references it is written
+	drainWrites(&pipe);
 
-		buf_desc_t data_desc;
-		data_desc.size = INODE_PAYLOAD_SIZE;
-		data_desc.buf = new char[INODE_PAYLOAD_SIZE];
-		
-		memcpy(data_desc.buf, &inode_record.isize, sizeof(uint64_t));
+	for (auto &ctx : ctxs) {
+		if (ctx.req->ret == NO_ERR)
+			ctx.req->ret = writeBlockMap(&ctx, &pipe);
+	}
+	drainWrites(&pipe);
+
+	for (auto &ctx : ctxs) {
+		if (ctx.req->ret == NO_ERR)
+			ctx.req->ret = writeInode(&ctx, &pipe);
+	}
+	drainWrites(&pipe);
 
-		// UJJAINI: add in the symmetric encrypt key to the inode -- likely needs to be encrypted with middleware sym key
-		unsigned char encryped_symmetric_key[AES_KEY_LEN + AES_PAD_LEN];
-		int outlen;
-		Util::encrypt_symmetric(symmetric_middleware_key_, NULL, (unsigned char *)inode_record.key, AES_KEY_LEN, encryped_symmetric_key, &outlen);
-		assert(outlen == AES_KEY_LEN + AES_PAD_LEN);
-		memcpy(data_desc.buf + INODE_AES_KEY_OFFSET, encryped_symmetric_key, AES_KEY_LEN + AES_PAD_LEN);
+	for (auto &ctx : ctxs)
+		finishModify(&ctx);
 
-		buf_desc_t record_desc;
-		ret = composeRecord(INODE, &new_inode_hashes, &data_desc, &record_desc, &new_inode_hashname);
-		if (ret < 0)
-			return ret;
-		ret = dcserver_->WriteRecord(dcname, new_inode_hashname, &record_desc);
+	return NO_ERR;
+}
+
+/* the MAC covers payload_hash instead of buf, so a block whose bytes do not match it would be signed as it */
+err_t DCFSMidSim::checkPayloadHashes(const std::vector<buf_desc_t> *descs) {
+	for (auto &desc : *descs) {
+		if (desc.payload_hash.size() == 0)
+			continue; // buf itself is digested and hashed
+		unsigned char hash[HASHLEN_IN_BYTES];
+		if (desc.payload_hash.size() != HASHLEN_IN_BYTES || !desc.buf)
+			return ERR_VERIFY;
+		if (!Util::hash256((void *)desc.buf, desc.size, hash))
+			return ERR_HASH;
+		if (CRYPTO_memcmp(hash, desc.payload_hash.c_str(), HASHLEN_IN_BYTES) != 0)
+			return ERR_VERIFY;
+	}
+
+	return NO_ERR;
+}
+
+err_t DCFSMidSim::Modify(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_hash, std::string aes_key, const unsigned char *sig, size_t siglen) {	
+	err_t ret;
+
+	// verify arguments
+	ret = checkPayloadHashes(descs);
+	if (ret < 0)
+		return ret;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	ret = digest_modify_args(dcname, descs, inode_hash, aes_key, hash);
+	if (ret < 0)
+		return ret;
+
+	if (!verifyRequest(hash, sig, siglen)) {
+		return ERR_VERIFY;
+	}
+
+	std::vector<modify_req_t> reqs(1);
+	reqs[0].dcname = dcname;
+	reqs[0].descs = descs;
+	reqs[0].inode_hash = inode_hash;
+	reqs[0].aes_key = aes_key;
+
+	ret = modifyFiles(&reqs);
+	if (ret < 0)
+		return ret;
+
+	return reqs[0].ret;
+}
+
+err_t DCFSMidSim::ModifyBatch(std::vector<modify_req_t> *reqs, const unsigned char *sig, size_t siglen) {
+	err_t ret;
+
+	for (auto &req : *reqs) {
+		ret = checkPayloadHashes(req.descs);
 		if (ret < 0)
 			return ret;
-		index_[dcname] = new_inode_hashname;
+	}
 
-		dealloc_buf_desc(&data_desc);
-		dealloc_buf_desc(&record_desc);
+	// one verification for the whole batch
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	ret = digest_modify_batch(reqs, hash);
+	if (ret < 0)
+		return ret;
+
+	if (!verifyRequest(hash, sig, siglen)) {
+		return ERR_VERIFY;
 	}
 
-	return NO_ERR;
+	return modifyFiles(reqs);
 }
 
 err_t DCFSMidSim::DecryptAESKey(std::string recordname, 
@@ -413,12 +872,17 @@ err_t DCFSMidSim::DecryptAESKey(std::string recordname,
 					const unsigned char *sig, size_t siglen) {
 	unsigned char aes_key_buf[AES_KEY_LEN + AES_PAD_LEN];
 
+	// a key wrapped under other middleware keys fails the padding check, or decrypts to the wrong length
 	int outlen = 0;
-	Util::decrypt_symmetric(symmetric_middleware_key_, NULL, (unsigned char *)encrypted_key.c_str(), encrypted_key.length(), aes_key_buf, &outlen);
-
-	assert(outlen == AES_KEY_LEN);
+	if (encrypted_key.length() > sizeof(aes_key_buf)
+			|| Util::decrypt_symmetric(symmetric_middleware_key_, NULL, (unsigned char *)encrypted_key.c_str(), encrypted_key.length(), aes_key_buf, &outlen) <= 0
+			|| outlen != AES_KEY_LEN) {
+		OPENSSL_cleanse(aes_key_buf, sizeof(aes_key_buf));
+		return ERR_CRYPTO;
+	}
 
 	*aes_key = std::string((char *)aes_key_buf, outlen);
+	OPENSSL_cleanse(aes_key_buf, sizeof(aes_key_buf));
 
 	return NO_ERR;
 }
@@ -0,0 +1,448 @@
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "backend.hpp"
+#include "util/logging.hpp"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t align_down(uint64_t x) {
+	return x & ~(uint64_t)(URING_DIRECT_ALIGN - 1);
+}
+
+static uint64_t align_up(uint64_t x) {
+	return align_down(x + URING_DIRECT_ALIGN - 1);
+}
+
+DCServerUring::buf_pool::~buf_pool() {
+	free(mem);
+}
+
+DCServerUring::DCServerUring(std::string dir, bool direct, durability_mode durability, uint64_t sync_window_us)
+		: DCServerSeg(dir, durability, sync_window_us), ring_fd_(-1), sq_ring_(NULL), cq_ring_(NULL),
+		sqes_(NULL), to_submit_(0), fixed_(false), direct_(direct), inflight_(0), inflight_writes_(0), reaping_(false), hole_(false) {
+	pool_ = std::make_shared<buf_pool>();
+	if (posix_memalign((void **)&pool_->mem, URING_DIRECT_ALIGN, (size_t)URING_BUFS * URING_BUF_SIZE) != 0)
+		pool_->mem = NULL;
+	for (uint32_t i = 0; pool_->mem && i < URING_BUFS; i++)
+		pool_->free_slots.push_back(i);
+
+	if (setupRing() < 0)
+		Logger::log(WARNING, "DCServerUring: io_uring unavailable, reading and writing synchronously");
+}
+
+DCServerUring::~DCServerUring() {
+	if (ring_fd_ >= 0) {
+		{
+			std::lock_guard<std::mutex> wlock(write_m_);
+			quiesce();
+		}
+		// the kernel may still hold buffers of reads nobody waited for
+		std::unique_lock<std::mutex> lock(ops_m_);
+		reap(lock, [&] { return inflight_ == 0; });
+		lock.unlock();
+
+		munmap(sqes_, sqes_size_);
+		if (cq_ring_ != sq_ring_)
+			munmap(cq_ring_, cq_ring_size_);
+		munmap(sq_ring_, sq_ring_size_);
+		close(ring_fd_);
+	}
+
+	for (int fd : direct_fds_) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+int DCServerUring::setupRing() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+
+	sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+	sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq_ring_ = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_
+			: mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size_);
+		if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+			munmap(cq_ring_, cq_ring_size_);
+		if (sq_ring_ != MAP_FAILED)
+			munmap(sq_ring_, sq_ring_size_);
+		close(fd);
+		return -1;
+	}
+
+	char *sq = (char *)sq_ring_;
+	sq_head_ = (unsigned *)(sq + p.sq_off.head);
+	sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask_ = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array_ = (unsigned *)(sq + p.sq_off.array);
+	char *cq = (char *)cq_ring_;
+	cq_head_ = (unsigned *)(cq + p.cq_off.head);
+	cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask_ = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes_ = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	sqes_ = (struct io_uring_sqe *)sqes;
+	sq_entries_ = p.sq_entries;
+	cq_entries_ = p.cq_entries;
+	ring_fd_ = fd;
+
+	// registered buffers spare the kernel pinning pages on every transfer; without them the pool is plain memory
+	if (pool_->mem) {
+		std::vector<struct iovec> iovs(URING_BUFS);
+		for (uint32_t i = 0; i < URING_BUFS; i++)
+			iovs[i] = {pool_->mem + (uint64_t)i * URING_BUF_SIZE, URING_BUF_SIZE};
+		fixed_ = io_uring_register(fd, IORING_REGISTER_BUFFERS, iovs.data(), URING_BUFS) == 0;
+	}
+
+	return 0;
+}
+
+/* a pool buffer if one is free, never waiting for one: refs may keep them for long */
+bool DCServerUring::getStaging(uint64_t len, staging *st) {
+	if (len <= URING_BUF_SIZE) {
+		std::lock_guard<std::mutex> lock(pool_->m);
+		if (!pool_->free_slots.empty()) {
+			int slot = pool_->free_slots.back();
+			pool_->free_slots.pop_back();
+			std::shared_ptr<buf_pool> pool = pool_;
+			st->slot = slot;
+			st->buf = pool_->mem + (uint64_t)slot * URING_BUF_SIZE;
+			st->pin = std::shared_ptr<const void>(st->buf, [pool, slot](const void *) {
+				std::lock_guard<std::mutex> lock(pool->m);
+				pool->free_slots.push_back(slot);
+			});
+			return true;
+		}
+	}
+
+	void *buf;
+	if (posix_memalign(&buf, URING_DIRECT_ALIGN, align_up(len)) != 0)
+		return false;
+	st->slot = -1;
+	st->buf = (char *)buf;
+	st->pin = std::shared_ptr<const void>(buf, [](const void *p) { free((void *)p); });
+	return true;
+}
+
+/* waits until the completion queue has room for one more op */
+void DCServerUring::admit() {
+	std::unique_lock<std::mutex> lock(ops_m_);
+	reap(lock, [&] { return inflight_ < cq_entries_; });
+	inflight_++;
+}
+
+/* puts op (admitted) on the submission queue; the kernel sees it at the next submit */
+void DCServerUring::queue(op_t *op, int fd, uint64_t offset) {
+	std::lock_guard<std::mutex> lock(ring_m_);
+	unsigned tail = *sq_tail_;
+	if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+		submit();
+
+	unsigned idx = tail & *sq_mask_;
+	struct io_uring_sqe *sqe = &sqes_[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	bool fixed = fixed_ && op->st.slot >= 0;
+	if (op->write)
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	else
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uint64_t)op->st.buf;
+	sqe->len = op->len;
+	if (fixed)
+		sqe->buf_index = op->st.slot;
+	sqe->user_data = (uint64_t)op;
+	sq_array_[idx] = idx;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+	if (++to_submit_ >= URING_SUBMIT_BATCH)
+		submit();
+}
+
+/* caller holds ring_m_ */
+void DCServerUring::submit() {
+	while (to_submit_ > 0) {
+		int n = io_uring_enter(ring_fd_, to_submit_, 0, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			Logger::log(ERROR, "DCServerUring: io_uring_enter failed: " + std::string(strerror(errno)));
+			return;
+		}
+		to_submit_ -= n;
+	}
+}
+
+void DCServerUring::flush() {
+	std::lock_guard<std::mutex> lock(ring_m_);
+	submit();
+}
+
+err_t DCServerUring::wait(op_t *op) {
+	std::unique_lock<std::mutex> lock(ops_m_);
+	if (!reap(lock, [&] { return op->done; }))
+		return ERR_IO;
+	return op->ret;
+}
+
+/**
+ * Blocks until done() holds, with ops_m_ held through lock. Completions are reaped by the waiting callers,
+ * one at a time, so a result costs no hand-off to another thread; the others sleep until it was reaped.
+ * Returns false if the ring failed.
+*/
+bool DCServerUring::reap(std::unique_lock<std::mutex> &lock, const std::function<bool()> &done) {
+	while (!done()) {
+		if (reaping_) {
+			flush(); // the reaper may have flushed before our op was queued
+			ops_cv_.wait(lock);
+			continue;
+		}
+		reaping_ = true;
+		lock.unlock();
+
+		flush();
+		bool ok = io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) >= 0 || errno == EINTR;
+		if (!ok)
+			Logger::log(ERROR, "DCServerUring: waiting for completions failed: " + std::string(strerror(errno)));
+
+		unsigned head = *cq_head_;
+		unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+			complete((op_t *)cqe->user_data, cqe->res);
+		}
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		lock.lock();
+		reaping_ = false;
+		ops_cv_.notify_all();
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * A failed write leaves a hole in its segment: the hint written when the segment is sealed skips it,
+ * but after a crash the scan on load stops there. So, as GroupSync does after a failed sync,
+ * no write past the hole is acked from then on.
+*/
+void DCServerUring::complete(op_t *op, int res) {
+	if (res < 0 || (uint64_t)res < op->min_len) {
+		Logger::log(ERROR, std::string("DCServerUring: ") + (op->write ? "write" : "read") + " failed: "
+				+ (res < 0 ? std::string(strerror(-res)) : "short transfer"));
+		op->ret = ERR_IO;
+	} else if (op->write) {
+		publish(op->seg, op->offset, op->hdr);
+		op->ticket = sync_.Written(op->len);
+	}
+	if (op->write || op->ret < 0)
+		op->st.pin.reset();
+
+	std::lock_guard<std::mutex> lock(ops_m_);
+	if (op->write) {
+		unwritten_.erase(std::make_pair(op->seg, op->offset));
+		if (op->ret < 0 && (!hole_ || std::make_pair(op->seg, op->offset) < hole_at_)) {
+			hole_ = true;
+			hole_at_ = std::make_pair(op->seg, op->offset);
+		}
+	}
+	op->done = true;
+	inflight_--;
+	if (op->write)
+		inflight_writes_--;
+	ops_cv_.notify_all();
+}
+
+/* caller holds write_m_, so no append is reserved meanwhile */
+void DCServerUring::quiesce() {
+	if (ring_fd_ < 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(ops_m_);
+	reap(lock, [&] { return inflight_writes_ == 0; });
+}
+
+/* O_DIRECT descriptor of segment seg, -1 if direct reads are off or the file system refuses them */
+int DCServerUring::directFd(uint32_t seg, uint32_t seg_id) {
+	std::lock_guard<std::mutex> lock(direct_m_);
+	if (!direct_)
+		return -1;
+
+	if (seg >= direct_fds_.size())
+		direct_fds_.resize(seg + 1, -1);
+	if (direct_fds_[seg] < 0) {
+		direct_fds_[seg] = open(segmentPath(seg_id).c_str(), O_RDONLY | O_DIRECT);
+		if (direct_fds_[seg] < 0) {
+			Logger::log(WARNING, "DCServerUring: no O_DIRECT on " + segmentPath(seg_id) + ", reading through the page cache");
+			direct_ = false;
+		}
+	}
+	return direct_fds_[seg];
+}
+
+err_t DCServerUring::SubmitWrite(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+	if (ring_fd_ < 0)
+		return DCServerSeg::SubmitWrite(dcname, recordname, desc);
+	if (desc->size > UINT32_MAX)
+		return ERR_IO;
+	{
+		std::lock_guard<std::mutex> lock(ops_m_);
+		if (hole_) // it would land past the hole
+			return ERR_IO;
+	}
+
+	// desc may be released once this returns, so the record is staged now
+	op_t *op = new op_t;
+	op->write = true;
+	op->len = sizeof(record_hdr) + desc->size;
+	op->min_len = op->len;
+	if (!getStaging(op->len, &op->st)) {
+		delete op;
+		return ERR_IO;
+	}
+	fillHeader(&op->hdr, dcname, recordname, desc->buf, desc->size);
+	memcpy(op->st.buf, &op->hdr, sizeof(record_hdr));
+	memcpy(op->st.buf + sizeof(record_hdr), desc->buf, desc->size);
+
+	admit();
+	std::lock_guard<std::mutex> wlock(write_m_);
+	err_t ret = reserve(dcname, recordname, desc->size, &op->seg, &op->offset);
+	{
+		std::lock_guard<std::mutex> lock(ops_m_);
+		if (ret < 0) {
+			inflight_--;
+			ops_cv_.notify_all();
+			delete op;
+			return ret;
+		}
+		inflight_writes_++;
+		writes_.insert(std::make_pair(recordname, op));
+		unwritten_.insert(std::make_pair(op->seg, op->offset));
+	}
+	// queued before write_m_ is released, so that quiesce finds it
+	queue(op, segs_[op->seg].fd, op->offset);
+
+	return NO_ERR;
+}
+
+err_t DCServerUring::WaitWrite(std::string dcname, std::string recordname) {
+	op_t *op = NULL;
+	{
+		std::lock_guard<std::mutex> lock(ops_m_);
+		auto match = writes_.find(recordname);
+		if (match != writes_.end()) {
+			op = match->second;
+			writes_.erase(match);
+		}
+	}
+	if (!op)
+		return DCServerSeg::WaitWrite(dcname, recordname); // written synchronously by SubmitWrite
+
+	err_t ret;
+	std::pair<uint32_t, uint64_t> at(op->seg, op->offset);
+	{
+		// not acked before every write ahead of it completed, so that a hole ahead of it is known
+		std::unique_lock<std::mutex> lock(ops_m_);
+		if (!reap(lock, [&] { return op->done && (unwritten_.empty() || *unwritten_.begin() > at); }))
+			ret = ERR_IO;
+		else
+			ret = (hole_ && hole_at_ < at) ? ERR_IO : op->ret;
+	}
+	if (ret == NO_ERR)
+		ret = sync_.Wait(op->ticket);
+	delete op;
+	return ret;
+}
+
+err_t DCServerUring::SubmitRead(std::string dcname, std::string recordname, uint64_t max_size, record_ref_t *ref) {
+	if (ring_fd_ < 0)
+		return DCServer::SubmitRead(dcname, recordname, max_size, ref);
+
+	location loc;
+	uint32_t seg_id;
+	int fd;
+	err_t ret = locate(dcname, recordname, &loc, &seg_id, &fd);
+	if (ret < 0)
+		return ret;
+	if (loc.size > max_size)
+		return ERR_BUF_TOO_SMALL;
+
+	// through the page cache, copying a record out costs more than viewing the mapped segment
+	int direct_fd = directFd(loc.seg, seg_id);
+	if (direct_fd < 0)
+		return ViewRecord(dcname, recordname, max_size, ref);
+
+	// O_DIRECT transfers whole aligned blocks around the record
+	op_t *op = new op_t;
+	op->write = false;
+	uint64_t start = align_down(loc.offset);
+	op->len = align_up(loc.offset + loc.size) - start;
+	op->min_len = loc.offset + loc.size - start; // the segment may end before the last aligned block does
+	if (!getStaging(op->len, &op->st)) {
+		delete op;
+		return ERR_IO;
+	}
+	op->data = op->st.buf + (loc.offset - start);
+	op->size = loc.size;
+
+	admit();
+	{
+		std::lock_guard<std::mutex> lock(ops_m_);
+		reads_[ref] = op;
+	}
+	queue(op, direct_fd, start);
+
+	return NO_ERR;
+}
+
+err_t DCServerUring::WaitRead(record_ref_t *ref) {
+	op_t *op;
+	{
+		std::lock_guard<std::mutex> lock(ops_m_);
+		auto match = reads_.find(ref);
+		if (match == reads_.end())
+			return NO_ERR; // read synchronously by SubmitRead
+		op = match->second;
+		reads_.erase(match);
+	}
+
+	err_t ret = wait(op);
+	if (ret == NO_ERR) {
+		ref->buf = op->data;
+		ref->size = op->size;
+		ref->pin = op->st.pin;
+	}
+	delete op;
+	return ret;
+}
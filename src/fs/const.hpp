@@ -2,6 +2,18 @@
 #define CONST_HPP_
 
 #define BACKEND_MNT_POINT "/tmp/dcfs"
+#define SEGMENT_DIR BACKEND_MNT_POINT "/segments" // DCServerSeg
+#define SEGMENT_SIZE (256ULL * 1024 * 1024) // a record larger than this gets a segment of its own
+#define URING_ENTRIES 256 // submission queue of DCServerUring
+#define URING_SUBMIT_BATCH 32 // queued submissions handed to the kernel at once
+#define URING_BUFS 64 // registered staging buffers
+#define URING_BUF_SIZE (64 * 1024) // a record staged in one must fit, aligned for O_DIRECT; larger ones use the heap
+#define URING_DIRECT_ALIGN 4096
+#define SYNC_WINDOW_US 0 // --sync_window_us: a group is whatever was written while the previous sync ran
+#define SYNC_WINDOW_BYTES (4 * 1024 * 1024) // closes a group commit window early
+#define NETEM_TIMEOUT_MS 200 // --netem: a lost request is resent after this
+#define NETEM_RETRIES 3 // attempts before a request on the emulated network fails
+#define NETEM_MSG_BYTES 128 // get requests and acks on the emulated network
 #define DEFAULT_BLOCK_SIZE_IN_KB 16
 #define HASHLEN_IN_BYTES 32
 
@@ -10,7 +22,32 @@
 
 #define BLOCKMAP_SIZE_IN_KB (DEFAULT_BLOCK_SIZE_IN_KB)
 #define BLOCKMAP_COVER (BLOCKMAP_SIZE_IN_KB * 1024 / HASHLEN_IN_BYTES)
+#define BLOCKMAP_DELTA_MAX_CHAIN 16 // BLOCKMAP_DELTA records between full blockmaps
+#define CHECKPOINT_INTERVAL 64 // inode versions between CHECKPOINT records
 
 #define MAX_FILEMETA_SIZE 1024 * 4
 
+#define KEY_CACHE_ENTRIES 4096 // unwrapped per-file keys kept by the client
+#define VERSION_INDEX_DIR "/tmp/dcfs-versions" // InodeRecord chains known to the client
+#define VERSION_INDEX_FILES 1024 // files whose version chain is kept in memory
+#define DEDUP_INDEX_DIR "/tmp/dcfs-dedup" // convergent records known to the client, a cache
+#define CONVERGENCE_SECRET_FILE ".dcfs/convergence_secret" // under $HOME, unless --convergence_secret=<path>
+#define DEDUP_INDEX_ENTRIES (1024 * 1024) // content ids kept in memory
+#define MID_STATE_CACHE_ENTRIES 1024 // parsed inode/blockmap states kept by the middleware
+#define MID_WRITE_WINDOW 32 // data records in flight per Modify
+#define GROUP_COMMIT_MAX_BATCH 64 // files per ModifyBatch
+#define MID_INDEX_DIR "/tmp/dcfs-mid" // durable middleware index and middleware keys
+#define MID_INDEX_COMPACT_ENTRIES (64 * 1024) // log entries before the index is compacted into a new snapshot
+#define MID_KEYS_MAX_SIZE 512 // stored middleware keys: the AES key and the DER-encoded writer key
+#define MID_IPC_SOCKET "/tmp/dcfs-midd.sock" // default control socket of the middleware daemon
+#define MID_IPC_SLOTS 64 // middleware requests in flight per client
+#define MID_IPC_SLOT_ARGS_SIZE (4 * 1024) // arguments of a request that fit in its slot, larger ones go to the arena
+#define MID_IPC_ARENA_SIZE (256 * 1024 * 1024) // shared payload arena per client (reserved, backed on first touch)
+#define MID_IPC_CHUNK_SIZE (4 * 1024) // arena allocation unit
+#define MID_IPC_SPIN_US 20 // busy-poll before sleeping on the eventfd
+#define MID_DAEMON_WORKERS 8 // daemon threads running Modify requests
+#define RECORD_SIGN_WORKERS 4 // threads signing records composed by the middleware, besides the requester
+#define RECORD_SIG_MAX 72 // DER-encoded ECDSA signature on secp256k1, at most
+#define RECORD_PRESIGS 64 // precomputed ECDSA nonces kept by the signing workers
+
 #endif // CONST_HPP_
\ No newline at end of file
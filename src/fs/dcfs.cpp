@@ -42,6 +42,15 @@ static const struct fuse_opt option_spec[] = {
 	OPTION("--block_size_in_kb=%d", block_size_in_kb),
 	OPTION("--client_ip=%s", client_ip),
 	OPTION("--dcserver_ip=%s", dcserver_ip),
+	OPTION("--strict_auth", strict_auth),
+	OPTION("--convergent", convergent),
+	OPTION("--convergence_secret=%s", convergence_secret),
+	OPTION("--group_commit_us=%d", group_commit_us),
+	OPTION("--middleware=%s", middleware),
+	OPTION("--record_signing=%s", record_signing),
+	OPTION("--netem=%s", netem),
+	OPTION("--replicas=%d", replicas),
+	OPTION("--record_cache_mb=%s", record_cache_mb),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
@@ -53,7 +62,7 @@ uint64_t fd_cnt = 10;
 /**
  * File descriptor table
  * fd is a handle to the file
- * fd_table[fd] = the hashname of the file
+ * fd_table[fd] = the hashname of the file (hashname@version for a past version, see open_version)
  * you can access to the in-memory Inode of the file using the hashname
  * Backend will take care of caching the necessary data if Inode is not in memory
  * */
@@ -71,7 +80,11 @@ static void *dcfs_init(struct fuse_conn_info *conn,
 
 	dcfs->block_size_in_kb = options.block_size_in_kb;
 	init_inode();
-	init_backend(&dcfs->backend);
+	if (init_backend(&dcfs->backend) < 0) {
+		Logger::log(ERROR, "Backend init failed, unmounting");
+		fuse_exit(fuse_get_context()->fuse);
+		return NULL;
+	}
 	Logger::log(INFO, "Backend init finished");
 
 	dcfs->backend->LoadRoot(&dcfs->root); // this does nothing for now
@@ -93,6 +106,27 @@ static void dcfs_destroy(void *userdata)
 }
 
 
+/**
+ * Past versions of a file are opened read-only as "name@N", N = 0 being the first version written.
+ * They are not listed by readdir, and a file actually named "name@N" takes precedence.
+*/
+static Inode *open_version(const char *path) {
+	const char *at = strrchr(path, '@');
+	if (!at || at[1] == '\0' || strspn(at + 1, "0123456789") != strlen(at + 1))
+		return NULL;
+
+	std::string filename(path + 1, at - path - 1);
+	uint64_t version = strtoull(at + 1, NULL, 10);
+
+	DirectoryEntry *ent;
+	dcfs->root->InitReaddir();
+	while((ent = dcfs->root->Readdir())) {
+		if (filename == ent->Filename())
+			return get_inode_version(dcfs, ent->Hashname(), version);
+	}
+	return NULL;
+}
+
 static int dcfs_getattr(const char *path, struct stat *stbuf,
 			 struct fuse_file_info *fi)
 {
@@ -119,6 +153,15 @@ static int dcfs_getattr(const char *path, struct stat *stbuf,
 				break;
 			}
 		}
+		if (res < 0) {
+			auto inode = open_version(path);
+			if (inode) {
+				stbuf->st_mode = S_IFREG | 0444;
+				stbuf->st_nlink = 1;
+				stbuf->st_size = inode->Size();
+				res = 0;
+			}
+		}
 	}
 
 	return res;
@@ -194,17 +237,21 @@ static int dcfs_open(const char *path, struct fuse_file_info *fi)
 			break;
 		}
 	}
-	if (ent == NULL)
-		return -ENOENT;
-
-	Inode *ino = get_inode(dcfs, ent->Hashname());
+	Inode *ino;
+	if (ent) {
+		ino = get_inode(dcfs, ent->Hashname());
+	} else {
+		ino = open_version(path);
+		if (ino && (fi->flags & O_ACCMODE) != O_RDONLY)
+			return -EROFS;
+	}
 	if (!ino)
 		return -ENOENT;
 	
 	ino->Ref();	
 
 	fd = ++fd_cnt;
-	fd_table[fd] = ent->Hashname(); 	
+	fd_table[fd] = ino->Key(); 	
 	fi->fh = fd;
 	// could be used later
 	//if ((fi->flags & O_ACCMODE) != O_RDONLY)
@@ -285,6 +332,8 @@ static int dcfs_write(const char *path, const char *buf, size_t size, off_t offs
 
 	uint64_t write_size;
 	err_t err = inode->Write(buf, offset, size, &write_size);
+	if (err == ERR_READ_ONLY)
+		return -EROFS;
 	if (err < 0) {
 		Logger::log(ERROR, "write error: " + err);
 		return -EIO;
@@ -321,7 +370,7 @@ static int dcfs_flush(const char *path, struct fuse_file_info *fi)
 
 	int cnt	= inode->Unref();		
 	if (cnt == 0) {
-		release_inode(dcfs, inode->Hashname());
+		release_inode(dcfs, inode->Key());
 		if (fi->fh > 0)	
 			fd_table[fi->fh] = "";
 		fi->fh = 0;
@@ -337,6 +386,30 @@ static void show_help(const char *progname)
 {
 	printf("usage: %s [options] <mountpoint>\n\n", progname);
 	printf("File-system specific options:\n"
+	       "    --strict_auth          sign every middleware request with ECDSA\n"
+	       "                           (default: one signed handshake, then HMAC)\n"
+	       "    --convergent           encrypt data blocks with content-derived keys\n"
+	       "                           and skip uploading known duplicates\n"
+	       "    --convergence_secret=<path>\n"
+	       "                           secret convergent keys derive from, created on\n"
+	       "                           first use (default: ~/.dcfs/convergence_secret)\n"
+	       "    --group_commit_us=<n>  batch file flushes arriving within n us into\n"
+	       "                           one middleware commit (default: 0, off)\n"
+	       "    --middleware=<socket>  use the middleware daemon (dcfs-midd) listening\n"
+	       "                           on socket (default: in-process middleware)\n"
+	       "    --record_signing=off|each|batch\n"
+	       "                           writer signatures on records: none, every\n"
+	       "                           record, or inode records only, which commit\n"
+	       "                           to the rest (default: batch)\n"
+	       "    --netem=<key>=<value>,...\n"
+	       "                           emulate the network to the DC servers: rtt_us,\n"
+	       "                           jitter_us, dist=uniform|normal|pareto, bw_mbit,\n"
+	       "                           loss (percent), timeout_ms, seed (default: off)\n"
+	       "    --replicas=<n>         stripe records over the DC servers, n of them\n"
+	       "                           holding each one (default: 0, all of them)\n"
+	       "    --record_cache_mb=<n>  keep up to n MB of records read from the DC\n"
+	       "                           servers, least recently used out first\n"
+	       "                           (default: 64, 0 = off)\n"
 	       "\n");
 }
 
@@ -391,6 +464,42 @@ int main(int argc, char *argv[])
 		Logger::log(INFO, "dcserver ip: " + std::string(options.dcserver_ip));
 		Util::option_map["dcserver_ip"] = std::string(options.dcserver_ip);
 	}
+	if (options.strict_auth) {
+		Logger::log(INFO, "strict auth: per-request signatures");
+		Util::option_map["strict_auth"] = "1";
+	}
+	if (options.convergent) {
+		Logger::log(INFO, "convergent encryption enabled");
+		Util::option_map["convergent"] = "1";
+	}
+	if (options.convergence_secret) {
+		Logger::log(INFO, "convergence secret: " + std::string(options.convergence_secret));
+		Util::option_map["convergence_secret"] = std::string(options.convergence_secret);
+	}
+	if (options.group_commit_us > 0) {
+		Logger::log(INFO, "group commit window: " + std::to_string(options.group_commit_us) + " us");
+		Util::option_map["group_commit_us"] = std::to_string(options.group_commit_us);
+	}
+	if (options.middleware) {
+		Logger::log(INFO, "middleware daemon: " + std::string(options.middleware));
+		Util::option_map["middleware"] = std::string(options.middleware);
+	}
+	if (options.record_signing) {
+		Logger::log(INFO, "record signing: " + std::string(options.record_signing));
+		Util::option_map["record_signing"] = std::string(options.record_signing);
+	}
+	if (options.netem) {
+		Logger::log(INFO, "emulated network: " + std::string(options.netem));
+		Util::option_map["netem"] = std::string(options.netem);
+	}
+	if (options.replicas > 0) {
+		Logger::log(INFO, "replicas per record: " + std::to_string(options.replicas));
+		Util::option_map["replicas"] = std::to_string(options.replicas);
+	}
+	if (options.record_cache_mb) {
+		Logger::log(INFO, "record cache: " + std::string(options.record_cache_mb) + " MB");
+		Util::option_map["record_cache_mb"] = std::string(options.record_cache_mb);
+	}
 
 
 	ret = fuse_main(args.argc, args.argv, &dcfs_oper, NULL);
@@ -16,6 +16,15 @@ struct dcfs_options {
 	uint64_t block_size_in_kb;
 	const char *client_ip;
 	const char *dcserver_ip;
+	int strict_auth;
+	int convergent;
+	const char *convergence_secret;
+	int group_commit_us;
+	const char *middleware;
+	const char *record_signing;
+	const char *netem;
+	int replicas;
+	const char *record_cache_mb;
 	int show_help;
 };
 
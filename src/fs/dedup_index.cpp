@@ -0,0 +1,118 @@
+#include <cstring>
+#include <filesystem>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+
+#include "dedup_index.hpp"
+#include "util/logging.hpp"
+
+namespace fs = std::filesystem;
+
+DedupIndex::DedupIndex(std::string dir, size_t capacity) : dir_(dir), capacity_(capacity), log_fd_(-1) {
+}
+
+DedupIndex::~DedupIndex() {
+	if (log_fd_ >= 0)
+		close(log_fd_);
+}
+
+/* the secret is written to a temporary file and renamed in place, so a crash never leaves a partial one */
+err_t load_convergence_secret(std::string path, unsigned char *secret) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		ssize_t len = read(fd, secret, HMAC_KEY_LEN);
+		close(fd);
+		return len == HMAC_KEY_LEN ? NO_ERR : ERR_IO;
+	}
+	if (errno != ENOENT || RAND_bytes(secret, HMAC_KEY_LEN) != 1)
+		return ERR_IO;
+
+	std::string dir = fs::path(path).parent_path().string();
+	std::error_code ec;
+	if (dir.size() > 0)
+		fs::create_directories(dir, ec);
+	std::string tmp_path = path + ".tmp";
+	fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return ERR_IO;
+	bool ok = write(fd, secret, HMAC_KEY_LEN) == HMAC_KEY_LEN && fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0)
+		return ERR_IO;
+
+	int dir_fd = open(dir.size() > 0 ? dir.c_str() : ".", O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return NO_ERR;
+}
+
+err_t DedupIndex::Load() {
+	std::error_code ec;
+	fs::create_directories(dir_, ec);
+
+	std::string path = dir_ + "/log";
+	log_fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (log_fd_ < 0)
+		return ERR_IO;
+
+	struct stat st = {};
+	if (fstat(log_fd_, &st) < 0)
+		return ERR_IO;
+	std::vector<entry_t> stored(st.st_size / sizeof(entry_t));
+	ssize_t len = stored.size() * sizeof(entry_t);
+	if (pread(log_fd_, stored.data(), len, 0) != len)
+		return ERR_IO;
+
+	// drop a torn tail: it was never synced, so no record references it
+	if (st.st_size != len) {
+		Logger::log(WARNING, "DedupIndex: truncating " + path + " to " + std::to_string(stored.size()) + " records");
+		if (ftruncate(log_fd_, len) < 0)
+			return ERR_IO;
+	}
+
+	std::lock_guard<std::mutex> lock(m_);
+	for (auto &e : stored)
+		insert(e);
+	return NO_ERR;
+}
+
+bool DedupIndex::Find(const std::string &dcname, const std::string &content_id, std::string *recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	auto match = by_content_.find(dcname + content_id);
+	if (match == by_content_.end())
+		return false;
+
+	*recordname = match->second;
+	return true;
+}
+
+/* synced before the records can be found, so a block map never references a record that was not acked */
+err_t DedupIndex::Insert(const std::vector<entry_t> &entries) {
+	if (entries.empty())
+		return NO_ERR;
+
+	std::lock_guard<std::mutex> lock(m_);
+	ssize_t len = entries.size() * sizeof(entry_t);
+	if (write(log_fd_, entries.data(), len) != len || fdatasync(log_fd_) < 0)
+		return ERR_IO;
+
+	for (auto &e : entries)
+		insert(e);
+	return NO_ERR;
+}
+
+/* a missed duplicate only costs an upload, so dropping an arbitrary entry when full is fine */
+void DedupIndex::insert(const entry_t &e) {
+	std::string key = std::string(e.dcname, HASHLEN_IN_BYTES) + std::string(e.content_id, sizeof(e.content_id));
+
+	if (by_content_.size() >= capacity_ && by_content_.find(key) == by_content_.end())
+		by_content_.erase(by_content_.begin());
+
+	by_content_[key] = std::string(e.recordname, HASHLEN_IN_BYTES);
+}
@@ -0,0 +1,53 @@
+#ifndef DEDUP_INDEX_HPP_
+#define DEDUP_INDEX_HPP_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "errno.hpp"
+#include "const.hpp"
+#include "util/crypto.hpp"
+
+/**
+ * Client-side index of convergent data records known to exist on the DC server.
+ * (dcname, content id (wrapped block key, deterministic for a given plaintext)) -> recordname
+ * A hit lets the client reference the existing record from the file's BlockMapRecord instead of uploading it again.
+ * Duplicates are only shared within one DataCapsule, so a block map never names a record its file does not hold
+ * and the index is a cache: losing it only costs uploads. Records are appended to a log in dir;
+ * on load, at most capacity entries are kept.
+*/
+class DedupIndex {
+public:
+	struct entry_t {
+		char content_id[AES_KEY_LEN + AES_PAD_LEN];
+		char dcname[HASHLEN_IN_BYTES];
+		char recordname[HASHLEN_IN_BYTES];
+	};
+
+	DedupIndex(std::string dir, size_t capacity);
+	~DedupIndex();
+
+	err_t Load();
+
+	bool Find(const std::string &dcname, const std::string &content_id, std::string *recordname);
+	err_t Insert(const std::vector<entry_t> &entries);
+
+private:
+	void insert(const entry_t &e); // caller holds m_
+
+	const std::string dir_;
+	const size_t capacity_;
+	int log_fd_;
+	std::unordered_map<std::string, std::string> by_content_; // dcname || content id -> recordname
+	std::mutex m_;
+};
+
+/**
+ * Read the convergence secret (HMAC_KEY_LEN bytes) from path, creating it on first use.
+ * Blocks written under it cannot be read without it, so it must outlive the dedup index.
+*/
+err_t load_convergence_secret(std::string path, unsigned char *secret);
+
+#endif // DEDUP_INDEX_HPP_
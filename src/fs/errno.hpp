@@ -9,4 +9,7 @@ using err_t = int;
 #define ERR_BUF_TOO_SMALL -6
 #define ERR_VERIFY -7
 #define ERR_CRYPTO -8
-#define ERR_SIGN -9
\ No newline at end of file
+#define ERR_SIGN -9
+#define ERR_READ_ONLY -10
+#define ERR_BUSY -11
+#define ERR_CONFLICT -12
@@ -0,0 +1,77 @@
+#include <algorithm>
+
+#include "group_sync.hpp"
+
+bool parse_durability_mode(const std::string &s, durability_mode *mode) {
+	if (s == "none")
+		*mode = DURABILITY_NONE;
+	else if (s == "group")
+		*mode = DURABILITY_GROUP;
+	else if (s == "each")
+		*mode = DURABILITY_EACH;
+	else
+		return false;
+	return true;
+}
+
+GroupSync::GroupSync(durability_mode mode, uint64_t window_us, std::function<bool()> sync) : mode_(mode),
+		window_(window_us), sync_(sync), written_(0), synced_(0), window_bytes_(0), syncing_(false), failed_(false) {
+}
+
+uint64_t GroupSync::Written(uint64_t bytes) {
+	if (mode_ == DURABILITY_NONE)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_);
+	if (window_bytes_ == 0)
+		window_start_ = std::chrono::steady_clock::now();
+	window_bytes_ += bytes;
+	if (window_bytes_ >= SYNC_WINDOW_BYTES)
+		cv_.notify_all(); // closes the window early
+	return ++written_;
+}
+
+err_t GroupSync::Wait(uint64_t ticket) {
+	if (mode_ == DURABILITY_NONE)
+		return NO_ERR;
+	if (mode_ == DURABILITY_EACH)
+		return Sync();
+
+	std::unique_lock<std::mutex> lock(m_);
+	while (synced_ < ticket) {
+		if (failed_)
+			return ERR_IO;
+		if (syncing_) {
+			cv_.wait(lock);
+			continue;
+		}
+
+		syncing_ = true;
+		if (window_.count() > 0)
+			cv_.wait_until(lock, window_start_ + window_, [&] { return window_bytes_ >= SYNC_WINDOW_BYTES; });
+		uint64_t group = written_;
+		window_bytes_ = 0;
+		lock.unlock();
+		bool ok = sync_();
+		lock.lock();
+
+		syncing_ = false;
+		if (ok)
+			synced_ = std::max(synced_, group);
+		else
+			failed_ = true;
+		cv_.notify_all();
+	}
+	return NO_ERR;
+}
+
+err_t GroupSync::Sync() {
+	if (mode_ == DURABILITY_NONE)
+		return NO_ERR;
+
+	bool ok = sync_();
+	std::lock_guard<std::mutex> lock(m_);
+	if (!ok)
+		failed_ = true;
+	return failed_ ? ERR_IO : NO_ERR;
+}
@@ -0,0 +1,61 @@
+#ifndef GROUP_SYNC_HPP_
+#define GROUP_SYNC_HPP_
+
+#include <string>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include <stdint.h>
+
+#include "errno.hpp"
+#include "const.hpp"
+
+/**
+ * Durability of records in the local store (--durability)
+ * - none: acks do not wait, records reach the disk when the page cache writes them back
+ * - group: an ack waits for one sync covering every record written in the window, which closes after
+ *   --sync_window_us or once SYNC_WINDOW_BYTES were written
+ * - each: every ack waits for a sync of its own
+*/
+enum durability_mode {
+	DURABILITY_NONE,
+	DURABILITY_GROUP,
+	DURABILITY_EACH,
+};
+
+bool parse_durability_mode(const std::string &s, durability_mode *mode);
+
+/**
+ * Group commit for a store whose sync covers everything written before it starts (an fdatasync of an
+ * append-only file). Written hands out a ticket once a record is in the page cache, Wait returns once a sync
+ * started after that. The first waiter leads: it waits out the window, then syncs for everyone who wrote
+ * meanwhile; records written while it syncs go to the next group.
+ * After a failed sync the page cache may have dropped the unsynced pages, so no later ack is given.
+*/
+class GroupSync {
+public:
+	GroupSync(durability_mode mode, uint64_t window_us, std::function<bool()> sync);
+
+	durability_mode Mode() { return mode_; }
+	uint64_t Written(uint64_t bytes); // returns the record's ticket
+	err_t Wait(uint64_t ticket);
+	err_t Sync(); // syncs now, outside of any group
+
+private:
+	durability_mode mode_;
+	std::chrono::microseconds window_;
+	std::function<bool()> sync_;
+
+	uint64_t written_; // tickets handed out
+	uint64_t synced_; // tickets up to this one are durable
+	uint64_t window_bytes_; // written since the last sync started
+	std::chrono::steady_clock::time_point window_start_;
+	bool syncing_; // a leader is gathering or syncing
+	bool failed_;
+	std::mutex m_;
+	std::condition_variable cv_;
+};
+
+#endif // GROUP_SYNC_HPP_
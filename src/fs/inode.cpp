@@ -78,6 +78,41 @@ Inode *get_inode(DCFS *dcfs, std::string hashname) {
 	return ret;
 }
 
+// hashnames have a fixed length, so these never collide with the key of a latest version
+static std::string version_key(std::string hashname, uint64_t version) {
+	return hashname + "@" + std::to_string(version);
+}
+
+Inode *get_inode_version(DCFS *dcfs, std::string hashname, uint64_t version) {
+	std::lock_guard<std::mutex> lock(inode_table_mutex);
+	std::string key = version_key(hashname, version);
+
+	auto match = inode_table.find(key);
+	if (match != inode_table.end())
+		return match->second;
+
+	std::string recordname;
+	std::string blockmap_hash;
+	uint64_t file_size_in_bytes;
+	std::string aes_key;
+	err_t err = dcfs->backend->ReadFileVersion(hashname, version, &recordname, &file_size_in_bytes, &aes_key, &blockmap_hash);
+	if (err < 0)
+		return NULL;
+
+	Inode *ret = new Inode(hashname,
+							recordname,
+							blockmap_hash,
+							dcfs->block_size_in_kb, 
+							BLOCKMAP_COVER, 
+							file_size_in_bytes,
+							aes_key,
+							dcfs->backend);
+	ret->SetVersion(version);
+	inode_table[key] = ret;
+
+	return ret;
+}
+
 void release_inode(DCFS *dcfs, std::string hashname) {
 	std::lock_guard<std::mutex> lock(inode_table_mutex);
 	auto match = inode_table.find(hashname);
@@ -105,7 +140,9 @@ Inode::Inode(std::string hashname,
 		i_backend_(backend),
 		i_cache_(new RecordCache(this)),
 		i_aes_key_(aes_key),
-		i_ref_count_(0) {}
+		i_ref_count_(0),
+		i_key_(hashname),
+		i_readonly_(false) {}
 
 // fresh Inode constructor
 Inode::Inode(std::string hashname, 
@@ -122,7 +159,9 @@ Inode::Inode(std::string hashname,
 		i_backend_(backend),
 		i_cache_(new RecordCache(this)),	
 		i_aes_key_(aes_key),
-		i_ref_count_(0) {}
+		i_ref_count_(0),
+		i_key_(hashname),
+		i_readonly_(false) {}
 
 Inode::~Inode() { delete i_cache_; }
 
@@ -159,6 +198,19 @@ std::string Inode::AESKey() const {
 	return i_aes_key_;
 }
 
+std::string Inode::Key() const {
+	return i_key_;
+}
+
+bool Inode::ReadOnly() const {
+	return i_readonly_;
+}
+
+void Inode::SetVersion(uint64_t version) {
+	i_key_ = version_key(i_hashname_, version);
+	i_readonly_ = true;
+}
+
 
 void Inode::Ref() {
 	i_ref_count_++;
@@ -169,7 +221,7 @@ int Inode::Unref() {
 
 	i_ref_count_--;
 
-	if (i_ref_count_ == 0) 
+	if (i_ref_count_ == 0 && !i_readonly_)
 		i_cache_->FlushCache();
 
 	return i_ref_count_;
@@ -272,6 +324,11 @@ err_t RecordCache::fillDcache(uint64_t offset, uint64_t size) {
 	if (ret < 0)
 		return ret;
 
+	// blocks to load from backend, read together so that an asynchronous DC server overlaps them
+	std::vector<uint64_t> load_idx;
+	std::vector<std::string> load_names;
+	std::vector<buf_desc_t> load_descs;
+
 	for (blk_idx = st_block; blk_idx <= ed_block; blk_idx++) {
 		/**
 		 * allocate new cache block if needed
@@ -288,34 +345,34 @@ err_t RecordCache::fillDcache(uint64_t offset, uint64_t size) {
 		
 			if (bmCheck(blk_idx, &recordname)) { // if true, need to load from backend
 				buf_desc_t desc;
-				alloc_buf_desc(&desc, block_size + AES_PAD_LEN);
-				uint64_t read_size;
-				ret = host_->Backend()->ReadRecordData(host_->Hashname(),
-										recordname, 
-										&desc,
-										&read_size); 
-
-				if (ret < 0)
-					return ret;
-
-				assert(read_size <= desc.size);
-
-				int outlen = 0;
-				Util::decrypt_symmetric((unsigned char *)host_->AESKey().c_str(),
-									NULL,
-									(unsigned char *)desc.buf,
-									read_size,
-									(unsigned char *)dcache_blocks_[blk_idx],
-									&outlen);
-				dealloc_buf_desc(&desc);
-			} else { // else, zero fill the block
-				memset(dcache_blocks_[blk_idx], 0, block_size);
+				desc.buf = dcache_blocks_[blk_idx];
+				desc.size = block_size + AES_PAD_LEN;
+				load_idx.push_back(blk_idx);
+				load_names.push_back(recordname);
+				load_descs.push_back(desc);
+				continue;
 			}
 
+			// else, zero fill the block
+			memset(dcache_blocks_[blk_idx], 0, block_size);
 			dcache_stats_[blk_idx].cached = true;
 		}
 	}
 
+	if (load_idx.size() > 0) {
+		std::vector<uint64_t> read_sizes;
+		ret = host_->Backend()->ReadBlocks(host_->Hashname(),
+								load_names,
+								host_->AESKey(),
+								&load_descs,
+								&read_sizes);
+		if (ret < 0)
+			return ret;
+
+		for (uint64_t idx : load_idx)
+			dcache_stats_[idx].cached = true;
+	}
+
 	return ret;
 }
 
@@ -332,7 +389,7 @@ err_t RecordCache::fillBmcache(uint64_t blk_offset, uint64_t cnt) {
 		desc.size = HASHLEN_IN_BYTES * bm_cover;
 
 		uint64_t read_size;
-		ret = host_->Backend()->ReadRecordData(host_->Hashname(), 
+		ret = host_->Backend()->ReadBlockMap(host_->Hashname(), 
 						host_->BlockMapRecordname(), 
 						&desc, 
 						&read_size);
@@ -355,7 +412,7 @@ bool RecordCache::bmCheck(uint64_t blk_idx, std::string *recordname) {
 
 	memcpy(ret, bm_ + blk_idx * HASHLEN_IN_BYTES, HASHLEN_IN_BYTES);
 
-	if (strcmp(ret, zero_str) == 0) {
+	if (memcmp(ret, zero_str, HASHLEN_IN_BYTES) == 0) { // hashes may contain zero bytes
 		return false;
 	} else {
 		*recordname = std::string(ret, HASHLEN_IN_BYTES);
@@ -370,7 +427,6 @@ err_t RecordCache::FlushCache() {
 	std::string hashname = host_->Hashname();
 
 	std::vector<buf_desc_t> desc_vec;
-	std::vector<char *> encrypted_buf_vec;
 	/**
 	 * Possible Opt: merge adjacent dirty blocks and write them in one shot
 	 * But this technique needs gathering dirty blocks into a single buffer.
@@ -380,24 +436,15 @@ err_t RecordCache::FlushCache() {
 	for (uint64_t blk_idx = 0; blk_idx < dcache_stats_.size(); blk_idx++) {
 		if (dcache_stats_[blk_idx].dirty) {
 			buf_desc_t desc;
-			
-			char *encrypted_buf = new char[block_size + AES_PAD_LEN];
-			int outlen = 0;
-			if (Util::encrypt_symmetric(
-				(unsigned char *)host_->AESKey().c_str(),
-				NULL,
-				(unsigned char *)dcache_blocks_[blk_idx],
-				block_size,
-				(unsigned char *)encrypted_buf,
-				&outlen) <= 0) {
-					return ERR_CRYPTO;
-				}
-
-			desc.buf = encrypted_buf;
-			desc.size = outlen;
+			ret = host_->Backend()->SealBlock(hashname, host_->AESKey(), dcache_blocks_[blk_idx], block_size, &desc);
+			if (ret < 0) {
+				for (auto &d : desc_vec)
+					host_->Backend()->ReleaseBlock(&d);
+				return ret;
+			}
+
 			desc.file_offset = blk_idx * block_size;
 			desc_vec.push_back(desc);
-			encrypted_buf_vec.push_back(encrypted_buf);
 		}
 	}
 
@@ -405,8 +452,8 @@ err_t RecordCache::FlushCache() {
 								&desc_vec, 
 								host_->InodeRecordname(), 
 								host_->AESKey());
-	for (uint64_t i = 0; i < encrypted_buf_vec.size(); i++)
-		delete[] encrypted_buf_vec[i];		
+	for (auto &desc : desc_vec)
+		host_->Backend()->ReleaseBlock(&desc);
 
 	if (ret < 0) {
 		return ret;
@@ -435,6 +482,9 @@ err_t Inode::Read(void *buf, uint64_t offset, uint64_t size, uint64_t *read_size
 }
 
 err_t Inode::Write(const void *buf, uint64_t offset, uint64_t size, uint64_t *write_size) {
+	if (i_readonly_)
+		return ERR_READ_ONLY;
+
 	if (offset >= i_size_)
 		offset = i_size_;
 
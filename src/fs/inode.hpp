@@ -16,6 +16,7 @@ class RecordCache;
  * In-memory handle of a file (storage format = a single DC)
  * Inode object represents a single version of file (= single InodeRecord).
  * When reference count becomes zero, the inode object is released, and the cache is flushed.
+ * An inode pinned to a past version (get_inode_version) is read-only and never flushed.
  * ***Assuming single-level block map (1/512 overhead) for 1st iteration
 */
 class Inode {
@@ -48,6 +49,9 @@ public:
 	std::string BlockMapRecordname() const;
 	std::string InodeRecordname() const;
 	std::string AESKey() const;
+	std::string Key() const;
+	bool ReadOnly() const;
+	void SetVersion(uint64_t version); // pin to a past version: read-only, cached under its own key
 	void Ref();
 	int Unref();
 
@@ -66,6 +70,9 @@ private:
 	std::string i_aes_key_;
 
 	uint64_t i_ref_count_;
+
+	std::string i_key_; // key in the inode table: hashname, or hashname@version for a past version
+	bool i_readonly_;
 };
 
 class RecordCache {
@@ -114,6 +121,7 @@ private:
 
 Inode *allocate_inode(DCFS *dcfs);
 Inode *get_inode(DCFS *dcfs, std::string hashname);
+Inode *get_inode_version(DCFS *dcfs, std::string hashname, uint64_t version);
 void release_inode(DCFS *dcfs, std::string hashname);
 void init_inode();
 
@@ -0,0 +1,84 @@
+#include <cstring>
+#include <cassert>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "key_cache.hpp"
+#include "util/logging.hpp"
+
+KeyCache::KeyCache(size_t capacity) : capacity_(capacity) {
+	assert(capacity_ > 0);
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	slab_size_ = (capacity_ * AES_KEY_LEN + page_size - 1) / page_size * page_size;
+	slab_ = (unsigned char *)mmap(NULL, slab_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(slab_ != MAP_FAILED);
+
+	if (mlock(slab_, slab_size_) != 0)
+		Logger::log(WARNING, "KeyCache: mlock failed, unwrapped keys may be swapped out");
+	madvise(slab_, slab_size_, MADV_DONTDUMP);
+
+	free_slots_.reserve(capacity_);
+	for (size_t i = capacity_; i > 0; i--)
+		free_slots_.push_back(i - 1);
+}
+
+KeyCache::~KeyCache() {
+	OPENSSL_cleanse(slab_, slab_size_);
+	munlock(slab_, slab_size_);
+	munmap(slab_, slab_size_);
+}
+
+bool KeyCache::Get(const std::string &hashname, const std::string &wrapped_key, std::string *aes_key) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	auto match = map_.find(hashname);
+	if (match == map_.end())
+		return false;
+
+	auto it = match->second;
+	if (it->wrapped_key != wrapped_key) { // key has been re-wrapped, the cached one is stale
+		evict(it);
+		return false;
+	}
+
+	lru_.splice(lru_.begin(), lru_, it);
+	*aes_key = std::string((char *)slotKey(it->slot), AES_KEY_LEN);
+	return true;
+}
+
+void KeyCache::Put(const std::string &hashname, const std::string &wrapped_key, const std::string &aes_key) {
+	assert(aes_key.size() == AES_KEY_LEN);
+	std::lock_guard<std::mutex> lock(m_);
+
+	auto match = map_.find(hashname);
+	if (match != map_.end())
+		evict(match->second);
+
+	if (free_slots_.empty())
+		evict(std::prev(lru_.end()));
+
+	size_t slot = free_slots_.back();
+	free_slots_.pop_back();
+	memcpy(slotKey(slot), aes_key.c_str(), AES_KEY_LEN);
+
+	lru_.push_front(entry{hashname, wrapped_key, slot});
+	map_[hashname] = lru_.begin();
+}
+
+void KeyCache::Invalidate(const std::string &hashname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	auto match = map_.find(hashname);
+	if (match != map_.end())
+		evict(match->second);
+}
+
+// caller holds m_
+void KeyCache::evict(std::list<entry>::iterator it) {
+	OPENSSL_cleanse(slotKey(it->slot), AES_KEY_LEN);
+	free_slots_.push_back(it->slot);
+	map_.erase(it->hashname);
+	lru_.erase(it);
+}
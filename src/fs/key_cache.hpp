@@ -0,0 +1,50 @@
+#ifndef KEY_CACHE_HPP_
+#define KEY_CACHE_HPP_
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "util/crypto.hpp"
+
+/**
+ * Bounded LRU cache of unwrapped per-file AES keys.
+ * Entries are keyed by file hashname and validated against the wrapped key bytes of the InodeRecord,
+ * so a new inode version that carries the same wrapped key still hits, and a re-wrapped key misses.
+ * Unwrapped keys are kept in a single mlock'ed slab (never swapped, excluded from core dumps)
+ * and zeroized when evicted or when the cache is destroyed.
+*/
+class KeyCache {
+public:
+	KeyCache(size_t capacity);
+	~KeyCache();
+
+	bool Get(const std::string &hashname, const std::string &wrapped_key, std::string *aes_key);
+	void Put(const std::string &hashname, const std::string &wrapped_key, const std::string &aes_key);
+	void Invalidate(const std::string &hashname);
+
+private:
+	struct entry {
+		std::string hashname;
+		std::string wrapped_key;
+		size_t slot; // index into slab_
+	};
+
+	void evict(std::list<entry>::iterator it);
+	unsigned char *slotKey(size_t slot) { return slab_ + slot * AES_KEY_LEN; }
+
+	const size_t capacity_;
+	size_t slab_size_;
+	unsigned char *slab_;
+
+	std::list<entry> lru_; // front = most recently used
+	std::unordered_map<std::string, std::list<entry>::iterator> map_;
+	std::vector<size_t> free_slots_;
+	std::mutex m_;
+};
+
+#endif // KEY_CACHE_HPP_
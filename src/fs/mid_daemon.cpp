@@ -0,0 +1,397 @@
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "mid_daemon.hpp"
+#include "util/logging.hpp"
+
+#define NO_ARENA_OFFSET UINT64_MAX
+#define MAX_CLIENT_KEY_LEN 256
+#define REJECT_TIMEOUT_SEC 1
+// file_offset, convergent, recordname and payload_hash (empty), arena offset and size
+#define MIN_DESC_SIZE (3 * sizeof(uint64_t) + 3 * sizeof(uint32_t))
+// dcname, inode hash and aes key (empty), desc count
+#define MIN_MODIFY_REQ_SIZE (3 * sizeof(uint32_t) + sizeof(uint64_t))
+
+MidDaemon::~MidDaemon() {
+	if (session_.joinable())
+		session_.join();
+	if (listen_fd_ >= 0) {
+		close(listen_fd_);
+		unlink(sock_path_.c_str());
+	}
+}
+
+err_t MidDaemon::Listen() {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (sock_path_.size() >= sizeof(addr.sun_path))
+		return ERR_BUF_TOO_SMALL;
+	memcpy(addr.sun_path, sock_path_.c_str(), sock_path_.size());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		return ERR_NO_CONN;
+	unlink(sock_path_.c_str());
+	mode_t mask = umask(077); // owner only: whoever connects gets to act as the file system client
+	int ret = bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(listen_fd_, 4) < 0) {
+		Logger::log(ERROR, "MidDaemon: cannot listen on " + sock_path_);
+		return ERR_NO_CONN;
+	}
+	Logger::log(INFO, "MidDaemon: listening on " + sock_path_);
+	return NO_ERR;
+}
+
+err_t MidDaemon::Serve() {
+	for (;;) {
+		int sock = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return ERR_NO_CONN;
+		}
+		if (busy_.exchange(true)) {
+			reject(sock);
+			continue;
+		}
+		if (session_.joinable())
+			session_.join();
+		session_ = std::thread([this, sock] {
+			serveClient(sock);
+			busy_ = false;
+		});
+	}
+}
+
+/**
+ * Answers the hello of a client arriving while another is served with ERR_BUSY and no shared region.
+ * The hello is read first so that the client's writes do not fail on a closed socket;
+ * a client that does not send it in time is dropped.
+*/
+void MidDaemon::reject(int sock) {
+	struct timeval tv = { REJECT_TIMEOUT_SEC, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	mid_ipc_hello hello;
+	unsigned char key_buf[MAX_CLIENT_KEY_LEN];
+	if (mid_ipc_read_full(sock, &hello, sizeof(hello)) == NO_ERR && hello.key_len <= MAX_CLIENT_KEY_LEN
+			&& mid_ipc_read_full(sock, key_buf, hello.key_len) == NO_ERR) {
+		hello = { MID_IPC_MAGIC, MID_IPC_VERSION, ERR_BUSY, 0, 0 };
+		mid_ipc_write_full(sock, &hello, sizeof(hello));
+	}
+	Logger::log(WARNING, "MidDaemon: turned away a client, another one is connected");
+	close(sock);
+}
+
+err_t MidDaemon::handshake(int sock, session_t *s) {
+	mid_ipc_hello hello;
+	if (mid_ipc_read_full(sock, &hello, sizeof(hello)) < 0)
+		return ERR_NO_CONN;
+	if (hello.magic != MID_IPC_MAGIC || hello.version != MID_IPC_VERSION || hello.key_len == 0 || hello.key_len > MAX_CLIENT_KEY_LEN)
+		return ERR_VERIFY;
+	unsigned char key_buf[MAX_CLIENT_KEY_LEN];
+	if (mid_ipc_read_full(sock, key_buf, hello.key_len) < 0)
+		return ERR_NO_CONN;
+
+	EC_KEY *client_key = EC_KEY_new_by_curve_name(NID_secp256k1);
+	const unsigned char *p = key_buf;
+	if (!client_key || !o2i_ECPublicKey(&client_key, &p, hello.key_len)) {
+		EC_KEY_free(client_key);
+		return ERR_CRYPTO;
+	}
+
+	int memfd = memfd_create("dcfs-mid-ipc", MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, MID_IPC_REGION_SIZE) < 0) {
+		if (memfd >= 0)
+			close(memfd);
+		EC_KEY_free(client_key);
+		return ERR_NO_SPACE;
+	}
+	void *region = mmap(NULL, MID_IPC_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, memfd, 0);
+	if (region == MAP_FAILED) {
+		close(memfd);
+		EC_KEY_free(client_key);
+		return ERR_NO_SPACE;
+	}
+	s->shm = (mid_ipc_shm *)region;
+	s->arena = (char *)region + MID_IPC_ARENA_OFFSET;
+	s->shm->magic = MID_IPC_MAGIC;
+	s->shm->version = MID_IPC_VERSION;
+	s->shm->nslots = MID_IPC_SLOTS;
+	s->shm->arena_offset = MID_IPC_ARENA_OFFSET;
+	s->shm->arena_size = MID_IPC_ARENA_SIZE;
+
+	s->req_efd = eventfd(0, EFD_CLOEXEC);
+	s->cpl_efd = eventfd(0, EFD_CLOEXEC);
+	s->client_key = client_key;
+	s->middleware = factory_(client_key);
+
+	hello.ret = NO_ERR;
+	hello.region_size = MID_IPC_REGION_SIZE;
+	hello.key_len = 0;
+	int fds[3] = { memfd, s->req_efd, s->cpl_efd };
+	err_t ret = (s->req_efd < 0 || s->cpl_efd < 0) ? ERR_NO_SPACE : mid_ipc_send_fds(sock, &hello, sizeof(hello), fds, 3);
+	close(memfd);
+	return ret;
+}
+
+void MidDaemon::serveClient(int sock) {
+	session_t s;
+	s.sock = sock;
+	s.req_efd = s.cpl_efd = -1;
+	s.shm = NULL;
+	s.arena = NULL;
+	s.middleware = NULL;
+	s.client_key = NULL;
+
+	err_t ret = handshake(sock, &s);
+	if (ret < 0) {
+		Logger::log(WARNING, "MidDaemon: handshake failed: " + std::to_string(ret));
+	} else {
+		Logger::log(INFO, "MidDaemon: client connected");
+
+		std::vector<std::thread> workers;
+		for (int i = 0; i < nworkers_; i++)
+			workers.emplace_back(&MidDaemon::workerLoop, this, &s);
+
+		mid_ipc_ring *sq = &s.shm->sq;
+		auto idle_since = std::chrono::steady_clock::now();
+		for (;;) {
+			uint32_t idx;
+			if (mid_ipc_pop(sq, &idx)) {
+				if (idx >= MID_IPC_SLOTS)
+					continue;
+				uint32_t op = s.shm->slots[idx].opcode;
+				if (op == MID_MODIFY || op == MID_MODIFY_BATCH) {
+					std::lock_guard<std::mutex> lock(s.work_mutex);
+					s.work.push_back(idx);
+					s.work_cv.notify_one();
+				} else {
+					handle(&s, idx);
+				}
+				idle_since = std::chrono::steady_clock::now();
+				continue;
+			}
+			if (std::chrono::steady_clock::now() - idle_since < std::chrono::microseconds(mid_ipc_spin_us()))
+				continue;
+
+			sq->waiting.store(1, std::memory_order_seq_cst);
+			if (sq->head.load(std::memory_order_seq_cst) != sq->tail.load(std::memory_order_seq_cst)) {
+				sq->waiting.store(0, std::memory_order_relaxed);
+				continue;
+			}
+			struct pollfd pfds[2] = { { s.req_efd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+			int n = poll(pfds, 2, -1);
+			sq->waiting.store(0, std::memory_order_relaxed);
+			if (n < 0)
+				continue;
+			if (pfds[1].revents) // the client never writes after the handshake: readable means closed
+				break;
+			if (pfds[0].revents & POLLIN) {
+				uint64_t cnt;
+				ssize_t r = read(s.req_efd, &cnt, sizeof(cnt));
+				(void)r;
+			}
+			idle_since = std::chrono::steady_clock::now();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(s.work_mutex);
+			s.closing = true;
+			s.work_cv.notify_all();
+		}
+		for (auto &th : workers)
+			th.join();
+		Logger::log(INFO, "MidDaemon: client disconnected");
+	}
+
+	delete s.middleware;
+	EC_KEY_free(s.client_key);
+	if (s.shm)
+		munmap(s.shm, MID_IPC_REGION_SIZE);
+	for (int fd : {s.req_efd, s.cpl_efd, sock}) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+void MidDaemon::workerLoop(session_t *s) {
+	for (;;) {
+		uint32_t idx;
+		{
+			std::unique_lock<std::mutex> lock(s->work_mutex);
+			s->work_cv.wait(lock, [s] { return !s->work.empty() || s->closing; });
+			if (s->work.empty())
+				return;
+			idx = s->work.front();
+			s->work.pop_front();
+		}
+		handle(s, idx);
+	}
+}
+
+void MidDaemon::handle(session_t *s, uint32_t idx) {
+	mid_ipc_slot *slot = &s->shm->slots[idx];
+	if (slot->state.load(std::memory_order_acquire) != SLOT_SUBMITTED)
+		return;
+
+	// the client can still write to the slot: take a private copy of everything before using it
+	uint32_t opcode = slot->opcode;
+	uint64_t args_offset = slot->args_offset;
+	uint64_t args_size = slot->args_size;
+	uint64_t args_cap = slot->args_cap;
+	char *args_buf;
+	if (args_offset == MID_IPC_ARGS_INLINE) {
+		args_buf = slot->args;
+		if (args_cap > MID_IPC_SLOT_ARGS_SIZE)
+			args_cap = MID_IPC_SLOT_ARGS_SIZE;
+	} else if (args_offset < MID_IPC_ARENA_SIZE && args_cap <= MID_IPC_ARENA_SIZE - args_offset) {
+		args_buf = s->arena + args_offset;
+	} else {
+		args_buf = NULL;
+	}
+
+	std::string reply;
+	err_t ret;
+	if (!args_buf || args_size > args_cap) {
+		ret = ERR_BUF_TOO_SMALL;
+	} else {
+		std::string args(args_buf, args_size);
+		ret = execute(s, opcode, args, &reply);
+		if (reply.size() > args_cap)
+			ret = ERR_BUF_TOO_SMALL;
+	}
+	if (ret == NO_ERR)
+		memcpy(args_buf, reply.c_str(), std::min((uint64_t)reply.size(), args_cap));
+	slot->args_size = reply.size();
+	slot->ret = ret;
+
+	slot->state.store(SLOT_DONE, std::memory_order_seq_cst);
+	// pairs with the requester setting sleeping and re-checking state before it waits
+	if (slot->sleeping.load(std::memory_order_seq_cst)) {
+		std::lock_guard<std::mutex> lock(s->cq_mutex);
+		mid_ipc_push(&s->shm->cq, idx, s->cpl_efd);
+	}
+}
+
+bool MidDaemon::getDescs(session_t *s, MidIpcReader *r, std::vector<buf_desc_t> *descs) {
+	uint64_t n;
+	if (!r->GetU64(&n) || n > r->Remaining() / MIN_DESC_SIZE) // before allocating for them
+		return false;
+	descs->resize(n);
+	for (auto &desc : *descs) {
+		uint32_t convergent;
+		uint64_t offset, size;
+		if (!r->GetU64(&desc.file_offset) || !r->GetU32(&convergent) || !r->GetString(&desc.recordname)
+				|| !r->GetString(&desc.payload_hash) || !r->GetU64(&offset) || !r->GetU64(&size))
+			return false;
+		desc.convergent = convergent;
+		if (offset == NO_ARENA_OFFSET) {
+			desc.buf = NULL;
+			desc.size = 0;
+		} else if (offset < MID_IPC_ARENA_SIZE && size <= MID_IPC_ARENA_SIZE - offset) {
+			desc.buf = s->arena + offset; // payloads are used in place
+			desc.size = size;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void put_descs(MidIpcWriter *w, std::vector<buf_desc_t> *descs) {
+	w->PutU64(descs->size());
+	for (auto &desc : *descs)
+		w->PutString(desc.recordname);
+}
+
+err_t MidDaemon::execute(session_t *s, uint32_t opcode, const std::string &args, std::string *reply) {
+	DCFSMid *mid = s->middleware;
+	MidIpcReader r(args.c_str(), args.size());
+	MidIpcWriter w(reply);
+	std::string sig, a, b, c;
+	err_t ret;
+
+	switch (opcode) {
+		case MID_OPEN_SESSION:
+			if (!r.GetString(&a) || !r.GetString(&sig))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->OpenSession(a, &b, (const unsigned char *)sig.c_str(), sig.size());
+			w.PutString(b);
+			return ret;
+
+		case MID_CREATE_NEW:
+			if (!r.GetString(&sig))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->CreateNew(&a, &b, sig.size() ? (const unsigned char *)sig.c_str() : NULL, sig.size());
+			w.PutString(a);
+			w.PutString(b);
+			return ret;
+
+		case MID_GET_ROOT:
+			if (!r.GetString(&sig))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->GetRoot(&a, &b, (const unsigned char *)sig.c_str(), sig.size());
+			w.PutString(a);
+			w.PutString(b);
+			return ret;
+
+		case MID_GET_INODE_NAME:
+			if (!r.GetString(&a) || !r.GetString(&sig))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->GetInodeName(a, &b, (const unsigned char *)sig.c_str(), sig.size());
+			w.PutString(b);
+			return ret;
+
+		case MID_DECRYPT_AES_KEY:
+			if (!r.GetString(&a) || !r.GetString(&b) || !r.GetString(&sig))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->DecryptAESKey(a, b, &c, (const unsigned char *)sig.c_str(), sig.size());
+			w.PutString(c);
+			return ret;
+
+		case MID_MODIFY: {
+			std::vector<buf_desc_t> descs;
+			if (!r.GetString(&a) || !r.GetString(&b) || !r.GetString(&c) || !r.GetString(&sig) || !getDescs(s, &r, &descs))
+				return ERR_BUF_TOO_SMALL;
+			ret = mid->Modify(a, &descs, b, c, (const unsigned char *)sig.c_str(), sig.size());
+			put_descs(&w, &descs);
+			return ret;
+		}
+
+		case MID_MODIFY_BATCH: {
+			uint64_t n;
+			if (!r.GetString(&sig) || !r.GetU64(&n) || n > r.Remaining() / MIN_MODIFY_REQ_SIZE) // before allocating for them
+				return ERR_BUF_TOO_SMALL;
+			std::vector<modify_req_t> reqs(n);
+			std::vector<std::vector<buf_desc_t>> descs(n);
+			for (uint64_t i = 0; i < n; i++) {
+				if (!r.GetString(&reqs[i].dcname) || !r.GetString(&reqs[i].inode_hash) || !r.GetString(&reqs[i].aes_key)
+						|| !getDescs(s, &r, &descs[i]))
+					return ERR_BUF_TOO_SMALL;
+				reqs[i].descs = &descs[i];
+			}
+			ret = mid->ModifyBatch(&reqs, (const unsigned char *)sig.c_str(), sig.size());
+			for (auto &req : reqs) {
+				w.PutU32((uint32_t)req.ret);
+				put_descs(&w, req.descs);
+			}
+			return ret;
+		}
+
+		default:
+			return ERR_NOT_FOUND;
+	}
+}
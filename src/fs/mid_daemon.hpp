@@ -0,0 +1,69 @@
+#ifndef MID_DAEMON_HPP_
+#define MID_DAEMON_HPP_
+
+#include <string>
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "backend.hpp"
+#include "mid_ipc.hpp"
+
+/**
+ * Serves a DCFSMid to DCFSMidIPC clients over mid_ipc, one client at a time.
+ * The middleware is created per client from the public key received in the handshake, so that requests
+ * verify against it, and deleted when the client goes away. Access control is the socket's file mode.
+ * Middlewares share the index directory, so while a client is served others are turned away with ERR_BUSY.
+ *
+ * One thread polls the submission ring and runs the short requests itself; Modify and ModifyBatch
+ * wait on the DC server and go to a pool of workers.
+*/
+class MidDaemon {
+public:
+	using factory_t = std::function<DCFSMid *(EC_KEY *client_key)>;
+
+	MidDaemon(std::string sock_path, factory_t factory, int workers) :
+		sock_path_(sock_path), factory_(factory), nworkers_(workers), listen_fd_(-1), busy_(false) {}
+	~MidDaemon();
+
+	err_t Listen();
+	err_t Serve(); // accept and serve clients, returns only on error
+
+private:
+	struct session_t {
+		int sock;
+		int req_efd;
+		int cpl_efd;
+		mid_ipc_shm *shm;
+		char *arena;
+		DCFSMid *middleware;
+		EC_KEY *client_key;
+
+		std::mutex cq_mutex; // workers share the completion ring
+		std::mutex work_mutex;
+		std::condition_variable work_cv;
+		std::deque<uint32_t> work; // slots waiting for a worker
+		bool closing = false;
+	};
+
+	err_t handshake(int sock, session_t *s);
+	void serveClient(int sock);
+	void reject(int sock);
+	void workerLoop(session_t *s);
+	void handle(session_t *s, uint32_t idx);
+	err_t execute(session_t *s, uint32_t opcode, const std::string &args, std::string *reply);
+	bool getDescs(session_t *s, MidIpcReader *r, std::vector<buf_desc_t> *descs);
+
+	const std::string sock_path_;
+	factory_t factory_;
+	const int nworkers_;
+	int listen_fd_;
+	std::thread session_; // serving the connected client, while the listening thread accepts others
+	std::atomic<bool> busy_;
+};
+
+#endif // MID_DAEMON_HPP_
@@ -0,0 +1,436 @@
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <filesystem>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mid_index.hpp"
+#include "util/logging.hpp"
+
+namespace fs = std::filesystem;
+
+#define SNAP_MAGIC 0x7865646e6973666dULL // "mfsindex"
+#define SNAP_VERSION 1
+
+enum log_type : uint32_t {
+	LOG_CREATE = 1,
+	LOG_PREPARE,
+	LOG_COMMIT,
+	LOG_ABORT,
+	LOG_ROOT,
+};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t h = 0xcbf29ce484222325ULL) {
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void pack_name(char *dst, const std::string &name) {
+	assert(name.size() == 0 || name.size() == HASHLEN_IN_BYTES);
+	memset(dst, 0, HASHLEN_IN_BYTES);
+	memcpy(dst, name.c_str(), name.size());
+}
+
+static std::string unpack_name(const char *src) {
+	static const char zero[HASHLEN_IN_BYTES] = {0};
+	if (memcmp(src, zero, HASHLEN_IN_BYTES) == 0)
+		return "";
+	return std::string(src, HASHLEN_IN_BYTES);
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+MidIndex::MidIndex(std::string dir) : dir_(dir), log_fd_(-1), log_entries_(0), snap_(NULL), snap_size_(0), snap_entries_(NULL) {
+	fs::create_directories(dir_);
+	snap_path_ = dir_ + "/index.snap";
+	log_path_ = dir_ + "/index.log";
+}
+
+MidIndex::~MidIndex() {
+	unmapSnapshot();
+	if (log_fd_ >= 0)
+		close(log_fd_);
+}
+
+err_t MidIndex::mapSnapshot() {
+	int fd = open(snap_path_.c_str(), O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? NO_ERR : ERR_IO; // no snapshot yet
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header)) {
+		close(fd);
+		return ERR_IO;
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return ERR_IO;
+
+	const snap_header *hdr = (const snap_header *)p;
+	if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION || hdr->entry_size != sizeof(snap_entry)
+			|| hdr->checksum != fnv1a(hdr, offsetof(snap_header, checksum))
+			|| sizeof(snap_header) + hdr->count * sizeof(snap_entry) != (size_t)st.st_size) {
+		munmap(p, st.st_size);
+		return ERR_IO;
+	}
+	// entries are only touched by lookups, let the kernel fault them in on demand
+	madvise(p, st.st_size, MADV_RANDOM);
+
+	snap_ = hdr;
+	snap_size_ = st.st_size;
+	snap_entries_ = (const snap_entry *)((const char *)p + sizeof(snap_header));
+	root_dcname_ = unpack_name(hdr->root_dcname);
+	root_recordname_ = unpack_name(hdr->root_recordname);
+
+	return NO_ERR;
+}
+
+void MidIndex::unmapSnapshot() {
+	if (snap_)
+		munmap((void *)snap_, snap_size_);
+	snap_ = NULL;
+	snap_size_ = 0;
+	snap_entries_ = NULL;
+}
+
+err_t MidIndex::Load() {
+	std::lock_guard<std::mutex> lock(m_);
+
+	err_t ret = mapSnapshot();
+	if (ret < 0) {
+		Logger::log(ERROR, "MidIndex: corrupted snapshot " + snap_path_);
+		return ret;
+	}
+
+	log_fd_ = open(log_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (log_fd_ < 0)
+		return ERR_IO;
+
+	struct stat st;
+	if (fstat(log_fd_, &st) < 0)
+		return ERR_IO;
+
+	// replay the log; a torn or corrupted entry marks the end of what was written
+	size_t valid = 0;
+	if (st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, log_fd_, 0);
+		if (p == MAP_FAILED)
+			return ERR_IO;
+		madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+		const log_entry *entries = (const log_entry *)p;
+		size_t n = st.st_size / sizeof(log_entry);
+		for (; valid < n; valid++) {
+			const log_entry &e = entries[valid];
+			if (e.checksum != (uint32_t)fnv1a(&e.type, sizeof(e.type), fnv1a(e.dcname, 2 * HASHLEN_IN_BYTES)))
+				break;
+			apply(e);
+		}
+		munmap(p, st.st_size);
+	}
+	log_entries_ = valid;
+
+	if (valid * sizeof(log_entry) != (size_t)st.st_size) {
+		Logger::log(WARNING, "MidIndex: truncating torn log tail at entry " + std::to_string(valid));
+		if (ftruncate(log_fd_, valid * sizeof(log_entry)) < 0)
+			return ERR_IO;
+	}
+
+	return NO_ERR;
+}
+
+void MidIndex::apply(const log_entry &e) {
+	std::string dcname(e.dcname, HASHLEN_IN_BYTES);
+	std::string recordname = unpack_name(e.recordname);
+
+	switch (e.type) {
+		case LOG_CREATE:
+		case LOG_COMMIT:
+			overlay_[dcname] = recordname;
+			pending_.erase(dcname);
+			unresolved_.erase(dcname);
+			break;
+		case LOG_PREPARE:
+			pending_[dcname] = recordname;
+			break;
+		case LOG_ABORT:
+			pending_.erase(dcname);
+			unresolved_.erase(dcname);
+			break;
+		case LOG_ROOT:
+			root_dcname_ = unpack_name(e.dcname);
+			root_recordname_ = recordname;
+			break;
+	}
+}
+
+void MidIndex::Recover(lookup_fn lookup) {
+	std::unordered_map<std::string, std::string> pending;
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		lookup_ = lookup;
+		pending = pending_;
+		unresolved_ = pending_;
+	}
+
+	for (auto &p : pending) {
+		if (resolve(p.first, p.second) < 0)
+			Logger::log(WARNING, "MidIndex: pending update left unresolved until the file is used");
+	}
+}
+
+err_t MidIndex::Resolve(const std::string &dcname) {
+	std::string recordname;
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		auto match = unresolved_.find(dcname);
+		if (match == unresolved_.end())
+			return NO_ERR;
+		recordname = match->second;
+	}
+
+	return resolve(dcname, recordname);
+}
+
+// commit or abort a pending update from before the restart; any other answer leaves it pending
+err_t MidIndex::resolve(const std::string &dcname, const std::string &recordname) {
+	err_t ret = lookup_(dcname, recordname); // outside the lock, may wait on the network
+	if (ret == NO_ERR) {
+		Logger::log(LDEBUG, "MidIndex: replayed tail inode record from DC server");
+		ret = Commit(dcname, recordname);
+	} else if (ret == ERR_NOT_FOUND) {
+		ret = Abort(dcname, recordname);
+	}
+	if (ret < 0)
+		Logger::log(ERROR, "MidIndex: failed to resolve a pending update: " + std::to_string(ret));
+
+	return ret;
+}
+
+const MidIndex::snap_entry *MidIndex::snapFind(const std::string &dcname) {
+	if (!snap_ || dcname.size() != HASHLEN_IN_BYTES)
+		return NULL;
+
+	const snap_entry *end = snap_entries_ + snap_->count;
+	const snap_entry *it = std::lower_bound(snap_entries_, end, dcname,
+			[](const snap_entry &e, const std::string &key) { return memcmp(e.dcname, key.c_str(), HASHLEN_IN_BYTES) < 0; });
+	if (it == end || memcmp(it->dcname, dcname.c_str(), HASHLEN_IN_BYTES) != 0)
+		return NULL;
+
+	return it;
+}
+
+bool MidIndex::findLocked(const std::string &dcname, std::string *recordname) {
+	auto match = overlay_.find(dcname);
+	if (match != overlay_.end()) {
+		*recordname = match->second;
+		return true;
+	}
+
+	const snap_entry *e = snapFind(dcname);
+	if (!e)
+		return false;
+
+	*recordname = unpack_name(e->recordname);
+	return true;
+}
+
+bool MidIndex::Find(const std::string &dcname, std::string *recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	return findLocked(dcname, recordname);
+}
+
+err_t MidIndex::append(uint32_t type, const std::string &dcname, const std::string &recordname, bool sync) {
+	log_entry e;
+	e.type = type;
+	pack_name(e.dcname, dcname);
+	pack_name(e.recordname, recordname);
+	e.checksum = (uint32_t)fnv1a(&e.type, sizeof(e.type), fnv1a(e.dcname, 2 * HASHLEN_IN_BYTES));
+
+	if (!write_all(log_fd_, &e, sizeof(e)))
+		return ERR_IO;
+	if (sync && fdatasync(log_fd_) < 0)
+		return ERR_IO;
+
+	apply(e);
+	log_entries_++;
+
+	return NO_ERR;
+}
+
+err_t MidIndex::Create(const std::string &dcname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	err_t ret = append(LOG_CREATE, dcname, "", true);
+	if (ret < 0)
+		return ret;
+
+	return maybeCompact();
+}
+
+err_t MidIndex::Prepare(const std::string &dcname, const std::string &recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	// must be durable before the inode record can reach the DC server
+	return append(LOG_PREPARE, dcname, recordname, true);
+}
+
+err_t MidIndex::Commit(const std::string &dcname, const std::string &recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	// losing a commit is fine: the synced prepare is resolved against the DC server on recovery
+	err_t ret = append(LOG_COMMIT, dcname, recordname, false);
+	if (ret < 0)
+		return ret;
+
+	return maybeCompact();
+}
+
+// keeps the log, and so the replay on load, bounded
+err_t MidIndex::maybeCompact() {
+	if (log_entries_ < MID_INDEX_COMPACT_ENTRIES || !pending_.empty())
+		return NO_ERR;
+
+	return compactLocked();
+}
+
+err_t MidIndex::Abort(const std::string &dcname, const std::string &recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	return append(LOG_ABORT, dcname, recordname, false);
+}
+
+void MidIndex::GetRoot(std::string *dcname, std::string *recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	*dcname = root_dcname_;
+	*recordname = root_recordname_;
+}
+
+err_t MidIndex::SetRoot(const std::string &dcname, const std::string &recordname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	return append(LOG_ROOT, dcname, recordname, true);
+}
+
+err_t MidIndex::Compact() {
+	std::lock_guard<std::mutex> lock(m_);
+
+	if (!pending_.empty()) // pending updates only live in the log
+		return ERR_IO;
+
+	return compactLocked();
+}
+
+/**
+ * Merge the snapshot with the overlay into a new sorted snapshot, then restart the log.
+ * The snapshot is replaced atomically by rename; a crash before the log is truncated
+ * only replays updates the new snapshot already contains.
+*/
+err_t MidIndex::compactLocked() {
+	std::vector<std::pair<std::string, std::string>> updates(overlay_.begin(), overlay_.end());
+	std::sort(updates.begin(), updates.end());
+
+	std::string tmp_path = snap_path_ + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return ERR_IO;
+
+	size_t snap_count = snap_ ? snap_->count : 0;
+	snap_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAP_MAGIC;
+	hdr.version = SNAP_VERSION;
+	hdr.entry_size = sizeof(snap_entry);
+	pack_name(hdr.root_dcname, root_dcname_);
+	pack_name(hdr.root_recordname, root_recordname_);
+
+	// merge two sorted sequences, overlay entries win
+	std::vector<snap_entry> out;
+	out.reserve(4096); // written out in chunks
+	bool ok = write_all(fd, &hdr, sizeof(hdr));
+	uint64_t count = 0;
+	size_t i = 0, j = 0;
+	while (ok && (i < snap_count || j < updates.size())) {
+		snap_entry e;
+		int cmp;
+		if (i == snap_count)
+			cmp = 1;
+		else if (j == updates.size())
+			cmp = -1;
+		else
+			cmp = memcmp(snap_entries_[i].dcname, updates[j].first.c_str(), HASHLEN_IN_BYTES);
+
+		if (cmp < 0) {
+			e = snap_entries_[i++];
+		} else {
+			pack_name(e.dcname, updates[j].first);
+			pack_name(e.recordname, updates[j].second);
+			j++;
+			if (cmp == 0)
+				i++;
+		}
+		out.push_back(e);
+		count++;
+
+		if (out.size() == out.capacity()) {
+			ok = write_all(fd, out.data(), out.size() * sizeof(snap_entry));
+			out.clear();
+		}
+	}
+	if (ok && !out.empty())
+		ok = write_all(fd, out.data(), out.size() * sizeof(snap_entry));
+
+	hdr.count = count;
+	hdr.checksum = fnv1a(&hdr, offsetof(snap_header, checksum));
+	ok = ok && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp_path.c_str(), snap_path_.c_str()) < 0) {
+		unlink(tmp_path.c_str());
+		return ERR_IO;
+	}
+
+	int dir_fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	if (ftruncate(log_fd_, 0) < 0 || fdatasync(log_fd_) < 0)
+		return ERR_IO;
+	log_entries_ = 0;
+
+	unmapSnapshot();
+	err_t ret = mapSnapshot();
+	if (ret < 0) {
+		Logger::log(ERROR, "MidIndex: failed to map the new snapshot");
+		return ret;
+	}
+	overlay_.clear();
+
+	return NO_ERR;
+}
@@ -0,0 +1,99 @@
+#ifndef MID_INDEX_HPP_
+#define MID_INDEX_HPP_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "errno.hpp"
+#include "const.hpp"
+
+/**
+ * Durable dcname -> latest inode recordname index of the middleware.
+ * State = compacted snapshot (sorted fixed-size entries, mmap'ed and binary searched in place)
+ *       + append-only log of the updates since that snapshot (replayed into an in-memory overlay).
+ * Loading is O(log size), independent of the number of files, so a restart does not walk any DC chain.
+ *
+ * An inode update is logged twice: Prepare (synced) before the inode record is sent to the DC server
+ * and Commit (not synced) after it is acked. A Prepare without Commit/Abort found on load is a tail
+ * record whose fate is unknown; Recover resolves it by asking the DC server whether the record exists.
+ * One the DC server cannot answer for stays pending, and Resolve asks again before the file is used.
+*/
+class MidIndex {
+public:
+	MidIndex(std::string dir);
+	~MidIndex();
+
+	err_t Load();
+	// lookup(dcname, recordname): NO_ERR if the inode record reached the DC server, ERR_NOT_FOUND if it did not
+	typedef std::function<err_t(const std::string &, const std::string &)> lookup_fn;
+	void Recover(lookup_fn lookup);
+	err_t Resolve(const std::string &dcname); // NO_ERR unless dcname has an update Recover could not resolve
+
+	bool Find(const std::string &dcname, std::string *recordname); // recordname is "" if no inode yet
+	err_t Create(const std::string &dcname);
+	err_t Prepare(const std::string &dcname, const std::string &recordname);
+	err_t Commit(const std::string &dcname, const std::string &recordname);
+	err_t Abort(const std::string &dcname, const std::string &recordname);
+
+	void GetRoot(std::string *dcname, std::string *recordname);
+	err_t SetRoot(const std::string &dcname, const std::string &recordname);
+
+	err_t Compact();
+
+private:
+	struct snap_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t entry_size;
+		uint64_t count;
+		char root_dcname[HASHLEN_IN_BYTES];
+		char root_recordname[HASHLEN_IN_BYTES];
+		uint64_t checksum; // over the fields above
+	};
+	struct snap_entry {
+		char dcname[HASHLEN_IN_BYTES];
+		char recordname[HASHLEN_IN_BYTES]; // all zero if no inode yet
+	};
+	struct log_entry {
+		uint32_t type;
+		uint32_t checksum;
+		char dcname[HASHLEN_IN_BYTES];
+		char recordname[HASHLEN_IN_BYTES];
+	};
+
+	bool findLocked(const std::string &dcname, std::string *recordname);
+	const snap_entry *snapFind(const std::string &dcname);
+	err_t append(uint32_t type, const std::string &dcname, const std::string &recordname, bool sync);
+	void apply(const log_entry &e);
+	err_t mapSnapshot();
+	void unmapSnapshot();
+	err_t compactLocked();
+	err_t maybeCompact();
+	err_t resolve(const std::string &dcname, const std::string &recordname);
+
+	const std::string dir_;
+	std::string snap_path_;
+	std::string log_path_;
+	int log_fd_;
+	uint64_t log_entries_; // entries in the log since the last snapshot
+
+	const snap_header *snap_; // mmap'ed snapshot, NULL if none
+	size_t snap_size_;
+	const snap_entry *snap_entries_;
+
+	std::unordered_map<std::string, std::string> overlay_; // committed since the snapshot
+	std::unordered_map<std::string, std::string> pending_; // prepared, not yet committed
+	std::unordered_map<std::string, std::string> unresolved_; // pending since before the restart, fate unknown
+	lookup_fn lookup_;
+	std::string root_dcname_;
+	std::string root_recordname_;
+
+	std::mutex m_;
+};
+
+#endif // MID_INDEX_HPP_
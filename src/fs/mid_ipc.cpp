@@ -0,0 +1,174 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mid_ipc.hpp"
+
+err_t mid_ipc_send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+	struct iovec iov = { (void *)buf, len };
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		if (nfds > 4)
+			return ERR_BUF_TOO_SMALL;
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	return (n == (ssize_t)len) ? NO_ERR : ERR_NO_CONN;
+}
+
+err_t mid_ipc_recv_fds(int sock, void *buf, size_t len, int *fds, int nfds) {
+	struct iovec iov = { buf, len };
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n != (ssize_t)len)
+		return ERR_NO_CONN;
+
+	int got = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n_in = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *in = (int *)CMSG_DATA(cmsg);
+		for (int i = 0; i < n_in; i++) {
+			if (got < nfds)
+				fds[got++] = in[i];
+			else
+				close(in[i]);
+		}
+	}
+	if (got != nfds) {
+		for (int i = 0; i < got; i++)
+			close(fds[i]);
+		return ERR_NO_CONN;
+	}
+	return NO_ERR;
+}
+
+err_t mid_ipc_read_full(int fd, void *buf, size_t len) {
+	char *p = (char *)buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return ERR_NO_CONN;
+		p += n;
+		len -= n;
+	}
+	return NO_ERR;
+}
+
+err_t mid_ipc_write_full(int fd, const void *buf, size_t len) {
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return ERR_NO_CONN;
+		p += n;
+		len -= n;
+	}
+	return NO_ERR;
+}
+
+void mid_ipc_push(mid_ipc_ring *ring, uint32_t slot, int efd) {
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	ring->entries[tail % MID_IPC_SLOTS] = slot;
+	ring->tail.store(tail + 1, std::memory_order_seq_cst);
+	// pairs with the consumer setting waiting and re-checking the ring before it sleeps
+	if (ring->waiting.load(std::memory_order_seq_cst)) {
+		uint64_t one = 1;
+		ssize_t n = write(efd, &one, sizeof(one));
+		(void)n;
+	}
+}
+
+bool mid_ipc_pop(mid_ipc_ring *ring, uint32_t *slot) {
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	if (head == ring->tail.load(std::memory_order_acquire))
+		return false;
+	*slot = ring->entries[head % MID_IPC_SLOTS];
+	ring->head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+uint64_t mid_ipc_spin_us() {
+	static const uint64_t spin_us = (std::thread::hardware_concurrency() > 1) ? MID_IPC_SPIN_US : 0;
+	return spin_us;
+}
+
+bool MidIpcArena::Alloc(uint64_t size, uint64_t *offset) {
+	size_t n = (size + MID_IPC_CHUNK_SIZE - 1) / MID_IPC_CHUNK_SIZE;
+	if (n == 0)
+		n = 1;
+
+	std::lock_guard<std::mutex> lock(m_);
+	size_t total = chunks_.size();
+	if (n > total - used_)
+		return false;
+
+	// lowest fit: recently freed chunks are reused first, their pages are already mapped on both sides
+	size_t i = 0;
+	while (i + n <= total) {
+		if (chunks_[i] != 0) { // skip the allocated run
+			i += chunks_[i];
+			continue;
+		}
+		size_t run = 1;
+		while (run < n && chunks_[i + run] == 0)
+			run++;
+		if (run == n) {
+			chunks_[i] = n;
+			for (size_t j = 1; j < n; j++)
+				chunks_[i + j] = UINT32_MAX;
+			used_ += n;
+			*offset = (uint64_t)i * MID_IPC_CHUNK_SIZE;
+			return true;
+		}
+		i += run;
+	}
+	return false;
+}
+
+void MidIpcArena::Free(uint64_t offset) {
+	size_t i = offset / MID_IPC_CHUNK_SIZE;
+
+	std::lock_guard<std::mutex> lock(m_);
+	if (i >= chunks_.size() || chunks_[i] == 0 || chunks_[i] == UINT32_MAX)
+		return;
+	size_t n = chunks_[i];
+	for (size_t j = 0; j < n; j++)
+		chunks_[i + j] = 0;
+	used_ -= n;
+}
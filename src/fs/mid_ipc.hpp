@@ -0,0 +1,172 @@
+#ifndef MID_IPC_HPP_
+#define MID_IPC_HPP_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "errno.hpp"
+#include "const.hpp"
+
+/**
+ * Transport between DCFSMidIPC (client) and the middleware daemon (dcfs-midd).
+ *
+ * The client connects to the daemon's unix socket and sends its public key; the daemon answers with
+ * a memfd holding the shared region and two eventfds (request, completion) passed as SCM_RIGHTS.
+ * The socket then only serves to detect a disconnect.
+ *
+ * Shared region = mid_ipc_shm | payload arena (MID_IPC_ARENA_SIZE)
+ * - A request occupies one slot. Its arguments are encoded in the slot (or in the arena when larger),
+ *   the slot index is pushed onto the submission ring, and the reply is encoded over the arguments.
+ * - Payload buffers of Modify live in the arena and are referenced by offset, so data blocks are never
+ *   copied on their way to the middleware.
+ * - Both rings are single-producer/single-consumer. A consumer busy-polls for mid_ipc_spin_us(), then sets
+ *   its waiting flag and sleeps on its eventfd; a producer writes the eventfd only if that flag is set.
+ *   A requester likewise polls its slot and only asks for a completion event before going to sleep.
+*/
+
+#define MID_IPC_MAGIC 0x6370696469666d64ULL // "dmfidipc"
+#define MID_IPC_VERSION 1
+#define MID_IPC_ARGS_INLINE UINT64_MAX // args_offset of arguments stored in the slot itself
+
+enum mid_ipc_op : uint32_t {
+	MID_OPEN_SESSION = 1,
+	MID_CREATE_NEW,
+	MID_MODIFY,
+	MID_MODIFY_BATCH,
+	MID_GET_INODE_NAME,
+	MID_GET_ROOT,
+	MID_DECRYPT_AES_KEY,
+};
+
+enum mid_ipc_slot_state : uint32_t {
+	SLOT_FREE = 0,
+	SLOT_SUBMITTED,
+	SLOT_DONE,
+};
+
+struct mid_ipc_ring {
+	std::atomic<uint32_t> head; // next entry to consume
+	std::atomic<uint32_t> tail; // next entry to produce
+	std::atomic<uint32_t> waiting; // consumer is asleep on its eventfd
+	uint32_t entries[MID_IPC_SLOTS]; // slot indexes; a slot is in at most one ring at a time, so it never fills
+};
+
+struct mid_ipc_slot {
+	std::atomic<uint32_t> state;
+	std::atomic<uint32_t> sleeping; // requester is asleep, the daemon must post a completion
+	uint32_t opcode;
+	int32_t ret;
+	uint64_t args_offset; // arena offset of the arguments, or MID_IPC_ARGS_INLINE
+	uint64_t args_size; // request size in, reply size out
+	uint64_t args_cap; // room for the reply
+	char args[MID_IPC_SLOT_ARGS_SIZE];
+};
+
+struct mid_ipc_shm {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint64_t arena_offset; // from the start of the region
+	uint64_t arena_size;
+	alignas(64) mid_ipc_ring sq; // client -> daemon
+	alignas(64) mid_ipc_ring cq; // daemon -> client, only for sleeping requesters
+	alignas(64) mid_ipc_slot slots[MID_IPC_SLOTS];
+};
+
+#define MID_IPC_ARENA_OFFSET ((sizeof(mid_ipc_shm) + MID_IPC_CHUNK_SIZE - 1) / MID_IPC_CHUNK_SIZE * MID_IPC_CHUNK_SIZE)
+#define MID_IPC_REGION_SIZE (MID_IPC_ARENA_OFFSET + (uint64_t)MID_IPC_ARENA_SIZE)
+
+/**
+ * Handshake over the control socket. Client -> daemon: hello + public key (i2o_ECPublicKey).
+ * Daemon -> client: hello with ret and the three fds (memfd, request eventfd, completion eventfd).
+*/
+struct mid_ipc_hello {
+	uint64_t magic;
+	uint32_t version;
+	int32_t ret;
+	uint64_t region_size;
+	uint64_t key_len;
+};
+
+err_t mid_ipc_send_fds(int sock, const void *buf, size_t len, const int *fds, int nfds);
+err_t mid_ipc_recv_fds(int sock, void *buf, size_t len, int *fds, int nfds);
+err_t mid_ipc_read_full(int fd, void *buf, size_t len);
+err_t mid_ipc_write_full(int fd, const void *buf, size_t len);
+
+void mid_ipc_push(mid_ipc_ring *ring, uint32_t slot, int efd); // producer side, wakes a sleeping consumer
+bool mid_ipc_pop(mid_ipc_ring *ring, uint32_t *slot);
+uint64_t mid_ipc_spin_us(); // MID_IPC_SPIN_US, or 0 on a single CPU where polling only delays the other side
+
+/**
+ * Argument encoding: fixed-width integers and length-prefixed byte strings, host byte order
+ * (both ends are on the same machine). Readers are bounds-checked; the daemon decodes from a private copy.
+*/
+class MidIpcWriter {
+public:
+	MidIpcWriter(std::string *out) : out_(out) {}
+
+	void PutU32(uint32_t v) { out_->append((const char *)&v, sizeof(v)); }
+	void PutU64(uint64_t v) { out_->append((const char *)&v, sizeof(v)); }
+	void PutBytes(const char *buf, size_t len) {
+		PutU32(len);
+		out_->append(buf, len);
+	}
+	void PutString(const std::string &s) { PutBytes(s.c_str(), s.size()); }
+
+private:
+	std::string *out_;
+};
+
+class MidIpcReader {
+public:
+	MidIpcReader(const char *buf, size_t size) : p_(buf), end_(buf + size) {}
+
+	bool GetU32(uint32_t *v) { return get(v, sizeof(*v)); }
+	bool GetU64(uint64_t *v) { return get(v, sizeof(*v)); }
+	bool GetString(std::string *s) {
+		uint32_t len;
+		if (!GetU32(&len) || (size_t)(end_ - p_) < len)
+			return false;
+		s->assign(p_, len);
+		p_ += len;
+		return true;
+	}
+	size_t Remaining() { return end_ - p_; }
+
+private:
+	bool get(void *v, size_t len) {
+		if ((size_t)(end_ - p_) < len)
+			return false;
+		memcpy(v, p_, len);
+		p_ += len;
+		return true;
+	}
+
+	const char *p_;
+	const char *end_;
+};
+
+/**
+ * Allocator of the payload arena, on the client side only (the daemon just resolves offsets).
+ * First fit over MID_IPC_CHUNK_SIZE chunks; the length of each allocated run is kept at its first chunk.
+*/
+class MidIpcArena {
+public:
+	MidIpcArena(uint64_t size) : chunks_(size / MID_IPC_CHUNK_SIZE, 0), used_(0) {}
+
+	bool Alloc(uint64_t size, uint64_t *offset);
+	void Free(uint64_t offset);
+	uint64_t Used() { return used_; }
+
+private:
+	std::vector<uint32_t> chunks_; // run length at the first chunk of a run, 0 if free (inner chunks are UINT32_MAX)
+	uint64_t used_; // chunks
+	std::mutex m_;
+};
+
+#endif // MID_IPC_HPP_
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "netem.hpp"
+
+bool parse_netem_config(const std::string &spec, netem_config *config) {
+	std::stringstream ss(spec);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		size_t eq = item.find('=');
+		if (eq == std::string::npos)
+			return false;
+		std::string key = item.substr(0, eq);
+		std::string value = item.substr(eq + 1);
+
+		try {
+			if (key == "rtt_us")
+				config->rtt_us = std::stoull(value);
+			else if (key == "jitter_us")
+				config->jitter_us = std::stoull(value);
+			else if (key == "bw_mbit")
+				config->bw_mbit = std::stod(value);
+			else if (key == "loss")
+				config->loss = std::stod(value);
+			else if (key == "timeout_ms")
+				config->timeout_ms = std::stoull(value);
+			else if (key == "seed")
+				config->seed = std::stoull(value);
+			else if (key == "dist" && value == "uniform")
+				config->dist = NETEM_UNIFORM;
+			else if (key == "dist" && value == "normal")
+				config->dist = NETEM_NORMAL;
+			else if (key == "dist" && value == "pareto")
+				config->dist = NETEM_PARETO;
+			else
+				return false;
+		} catch (const std::exception &) {
+			return false;
+		}
+	}
+	return config->bw_mbit >= 0 && config->loss >= 0 && config->loss < 100;
+}
+
+NetemLink::NetemLink(const netem_config &config) : config_(config), rng_(config.seed) {
+}
+
+std::chrono::nanoseconds NetemLink::roundTrip() {
+	double rtt = config_.rtt_us, jitter = config_.jitter_us;
+	if (jitter > 0) {
+		if (config_.dist == NETEM_UNIFORM) {
+			rtt += std::uniform_real_distribution<double>(-jitter, jitter)(rng_);
+		} else if (config_.dist == NETEM_NORMAL) {
+			rtt += std::normal_distribution<double>(0, jitter)(rng_);
+		} else {
+			// shape 3, scaled to average jitter
+			double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+			rtt += jitter * 2.0 / 3.0 * std::pow(1.0 - u, -1.0 / 3.0);
+		}
+	}
+	return std::chrono::nanoseconds((int64_t)(std::max(rtt, 0.0) * 1000));
+}
+
+std::chrono::nanoseconds NetemLink::transmit(uint64_t bytes) {
+	if (config_.bw_mbit == 0)
+		return std::chrono::nanoseconds(0);
+	return std::chrono::nanoseconds((int64_t)(bytes * 8 * 1000 / config_.bw_mbit));
+}
+
+bool NetemLink::Exchange(clock::time_point start, uint64_t up_bytes, uint64_t down_bytes, clock::time_point *done) {
+	std::lock_guard<std::mutex> lock(m_);
+	clock::time_point t = start;
+	for (int attempt = 0; attempt < NETEM_RETRIES; attempt++) {
+		if (config_.loss > 0 && std::uniform_real_distribution<double>(0, 100)(rng_) < config_.loss) {
+			t += std::chrono::milliseconds(config_.timeout_ms);
+			continue;
+		}
+
+		std::chrono::nanoseconds half = roundTrip() / 2;
+		up_free_ = std::max(t, up_free_) + transmit(up_bytes);
+		down_free_ = std::max(up_free_ + half, down_free_) + transmit(down_bytes);
+		*done = down_free_ + half;
+		return true;
+	}
+	*done = t;
+	return false;
+}
@@ -0,0 +1,67 @@
+#ifndef NETEM_HPP_
+#define NETEM_HPP_
+
+#include <string>
+#include <chrono>
+#include <random>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "const.hpp"
+
+enum netem_dist {
+	NETEM_UNIFORM,
+	NETEM_NORMAL,
+	NETEM_PARETO,
+};
+
+/**
+ * Emulated network to the DC servers (--netem=<key>=<value>,...)
+ * - rtt_us, jitter_us: round trip of a request, varying by jitter as dist says: uniform within +-jitter,
+ *   normal with jitter as its deviation, or pareto: rtt plus a heavy tail averaging jitter
+ * - bw_mbit: bandwidth each way, shared by the requests in flight (default: 0, unlimited)
+ * - loss: percentage of requests whose request or response is lost; a loss costs timeout_ms and a resend,
+ *   and a request lost NETEM_RETRIES times in a row fails
+ * - seed: of the delays and losses drawn, so that a run can be repeated
+*/
+struct netem_config {
+	uint64_t rtt_us = 0;
+	uint64_t jitter_us = 0;
+	netem_dist dist = NETEM_UNIFORM;
+	double bw_mbit = 0;
+	double loss = 0;
+	uint64_t timeout_ms = NETEM_TIMEOUT_MS;
+	uint64_t seed = 1;
+};
+
+bool parse_netem_config(const std::string &spec, netem_config *config);
+
+/**
+ * Times requests over the emulated link: each way, messages are transmitted one after another at the
+ * bandwidth and arrive half a round trip later.
+*/
+class NetemLink {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	NetemLink(const netem_config &config);
+
+	/**
+	 * When the response to a request sent at start arrives, in done.
+	 * Returns false if every attempt was lost; done is then when the last one timed out.
+	*/
+	bool Exchange(clock::time_point start, uint64_t up_bytes, uint64_t down_bytes, clock::time_point *done);
+
+private:
+	std::chrono::nanoseconds roundTrip();
+	std::chrono::nanoseconds transmit(uint64_t bytes);
+
+	netem_config config_;
+	std::mt19937_64 rng_;
+	clock::time_point up_free_; // the link towards the servers is busy until then
+	clock::time_point down_free_;
+	std::mutex m_;
+};
+
+#endif // NETEM_HPP_
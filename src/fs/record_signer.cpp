@@ -0,0 +1,163 @@
+#include <cstring>
+
+#include <openssl/ecdsa.h>
+
+#include "record_signer.hpp"
+
+bool parse_record_sign_mode(const std::string &s, record_sign_mode *mode) {
+	if (s == "off")
+		*mode = RECORD_SIGN_OFF;
+	else if (s == "each")
+		*mode = RECORD_SIGN_EACH;
+	else if (s == "batch")
+		*mode = RECORD_SIGN_BATCH;
+	else
+		return false;
+	return true;
+}
+
+RecordSigner::RecordSigner(EC_KEY *key, int workers) : key_(key), presigning_(0), presign_ok_(true), stop_(false) {
+	for (int i = 0; i < workers; i++)
+		workers_.emplace_back(&RecordSigner::workerLoop, this);
+}
+
+RecordSigner::~RecordSigner() {
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		stop_ = true;
+	}
+	work_cv_.notify_all();
+	for (auto &worker : workers_)
+		worker.join();
+
+	for (auto &p : presigs_) {
+		BN_clear_free(p.kinv);
+		BN_clear_free(p.r);
+	}
+}
+
+err_t RecordSigner::Sign(std::vector<job_t> *jobs) {
+	if (jobs->empty())
+		return NO_ERR;
+
+	batch_t batch;
+	batch.jobs = jobs;
+
+	std::unique_lock<std::mutex> lock(m_);
+	if (jobs->size() > 1) {
+		batches_.push_back(&batch);
+		work_cv_.notify_all();
+	}
+
+	// the caller signs too, so a single record or a busy pool costs no hand-off
+	job_t *job;
+	while ((job = claim(&batch))) {
+		lock.unlock();
+		err_t ret = signOne(job);
+		lock.lock();
+		finish(&batch, ret);
+	}
+
+	done_cv_.wait(lock, [&] { return batch.done == jobs->size(); });
+	return batch.ret;
+}
+
+void RecordSigner::workerLoop() {
+	std::unique_lock<std::mutex> lock(m_);
+	while (true) {
+		work_cv_.wait(lock, [&] { return stop_ || !batches_.empty() || wantPresig(); });
+		if (stop_)
+			return;
+
+		// refill only while no records wait
+		if (batches_.empty()) {
+			presigning_++;
+			lock.unlock();
+			presign();
+			lock.lock();
+			presigning_--;
+			continue;
+		}
+
+		// a batch is only touched while one of its jobs is claimed and not finished, so Sign cannot return under us
+		batch_t *batch = batches_.front();
+		job_t *job = claim(batch);
+		lock.unlock();
+		err_t ret = signOne(job);
+		lock.lock();
+		finish(batch, ret);
+	}
+}
+
+/* caller holds m_ */
+bool RecordSigner::wantPresig() {
+	return presign_ok_ && presigs_.size() + presigning_ < RECORD_PRESIGS;
+}
+
+/* caller holds m_ */
+RecordSigner::job_t *RecordSigner::claim(batch_t *batch) {
+	if (batch->next == batch->jobs->size())
+		return NULL;
+
+	job_t *job = &(*batch->jobs)[batch->next++];
+	if (batch->next == batch->jobs->size()) { // nothing left to claim
+		for (auto it = batches_.begin(); it != batches_.end(); it++) {
+			if (*it == batch) {
+				batches_.erase(it);
+				break;
+			}
+		}
+	}
+	return job;
+}
+
+/* caller holds m_ */
+void RecordSigner::finish(batch_t *batch, err_t ret) {
+	if (ret < 0)
+		batch->ret = ret;
+	if (++batch->done == batch->jobs->size())
+		done_cv_.notify_all();
+}
+
+/* adds one (k^-1, r) pair to presigs_; caller does not hold m_ */
+void RecordSigner::presign() {
+	presig_t p = {NULL, NULL};
+	int ok = ECDSA_sign_setup(key_, NULL, &p.kinv, &p.r);
+
+	std::lock_guard<std::mutex> lock(m_);
+	if (ok)
+		presigs_.push_back(p);
+	else
+		presign_ok_ = false; // records are then signed from scratch
+
+}
+
+err_t RecordSigner::signOne(job_t *job) {
+	presig_t p = {NULL, NULL};
+	{
+		std::lock_guard<std::mutex> lock(m_);
+		if (!presigs_.empty()) {
+			p = presigs_.back();
+			presigs_.pop_back();
+			work_cv_.notify_one();
+		}
+	}
+
+	// without a presignature, ECDSA_sign_ex computes k^-1 and r itself
+	unsigned char sig[RECORD_SIG_MAX];
+	unsigned int siglen = 0;
+	int ok = ECDSA_size(key_) <= RECORD_SIG_MAX
+			&& ECDSA_sign_ex(0, (const unsigned char *)job->digest.c_str(), job->digest.size(), sig, &siglen, p.kinv, p.r, key_);
+	BN_clear_free(p.kinv);
+	BN_clear_free(p.r);
+	if (!ok)
+		return ERR_SIGN;
+
+	// DER signatures vary in length: the slot is zero padded and signature_len (a one-byte varint) tells the length
+	char *slot = job->record + job->sig_offset;
+	memcpy(slot, sig, siglen);
+	memset(slot + siglen, 0, RECORD_SIG_MAX - siglen);
+	slot[RECORD_SIG_MAX + 1] = (char)siglen;
+
+	return NO_ERR;
+}
@@ -0,0 +1,88 @@
+#ifndef RECORD_SIGNER_HPP_
+#define RECORD_SIGNER_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <stdint.h>
+
+#include "errno.hpp"
+#include "const.hpp"
+#include "util/crypto.hpp"
+
+/**
+ * Writer signatures on records composed by the middleware (--record_signing)
+ * - off: no signature, the signature field holds RECORD_SIG_NONE
+ * - each: every record carries an ECDSA signature over its header hash
+ * - batch: only INODE, CHECKPOINT and META records are signed. An inode record commits to its blockmap,
+ *   which commits to the data records, so theirs is implied (RECORD_SIG_IMPLIED)
+*/
+enum record_sign_mode {
+	RECORD_SIGN_OFF,
+	RECORD_SIGN_EACH,
+	RECORD_SIGN_BATCH,
+};
+
+bool parse_record_sign_mode(const std::string &s, record_sign_mode *mode);
+
+#define RECORD_SIG_NONE "0"
+#define RECORD_SIG_IMPLIED "implied"
+
+/**
+ * Signing stage of the middleware write path.
+ * A composed record reserves RECORD_SIG_MAX bytes for its signature; Sign fills them in place,
+ * so records are signed after composition without being re-encoded.
+ * A batch of records is signed by a pool of workers together with the calling thread.
+ * While no batch is waiting, the workers precompute the record-independent part of ECDSA signatures
+ * (k^-1 and r, up to RECORD_PRESIGS of them), which leaves little more than a modular multiplication per record.
+*/
+class RecordSigner {
+public:
+	struct job_t {
+		char *record; // composed record
+		uint64_t sig_offset; // of the reserved signature bytes; signature_len follows them (see composeRecord)
+		std::string digest; // header hash
+	};
+
+	RecordSigner(EC_KEY *key, int workers);
+	~RecordSigner();
+
+	err_t Sign(std::vector<job_t> *jobs); // returns once every job is signed
+
+private:
+	struct batch_t {
+		std::vector<job_t> *jobs;
+		size_t next = 0; // next job to claim, guarded by m_
+		size_t done = 0; // guarded by m_
+		err_t ret = NO_ERR;
+	};
+
+	void workerLoop();
+	job_t *claim(batch_t *batch); // next unclaimed job, NULL if none
+	void finish(batch_t *batch, err_t ret);
+	err_t signOne(job_t *job);
+	bool wantPresig();
+	void presign();
+
+	struct presig_t {
+		BIGNUM *kinv;
+		BIGNUM *r;
+	};
+
+	EC_KEY *key_;
+	std::vector<std::thread> workers_;
+	std::deque<batch_t *> batches_; // batches with jobs left to claim
+	std::vector<presig_t> presigs_; // each used for one signature only
+	size_t presigning_; // presigs_ being computed by workers
+	bool presign_ok_; // false once precomputation failed
+	std::mutex m_;
+	std::condition_variable work_cv_;
+	std::condition_variable done_cv_;
+	bool stop_;
+};
+
+#endif // RECORD_SIGNER_HPP_
@@ -0,0 +1,142 @@
+#include <cstring>
+#include <filesystem>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "version_index.hpp"
+#include "util/encode.hpp"
+#include "util/logging.hpp"
+
+namespace fs = std::filesystem;
+
+VersionIndex::VersionIndex(std::string dir, size_t capacity) : dir_(dir), capacity_(capacity) {
+	std::error_code ec;
+	fs::create_directories(dir_, ec);
+}
+
+std::string VersionIndex::path(const std::string &dcname) {
+	return dir_ + "/" + Util::binary_to_hex_string(dcname.c_str(), dcname.size());
+}
+
+/* a torn tail is dropped; the entries before it were written whole */
+template <typename T>
+static void load_entries(const std::string &file, std::vector<T> *stored) {
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat st = {};
+	if (fstat(fd, &st) == 0) {
+		stored->resize(st.st_size / sizeof(T));
+		ssize_t len = stored->size() * sizeof(T);
+		if (pread(fd, stored->data(), len, 0) != len)
+			stored->clear();
+	}
+	close(fd);
+
+	if ((size_t)st.st_size != stored->size() * sizeof(T)) {
+		Logger::log(WARNING, "VersionIndex: truncating " + file + " to " + std::to_string(stored->size()) + " entries");
+		if (truncate(file.c_str(), stored->size() * sizeof(T)) < 0)
+			stored->clear();
+	}
+}
+
+/* not synced: an entry lost in a crash is read again from the DC server */
+template <typename T>
+err_t VersionIndex::append(const std::string &file, const std::vector<T> &entries) {
+	int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd < 0)
+		return ERR_IO;
+	ssize_t len = entries.size() * sizeof(T);
+	ssize_t written = write(fd, entries.data(), len);
+	close(fd);
+
+	return written == len ? NO_ERR : ERR_IO;
+}
+
+/* caller holds m_ */
+VersionIndex::file_t *VersionIndex::load(const std::string &dcname) {
+	auto match = files_.find(dcname);
+	if (match != files_.end())
+		return &match->second;
+
+	// past versions are cheap to reload from disk, so dropping an arbitrary file when full is fine
+	if (files_.size() >= capacity_)
+		files_.erase(files_.begin());
+
+	file_t *f = &files_[dcname];
+	std::vector<entry_t> versions;
+	load_entries(path(dcname), &versions);
+	for (auto &e : versions)
+		f->versions[e.version] = e;
+	std::vector<checkpoint_entry_t> checkpoints;
+	load_entries(path(dcname) + ".cp", &checkpoints);
+	for (auto &cp : checkpoints)
+		f->checkpoints[cp.seq] = cp;
+
+	return f;
+}
+
+bool VersionIndex::Get(const std::string &dcname, uint64_t version, entry_t *e) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	std::map<uint64_t, entry_t> *entries = &load(dcname)->versions;
+	auto match = entries->find(version);
+	if (match == entries->end())
+		return false;
+
+	*e = match->second;
+	return true;
+}
+
+err_t VersionIndex::Put(const std::string &dcname, const std::vector<entry_t> &fresh) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	std::map<uint64_t, entry_t> *entries = &load(dcname)->versions;
+	std::vector<entry_t> added;
+	for (auto &e : fresh) {
+		if (entries->insert(std::make_pair(e.version, e)).second)
+			added.push_back(e);
+	}
+	if (added.empty())
+		return NO_ERR;
+
+	return append(path(dcname), added);
+}
+
+bool VersionIndex::FindCheckpoint(const std::string &dcname, uint64_t seq, checkpoint_entry_t *cp) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	std::map<uint64_t, checkpoint_entry_t> *checkpoints = &load(dcname)->checkpoints;
+	auto match = checkpoints->lower_bound(seq);
+	if (match == checkpoints->end())
+		return false;
+
+	*cp = match->second;
+	return true;
+}
+
+err_t VersionIndex::PutCheckpoints(const std::string &dcname, const std::vector<checkpoint_entry_t> &fresh) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	std::map<uint64_t, checkpoint_entry_t> *checkpoints = &load(dcname)->checkpoints;
+	std::vector<checkpoint_entry_t> added;
+	for (auto &cp : fresh) {
+		if (checkpoints->insert(std::make_pair(cp.seq, cp)).second)
+			added.push_back(cp);
+	}
+	if (added.empty())
+		return NO_ERR;
+
+	return append(path(dcname) + ".cp", added);
+}
+
+void VersionIndex::Reset(const std::string &dcname) {
+	std::lock_guard<std::mutex> lock(m_);
+
+	files_.erase(dcname);
+	unlink(path(dcname).c_str());
+	unlink((path(dcname) + ".cp").c_str());
+}
@@ -0,0 +1,69 @@
+#ifndef VERSION_INDEX_HPP_
+#define VERSION_INDEX_HPP_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include <stdint.h>
+
+#include "errno.hpp"
+#include "const.hpp"
+#include "util/crypto.hpp"
+
+/**
+ * Client-side index of the InodeRecords of each file by version (the version number stored in the InodeRecord),
+ * and of its CHECKPOINT records by seq.
+ * Once a version is indexed, opening it is one lookup instead of a walk of the prevhash chain;
+ * once a checkpoint is, the walk to a version it covers starts at most CHECKPOINT_INTERVAL records away.
+ *
+ * Past versions never change, so entries are only added; the index may be sparse, with the versions
+ * StorageBackend happened to read. Each file's entries are kept in append-only files under dir
+ * and loaded on first use. The index is a cache: a lost or torn file only costs reading the records again.
+*/
+class VersionIndex {
+public:
+	struct entry_t {
+		char recordname[HASHLEN_IN_BYTES]; // InodeRecord
+		char prev[HASHLEN_IN_BYTES]; // previous InodeRecord, the dcname for version 0
+		uint64_t version;
+		uint64_t timestamp; // header timestamp of the InodeRecord
+		uint64_t i_size;
+		char blockmap[HASHLEN_IN_BYTES]; // BlockMapRecord referenced by the InodeRecord
+		char wrapped_key[AES_KEY_LEN + AES_PAD_LEN]; // per-file key as stored in the InodeRecord
+	};
+
+	struct checkpoint_entry_t {
+		char recordname[HASHLEN_IN_BYTES]; // CHECKPOINT
+		char prev[HASHLEN_IN_BYTES]; // previous CHECKPOINT, the dcname for the first one
+		char inode[HASHLEN_IN_BYTES]; // InodeRecord the checkpoint names, of version (seq + 1) * CHECKPOINT_INTERVAL - 2
+		uint64_t seq;
+	};
+
+	VersionIndex(std::string dir, size_t capacity);
+
+	bool Get(const std::string &dcname, uint64_t version, entry_t *e);
+	err_t Put(const std::string &dcname, const std::vector<entry_t> &entries); // entries already indexed are skipped
+	bool FindCheckpoint(const std::string &dcname, uint64_t seq, checkpoint_entry_t *cp); // the indexed one with the smallest seq >= seq
+	err_t PutCheckpoints(const std::string &dcname, const std::vector<checkpoint_entry_t> &cps);
+	void Reset(const std::string &dcname); // the file's chain is not the indexed one
+
+private:
+	struct file_t {
+		std::map<uint64_t, entry_t> versions;
+		std::map<uint64_t, checkpoint_entry_t> checkpoints;
+	};
+
+	file_t *load(const std::string &dcname);
+	std::string path(const std::string &dcname);
+	template <typename T> static err_t append(const std::string &file, const std::vector<T> &entries);
+
+	const std::string dir_;
+	const size_t capacity_; // files kept in memory
+	std::unordered_map<std::string, file_t> files_;
+	std::mutex m_;
+};
+
+#endif // VERSION_INDEX_HPP_
@@ -0,0 +1,134 @@
+/**
+ * dcfs-midd: DCFS middleware daemon
+ * Runs DCFSMidSim in its own process and serves it to dcfs-client mounted with --middleware=<socket>.
+ * Requests and data blocks are passed over shared memory (see fs/mid_ipc.hpp).
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "fs/backend.hpp"
+#include "fs/mid_daemon.hpp"
+#include "util/options.hpp"
+#include "util/logging.hpp"
+
+static void show_help(const char *progname) {
+	printf("usage: %s [options]\n\n", progname);
+	printf("Options:\n"
+	       "    --socket=<path>        control socket (default: %s)\n"
+	       "    --index_dir=<path>     durable middleware index and keys (default: %s)\n"
+	       "    --dcserver=net|sim|uring|files\n"
+	       "                           DC server over the network, the local\n"
+	       "                           simulator appending records to segment files\n"
+	       "                           under %s, the same segment files\n"
+	       "                           written and read asynchronously through\n"
+	       "                           io_uring, or the simulator keeping one file\n"
+	       "                           per record (default: net)\n"
+	       "    --odirect              for --dcserver=uring, read records with\n"
+	       "                           O_DIRECT, bypassing the page cache\n"
+	       "    --durability=none|group|each\n"
+	       "                           for --dcserver=sim|uring, ack a record once\n"
+	       "                           it is synced to disk: never, with the others\n"
+	       "                           written in the same window, or on its own\n"
+	       "                           (default: group)\n"
+	       "    --sync_window_us=<n>   for --durability=group, wait up to n us for\n"
+	       "                           more records before syncing (default: %d)\n"
+	       "    --client_ip=<ip>       as in dcfs-client, for --dcserver=net\n"
+	       "    --dcserver_ip=<ip>     as in dcfs-client, for --dcserver=net\n"
+	       "    --replicas=<n>         as in dcfs-client, for --dcserver=net\n"
+	       "    --record_cache_mb=<n>  as in dcfs-client, for --dcserver=net\n"
+	       "    --strict_auth          refuse sessions, every request is ECDSA-signed\n"
+	       "    --record_signing=off|each|batch\n"
+	       "                           as in dcfs-client (default: batch)\n"
+	       "    --netem=<key>=<value>,...\n"
+	       "                           as in dcfs-client, in front of any --dcserver\n"
+	       "\n", MID_IPC_SOCKET, MID_INDEX_DIR, SEGMENT_DIR, SYNC_WINDOW_US);
+}
+
+static bool parse_option(const char *arg, const char *name, std::string *value) {
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return false;
+	*value = std::string(arg + len + 1);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	std::string sock_path = MID_IPC_SOCKET;
+	std::string index_dir = MID_INDEX_DIR;
+	std::string dcserver_type = "net";
+	std::string record_signing = "batch";
+	std::string durability = "group";
+	std::string netem;
+	uint64_t sync_window_us = SYNC_WINDOW_US;
+	std::string value;
+	bool direct = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (parse_option(argv[i], "--socket", &sock_path) || parse_option(argv[i], "--index_dir", &index_dir)
+				|| parse_option(argv[i], "--dcserver", &dcserver_type)
+				|| parse_option(argv[i], "--record_signing", &record_signing)
+				|| parse_option(argv[i], "--durability", &durability) || parse_option(argv[i], "--netem", &netem)) {
+			continue;
+		} else if (parse_option(argv[i], "--sync_window_us", &value)) {
+			sync_window_us = std::stoull(value);
+		} else if (parse_option(argv[i], "--client_ip", &value)) {
+			Util::option_map["client_ip"] = value;
+		} else if (parse_option(argv[i], "--dcserver_ip", &value)) {
+			Util::option_map["dcserver_ip"] = value;
+		} else if (parse_option(argv[i], "--replicas", &value)) {
+			Util::option_map["replicas"] = value;
+		} else if (parse_option(argv[i], "--record_cache_mb", &value)) {
+			Util::option_map["record_cache_mb"] = value;
+		} else if (strcmp(argv[i], "--strict_auth") == 0) {
+			Util::option_map["strict_auth"] = "1";
+		} else if (strcmp(argv[i], "--odirect") == 0) {
+			direct = true;
+		} else {
+			show_help(argv[0]);
+			return (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) ? 0 : 1;
+		}
+	}
+
+	record_sign_mode sign_mode;
+	durability_mode sync_mode;
+	netem_config netem_conf;
+	if (!parse_record_sign_mode(record_signing, &sign_mode) || !parse_durability_mode(durability, &sync_mode)
+			|| (netem.size() > 0 && !parse_netem_config(netem, &netem_conf))) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	DCServer *dcserver;
+	if (dcserver_type == "sim") {
+		dcserver = new DCServerSeg(SEGMENT_DIR, sync_mode, sync_window_us);
+	} else if (dcserver_type == "uring") {
+		dcserver = new DCServerUring(SEGMENT_DIR, direct, sync_mode, sync_window_us);
+	} else if (dcserver_type == "files") {
+		dcserver = new DCServerSim(BACKEND_MNT_POINT);
+	} else if (dcserver_type == "net") {
+		dcserver = new DCServerNet();
+	} else {
+		show_help(argv[0]);
+		return 1;
+	}
+	if (netem.size() > 0)
+		dcserver = new DCServerNetem(dcserver, netem_conf);
+
+	bool strict_auth = Util::load_strict_auth();
+	MidDaemon daemon(sock_path, [&](EC_KEY *client_key) -> DCFSMid * {
+		return new DCFSMidSim(dcserver, client_key, strict_auth, index_dir, sign_mode);
+	}, MID_DAEMON_WORKERS);
+
+	if (daemon.Listen() < 0) {
+		fprintf(stderr, "cannot listen on %s\n", sock_path.c_str());
+		return 1;
+	}
+	printf("dcfs-midd: listening on %s\n", sock_path.c_str());
+	fflush(stdout);
+
+	err_t ret = daemon.Serve();
+	delete dcserver;
+	return ret < 0 ? 1 : 0;
+}
@@ -65,6 +65,37 @@ namespace Util {
         return ECDSA_verify(0, data, inlen, sig, siglen, sig_k) == 1;
 #endif
     }
+    unsigned char *hmac256(const unsigned char *key, size_t keylen, const void *data, size_t len, unsigned char *res) {
+        bool allocated = false;
+        if (!res) {
+            res = new unsigned char[HMAC_TAG_LEN];
+            allocated = true;
+        }
+
+        unsigned int outlen = 0;
+        if (!HMAC(EVP_sha256(), key, keylen, (const unsigned char *)data, len, res, &outlen) || outlen != HMAC_TAG_LEN) {
+            if (allocated)
+                delete[] res;
+            return NULL;
+        }
+
+        return res;                 // It is your responsibility to delete res if it was allocated here.
+    }
+
+    bool verify_hmac256(const unsigned char *key, size_t keylen, const void *data, size_t len, const unsigned char *tag, size_t taglen) {
+#ifdef NO_SIGN
+        return true;
+#else
+        unsigned char expected[HMAC_TAG_LEN];
+        if (taglen != HMAC_TAG_LEN)
+            return false;
+        if (!hmac256(key, keylen, data, len, expected))
+            return false;
+
+        return CRYPTO_memcmp(expected, tag, HMAC_TAG_LEN) == 0; // constant-time compare
+#endif
+    }
+
     /*    
     EVP_PKEY * generate_evp_pkey_dsa() {
 
@@ -189,6 +220,56 @@ namespace Util {
     }
 
 
+    int encrypt_symmetric_hash256(unsigned char *key, unsigned char *iv, unsigned char *inbuf, int inlen, unsigned char *outbuf, int *outlen,
+                    const unsigned char *prefix, size_t prefixlen, unsigned char *digest) {
+        SHA256_CTX hsh_ctx;
+        if (!SHA256_Init(&hsh_ctx))
+            return -1;
+        if (prefixlen > 0 && !SHA256_Update(&hsh_ctx, prefix, prefixlen))
+            return -1;
+
+#ifdef NO_ENC
+        memcpy(outbuf, inbuf, inlen);
+        *outlen = inlen;
+        if (!SHA256_Update(&hsh_ctx, outbuf, inlen) || !SHA256_Final(digest, &hsh_ctx))
+            return -1;
+        return 1;
+#else
+        int retlen = 0;
+        int total = 0;
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+        EVP_CipherInit_ex(ctx, EVP_aes_128_cbc(), NULL, NULL, NULL, 1);
+        OPENSSL_assert(EVP_CIPHER_CTX_key_length(ctx) == 16);
+        OPENSSL_assert(EVP_CIPHER_CTX_iv_length(ctx) == 16);
+        EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, 1);
+
+        for (int off = 0; off < inlen; off += FUSED_CHUNK_LEN) {
+            int chunk = inlen - off < FUSED_CHUNK_LEN ? inlen - off : FUSED_CHUNK_LEN;
+            if (!EVP_CipherUpdate(ctx, outbuf + total, &retlen, inbuf + off, chunk)) {
+                EVP_CIPHER_CTX_free(ctx);
+                return -1;
+            }
+            // CBC may hold back a partial block, so hash exactly what was produced
+            SHA256_Update(&hsh_ctx, outbuf + total, retlen);
+            total += retlen;
+        }
+
+        if (!EVP_CipherFinal_ex(ctx, outbuf + total, &retlen)) {
+            EVP_CIPHER_CTX_free(ctx);
+            return -1;
+        }
+        SHA256_Update(&hsh_ctx, outbuf + total, retlen);
+        total += retlen;
+        *outlen = total;
+
+        EVP_CIPHER_CTX_free(ctx);
+        if (!SHA256_Final(digest, &hsh_ctx))
+            return -1;
+        return 1;
+#endif
+    }
+
     int generate_symmetric_key(unsigned char* key) {
         return RAND_bytes(key, 16*sizeof(char)); // 1 on success, 0 on failure, -1 not supported
     }
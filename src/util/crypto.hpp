@@ -10,6 +10,8 @@
 #include <openssl/ecerr.h>
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
 #include <cstddef>
 #include <string>
@@ -24,6 +26,11 @@
 #define AES_KEY_LEN 16
 #define AES_PAD_LEN 16
 
+#define FUSED_CHUNK_LEN (4 * 1024) // L1-resident chunk for encrypt_symmetric_hash256
+
+#define HMAC_KEY_LEN 32
+#define HMAC_TAG_LEN 32
+
 namespace Util {
 	unsigned char * hash256(void *data, size_t len, unsigned char *res);            // Helper for SHA256
 	/*
@@ -36,10 +43,17 @@ namespace Util {
 	bool verify(EC_KEY *sig_k, unsigned char* data, int inlen, const unsigned char* sig, int siglen);
 	int generate_ECDSA_key(EC_KEY **ec_key);	
 
+	unsigned char *hmac256(const unsigned char *key, size_t keylen, const void *data, size_t len, unsigned char *res); // Helper for HMAC-SHA256
+	bool verify_hmac256(const unsigned char *key, size_t keylen, const void *data, size_t len, const unsigned char *tag, size_t taglen);
+
 	int encrypt_symmetric(unsigned char *key, unsigned char *iv, unsigned char *inbuf, int inlen, unsigned char *outbuf, int *outlen);
 	int decrypt_symmetric(unsigned char* key, unsigned char *iv, unsigned char *inbuf, int inlen, unsigned char *outbuf, int *outlen);
 	int generate_symmetric_key(unsigned char* key);
 
+	// encrypt_symmetric + SHA-256 of (prefix || ciphertext) in one pass; each ciphertext chunk is hashed while still in cache
+	int encrypt_symmetric_hash256(unsigned char *key, unsigned char *iv, unsigned char *inbuf, int inlen, unsigned char *outbuf, int *outlen,
+					const unsigned char *prefix, size_t prefixlen, unsigned char *digest);
+
 
 	// int sign(void *data, size_t len, void *pkey);
 }
@@ -16,6 +16,54 @@ std::string load_dcserver_ip() {
 	}
 	return option_map["dcserver_ip"];
 }
+bool load_strict_auth() {
+	return option_map.find("strict_auth") != option_map.end();
+}
+bool load_convergent() {
+	return option_map.find("convergent") != option_map.end();
+}
+std::string load_convergence_secret() {
+	if (option_map.find("convergence_secret") == option_map.end()) {
+		return "";
+	}
+	return option_map["convergence_secret"];
+}
+uint64_t load_group_commit_us() {
+	if (option_map.find("group_commit_us") == option_map.end()) {
+		return 0;
+	}
+	return std::stoull(option_map["group_commit_us"]);
+}
+std::string load_middleware_socket() {
+	if (option_map.find("middleware") == option_map.end()) {
+		return "";
+	}
+	return option_map["middleware"];
+}
+std::string load_record_signing() {
+	if (option_map.find("record_signing") == option_map.end()) {
+		return "batch";
+	}
+	return option_map["record_signing"];
+}
+std::string load_netem() {
+	if (option_map.find("netem") == option_map.end()) {
+		return "";
+	}
+	return option_map["netem"];
+}
+int load_replicas() {
+	if (option_map.find("replicas") == option_map.end()) {
+		return 0;
+	}
+	return std::stoi(option_map["replicas"]);
+}
+uint64_t load_record_cache_mb() {
+	if (option_map.find("record_cache_mb") == option_map.end()) {
+		return 64;
+	}
+	return std::stoull(option_map["record_cache_mb"]);
+}
 
 
 }
\ No newline at end of file
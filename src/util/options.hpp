@@ -2,11 +2,22 @@
 #define OPTIONS_HPP_
 
 #include <map>
+#include <string>
+#include <stdint.h>
 namespace Util {
 
 extern std::map<std::string, std::string> option_map;	
 std::string load_client_ip();
 std::string load_dcserver_ip();
+bool load_strict_auth();
+bool load_convergent();
+std::string load_convergence_secret();
+uint64_t load_group_commit_us();
+std::string load_middleware_socket();
+std::string load_record_signing();
+std::string load_netem();
+int load_replicas();
+uint64_t load_record_cache_mb();
 
 
 }
@@ -0,0 +1,181 @@
+// checkpoint test over the network
+// Runs more than CHECKPOINT_INTERVAL Modifys of one file through DCFSMidSim and DCServerNet against
+// a loopback DC server (dcfs-dcserver, started from ../bin), then finds every checkpoint back from
+// the head inode record, as a reader with an empty version index does. A write the DC server does not ack fails the test at the timeout.
+
+#include "../src/fs/backend.hpp"
+#include "../src/util/options.hpp"
+#include "../src/util/crypto.hpp"
+
+// C++ headers
+#include <string>
+#include <vector>
+
+// C headers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#define DEFAULT_DCSERVER "../bin/dcfs-dcserver"
+#define TEST_MODIFIES (2 * CHECKPOINT_INTERVAL + 2)
+#define TEST_TIMEOUT_SEC 60
+#define TEST_BLOCK_SIZE (DEFAULT_BLOCK_SIZE_IN_KB * 1024)
+
+static pid_t start_dcserver(const char *path) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // not left behind if the test times out
+    execl(path, path, "--servers=1", "--store=mem", (char *)NULL);
+    perror("execl");
+    _exit(1);
+}
+
+/**
+ * Client side of the middleware protocol, as in StorageBackend: one ECDSA-signed handshake, then HMAC tags.
+ */
+struct test_client {
+    DCFSMid *mid;
+    EC_KEY *key;
+    std::string mac_key;
+
+    std::string tag(const unsigned char *digest) {
+        unsigned char t[HMAC_TAG_LEN];
+        Util::hmac256((const unsigned char *)mac_key.c_str(), mac_key.size(), digest, SHA256_DIGEST_LENGTH, t);
+        return std::string((char *)t, HMAC_TAG_LEN);
+    }
+
+    bool open() {
+        unsigned char nonce[AES_KEY_LEN], digest[SHA256_DIGEST_LENGTH];
+        Util::generate_symmetric_key(nonce);
+        Util::hash256(nonce, AES_KEY_LEN, digest);
+        int siglen = 0;
+        unsigned char *sig = Util::sign(key, digest, SHA256_DIGEST_LENGTH, &siglen);
+        err_t ret = mid->OpenSession(std::string((char *)nonce, AES_KEY_LEN), &mac_key, sig, siglen);
+        delete[] sig;
+        return ret == NO_ERR;
+    }
+
+    err_t getInodeName(std::string dcname, std::string *recordname) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        Util::hash256((void *)dcname.c_str(), dcname.size(), digest);
+        std::string sig = tag(digest);
+        return mid->GetInodeName(dcname, recordname, (const unsigned char *)sig.c_str(), sig.size());
+    }
+
+    err_t modify(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        err_t ret = digest_modify_args(dcname, descs, inode_recordname, aes_key, digest);
+        if (ret < 0)
+            return ret;
+        std::string sig = tag(digest);
+        return mid->Modify(dcname, descs, inode_recordname, aes_key, (const unsigned char *)sig.c_str(), sig.size());
+    }
+};
+
+/* the checkpoint carried by an inode record, "" if it carries none */
+static bool inode_checkpoint(DCServer *dcserver, std::string dcname, std::string recordname, std::string *checkpoint_hash) {
+    record_ref_t ref;
+    if (dcserver->ViewRecord(dcname, recordname, MAX_INODE_RECORD_SIZE, &ref) < 0)
+        return false;
+    char arena_block[RECORD_ARENA_BLOCK_SIZE];
+    google::protobuf::Arena arena(arena_block, sizeof(arena_block));
+    record_view_t view;
+    if (parse_record(ref.buf, ref.size, &arena, &view) < 0 || view.header->msgtype() != record_type_to_string(INODE))
+        return false;
+    *checkpoint_hash = view.header->prevhash_size() > 2 ? view.header->prevhash(2) : "";
+    return true;
+}
+
+static bool run(DCServer *dcserver, test_client *c) {
+    std::string dcname, aes_key, inode_recordname;
+    if (c->mid->CreateNew(&dcname, &aes_key, NULL, 0) < 0) {
+        printf("CreateNew failed\n");
+        return false;
+    }
+
+    for (int i = 0; i < TEST_MODIFIES; i++) {
+        if (c->getInodeName(dcname, &inode_recordname) < 0) {
+            printf("GetInodeName failed at modify %d\n", i);
+            return false;
+        }
+        buf_desc_t desc;
+        desc.size = TEST_BLOCK_SIZE + AES_PAD_LEN;
+        desc.buf = c->mid->AllocPayload(desc.size);
+        desc.file_offset = (uint64_t)(i % 4) * TEST_BLOCK_SIZE;
+        RAND_bytes((unsigned char *)desc.buf, desc.size);
+        std::vector<buf_desc_t> descs(1, desc);
+        err_t ret = c->modify(dcname, &descs, inode_recordname, aes_key);
+        c->mid->FreePayload(desc.buf);
+        if (ret < 0) {
+            printf("Modify failed at modify %d: %d\n", i, ret);
+            return false;
+        }
+    }
+
+    if (c->getInodeName(dcname, &inode_recordname) < 0)
+        return false;
+    std::string checkpoint_hash;
+    if (!inode_checkpoint(dcserver, dcname, inode_recordname, &checkpoint_hash)) {
+        printf("cannot read the head inode record\n");
+        return false;
+    }
+
+    // newest first: versions 2 * CHECKPOINT_INTERVAL - 1, then CHECKPOINT_INTERVAL - 1
+    int found = 0;
+    while (checkpoint_hash != dcname) {
+        checkpoint_t cp;
+        err_t ret = read_checkpoint(dcserver, dcname, checkpoint_hash, &cp);
+        uint64_t expected = (uint64_t)(2 - found) * CHECKPOINT_INTERVAL - 1;
+        if (ret < 0 || cp.version != expected) {
+            printf("checkpoint %d: %d, version %lu, expected %lu\n", found, ret, ret < 0 ? 0 : cp.version, expected);
+            return false;
+        }
+        std::string carried;
+        if (!inode_checkpoint(dcserver, dcname, cp.inode_hash, &carried)) {
+            printf("checkpoint %d names a missing inode record\n", found);
+            return false;
+        }
+        found++;
+        checkpoint_hash = cp.prev;
+    }
+    if (found != 2) {
+        printf("found %d checkpoints, expected 2\n", found);
+        return false;
+    }
+
+    printf("%d modifies, %d checkpoints found from the head inode record\n", TEST_MODIFIES, found);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dcserver_path = argc > 1 ? argv[1] : DEFAULT_DCSERVER;
+
+    pid_t dcserver_pid = start_dcserver(dcserver_path);
+    usleep(200000); // let the server bind
+    alarm(TEST_TIMEOUT_SEC);
+
+    Util::option_map["client_ip"] = "localhost";
+    Util::option_map["dcserver_ip"] = "localhost:1";
+    std::string dir = "/tmp/dcfs-checkpointtest-" + std::to_string(getpid());
+    EC_KEY *key;
+    Util::generate_ECDSA_key(&key);
+
+    DCServer *dcserver = new DCServerNet();
+    test_client c = { new DCFSMidSim(dcserver, key, false, dir, RECORD_SIGN_BATCH), key, "" };
+    bool ok = c.open() && run(dcserver, &c);
+    printf("%s\n", ok ? "checkpoint test passed" : "checkpoint test FAILED");
+
+    kill(dcserver_pid, SIGTERM);
+    waitpid(dcserver_pid, NULL, 0);
+    std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        ok = false;
+
+    return ok ? 0 : 1;
+}
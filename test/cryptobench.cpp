@@ -0,0 +1,275 @@
+// crypto microbenchmark
+// Measures the Util:: crypto primitives used on the FUSE read/write path,
+// including the fused encrypt+hash kernel used by the write path.
+// Reports throughput and latency percentiles per (operation, block size, thread count) as JSON.
+
+#include "../src/util/crypto.hpp"
+
+// C++ headers
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+// C headers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+
+using namespace Util;
+
+#define MIN_BLOCK_SIZE (4 * 1024)
+#define MAX_BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_BYTES_PER_THREAD (64 * 1024 * 1024) // per (op, block size) run
+#define MIN_ITERS 16
+#define ASYM_ITERS 256 // sign/verify iterations per thread
+
+enum bench_op { OP_ENCRYPT, OP_DECRYPT, OP_HASH256, OP_ENCRYPT_THEN_HASH, OP_ENCRYPT_HASH_FUSED, OP_SIGN, OP_VERIFY };
+
+static const char *op_name(bench_op op) {
+    switch (op) {
+        case OP_ENCRYPT: return "encrypt";
+        case OP_DECRYPT: return "decrypt";
+        case OP_HASH256: return "hash256";
+        case OP_ENCRYPT_THEN_HASH: return "encrypt_then_hash";
+        case OP_ENCRYPT_HASH_FUSED: return "encrypt_hash_fused";
+        case OP_SIGN: return "sign";
+        case OP_VERIFY: return "verify";
+    }
+    return "unknown";
+}
+
+static void init_buf(char *buf, int size) {
+    RAND_bytes((unsigned char *)buf, size);
+}
+
+static inline double now_us() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Per-thread state
+ * Buffers and keys are private to each thread so only the primitive itself is measured.
+ */
+struct worker {
+    std::vector<double> lat_us;
+    double st_us, ed_us; // timed region, excluding setup
+    bool failed;
+};
+
+static void run_worker(bench_op op, int block_size, int iters, worker *w) {
+    unsigned char key[AES_KEY_LEN];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    std::vector<char> in(block_size), enc(block_size + AES_PAD_LEN), out(block_size + AES_PAD_LEN);
+    EC_KEY *eckey = NULL;
+    unsigned char *sig = NULL;
+    int siglen = 0, outlen = 0, enclen = 0;
+
+    w->failed = false;
+    w->st_us = w->ed_us = now_us();
+    w->lat_us.reserve(iters);
+
+    init_buf(in.data(), block_size);
+    generate_symmetric_key(key);
+    hash256(in.data(), block_size, digest);
+
+    if (op == OP_DECRYPT)
+        encrypt_symmetric(key, NULL, (unsigned char *)in.data(), block_size, (unsigned char *)enc.data(), &enclen);
+    if (op == OP_SIGN || op == OP_VERIFY) {
+        generate_ECDSA_key(&eckey);
+        sig = sign(eckey, digest, SHA256_DIGEST_LENGTH, &siglen);
+        if (!sig) {
+            w->failed = true;
+            return;
+        }
+    }
+
+    w->st_us = now_us();
+    for (int i = 0; i < iters; i++) {
+        double st = now_us();
+        bool ok = true;
+        switch (op) {
+            case OP_ENCRYPT:
+                ok = encrypt_symmetric(key, NULL, (unsigned char *)in.data(), block_size, (unsigned char *)out.data(), &outlen) > 0;
+                break;
+            case OP_DECRYPT:
+                ok = decrypt_symmetric(key, NULL, (unsigned char *)enc.data(), enclen, (unsigned char *)out.data(), &outlen) > 0;
+                break;
+            case OP_HASH256:
+                ok = hash256(in.data(), block_size, digest) != NULL;
+                break;
+            case OP_ENCRYPT_THEN_HASH:
+                ok = encrypt_symmetric(key, NULL, (unsigned char *)in.data(), block_size, (unsigned char *)out.data(), &outlen) > 0;
+                ok &= hash256(out.data(), outlen, digest) != NULL;
+                break;
+            case OP_ENCRYPT_HASH_FUSED:
+                ok = encrypt_symmetric_hash256(key, NULL, (unsigned char *)in.data(), block_size, (unsigned char *)out.data(), &outlen, NULL, 0, digest) > 0;
+                break;
+            case OP_SIGN: {
+                int len = 0;
+                unsigned char *s = sign(eckey, digest, SHA256_DIGEST_LENGTH, &len);
+                ok = s != NULL;
+                delete[] s;
+                break;
+            }
+            case OP_VERIFY:
+                ok = verify(eckey, digest, SHA256_DIGEST_LENGTH, sig, siglen);
+                break;
+        }
+        w->lat_us.push_back(now_us() - st);
+        if (!ok)
+            w->failed = true;
+    }
+    w->ed_us = now_us();
+
+    delete[] sig;
+    if (eckey)
+        EC_KEY_free(eckey);
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+/**
+ * Run one (op, block size, thread count) point and print it as a JSON object.
+ * sign/verify operate on a SHA-256 digest, as in the middleware protocol, so their block size is the digest length.
+ */
+static bool run_point(FILE *out, bool first, bench_op op, int block_size, int threads, long bytes_per_thread) {
+    int iters;
+    if (op == OP_SIGN || op == OP_VERIFY)
+        iters = ASYM_ITERS;
+    else
+        iters = std::max((long)MIN_ITERS, bytes_per_thread / block_size);
+
+    std::vector<worker> workers(threads);
+    std::vector<std::thread> pool;
+
+    for (int t = 0; t < threads; t++)
+        pool.emplace_back(run_worker, op, block_size, iters, &workers[t]);
+    for (auto &th : pool)
+        th.join();
+
+    std::vector<double> lat;
+    bool failed = false;
+    double st_us = workers[0].st_us, ed_us = workers[0].ed_us;
+    for (auto &w : workers) {
+        lat.insert(lat.end(), w.lat_us.begin(), w.lat_us.end());
+        failed |= w.failed;
+        st_us = std::min(st_us, w.st_us);
+        ed_us = std::max(ed_us, w.ed_us);
+    }
+    double elapsed_us = ed_us - st_us;
+    std::sort(lat.begin(), lat.end());
+
+    double ops = (double)lat.size();
+    int payload = (op == OP_SIGN || op == OP_VERIFY) ? SHA256_DIGEST_LENGTH : block_size;
+    double mib_per_sec = ops * payload / (1024.0 * 1024.0) / (elapsed_us / 1e6);
+
+    fprintf(out, "%s    {\"op\": \"%s\", \"block_size\": %d, \"threads\": %d, \"ops\": %.0f, "
+            "\"elapsed_us\": %.1f, \"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f, "
+            "\"lat_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}, \"ok\": %s}",
+            first ? "" : ",\n",
+            op_name(op), payload, threads, ops,
+            elapsed_us, ops / (elapsed_us / 1e6), mib_per_sec,
+            percentile(lat, 50), percentile(lat, 90), percentile(lat, 99), percentile(lat, 99.9),
+            lat.empty() ? 0 : lat.back(),
+            failed ? "false" : "true");
+    fflush(out);
+
+    return !failed;
+}
+
+/* comma-separated positive counts; false on anything else */
+static bool parse_list(const char *arg, std::vector<int> *res) {
+    std::string s(arg);
+    size_t last = 0;
+    while (true) {
+        size_t next = s.find(',', last);
+        std::string item = s.substr(last, next == std::string::npos ? std::string::npos : next - last);
+        char *end;
+        errno = 0;
+        long v = strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || errno == ERANGE || v <= 0 || v > INT_MAX)
+            return false;
+        res->push_back((int)v);
+        if (next == std::string::npos)
+            return true;
+        last = next + 1;
+    }
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-t threads] [-b bytes_per_thread] [-o out.json]\n", prog);
+    printf("    -t    comma-separated thread counts (default: 1,2,4,... up to #cpus)\n");
+    printf("    -b    bytes processed per thread for each symmetric/hash point (default: %d)\n", DEFAULT_BYTES_PER_THREAD);
+    printf("    -o    write JSON to file instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<int> thread_counts;
+    long bytes_per_thread = DEFAULT_BYTES_PER_THREAD;
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:o:h")) != -1) {
+        switch (opt) {
+            case 't':
+                thread_counts.clear();
+                if (!parse_list(optarg, &thread_counts)) {
+                    fprintf(stderr, "bad thread counts: %s\n", optarg);
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                bytes_per_thread = atol(optarg);
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (!out) {
+                    perror("fopen");
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (thread_counts.empty()) {
+        int ncpu = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int t = 1; t < ncpu; t *= 2)
+            thread_counts.push_back(t);
+        thread_counts.push_back(ncpu);
+    }
+
+    bool ok = true, first = true;
+    fprintf(out, "{\n  \"benchmark\": \"cryptobench\",\n  \"results\": [\n");
+    for (int threads : thread_counts) {
+        for (bench_op op : {OP_ENCRYPT, OP_DECRYPT, OP_HASH256, OP_ENCRYPT_THEN_HASH, OP_ENCRYPT_HASH_FUSED}) {
+            for (int bs = MIN_BLOCK_SIZE; bs <= MAX_BLOCK_SIZE; bs *= 4) {
+                ok &= run_point(out, first, op, bs, threads, bytes_per_thread);
+                first = false;
+            }
+        }
+        for (bench_op op : {OP_SIGN, OP_VERIFY}) {
+            ok &= run_point(out, first, op, 0, threads, bytes_per_thread);
+            first = false;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return ok ? 0 : 1;
+}
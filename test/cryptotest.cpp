@@ -3,6 +3,7 @@
 // C headers
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 enum result { success, failure };
 
@@ -125,11 +126,73 @@ int test_dsa() {
     return 0;
 }
 
+int test_hmac() {
+    printf("Testing HMAC...\n");
+
+    char data[TEST_DATA_LENGTH];
+    unsigned char key[HMAC_KEY_LEN];
+    unsigned char tag[HMAC_TAG_LEN];
+    init_buf(data, TEST_DATA_LENGTH);
+    init_buf((char *)key, HMAC_KEY_LEN);
+
+    if (!hmac256(key, HMAC_KEY_LEN, data, TEST_DATA_LENGTH, tag)) {
+        printf("HMAC failed\n");
+        return -1;
+    }
+
+    if (!verify_hmac256(key, HMAC_KEY_LEN, data, TEST_DATA_LENGTH, tag, HMAC_TAG_LEN)) {
+        printf("HMAC verification failed\n");
+        return -1;
+    }
+
+    data[0] ^= 1;
+    if (verify_hmac256(key, HMAC_KEY_LEN, data, TEST_DATA_LENGTH, tag, HMAC_TAG_LEN)) {
+        printf("HMAC verified tampered data\n");
+        return -1;
+    }
+    printf("HMAC verified\n");
+
+    return 0;
+}
+
+int test_fused_encrypt_hash() {
+    printf("Testing fused encrypt+hash...\n");
+
+    unsigned char data[TEST_DATA_LENGTH + 7];
+    unsigned char prefix[AES_PAD];
+    unsigned char enc1[TEST_DATA_LENGTH + 7 + AES_PAD], enc2[AES_PAD + TEST_DATA_LENGTH + 7 + AES_PAD];
+    unsigned char key[16], digest1[SHA256_DIGEST_LENGTH], digest2[SHA256_DIGEST_LENGTH];
+    init_buf((char *)data, sizeof(data));
+    init_buf((char *)prefix, sizeof(prefix));
+    generate_symmetric_key(key);
+
+    int len1 = 0, len2 = 0;
+    if (encrypt_symmetric_hash256(key, NULL, data, sizeof(data), enc1, &len1, prefix, sizeof(prefix), digest1) <= 0) {
+        printf("fused encryption failed\n");
+        return -1;
+    }
+
+    // reference: encrypt, then hash prefix || ciphertext
+    memcpy(enc2, prefix, sizeof(prefix));
+    encrypt_symmetric(key, NULL, data, sizeof(data), enc2 + sizeof(prefix), &len2);
+    hash256(enc2, sizeof(prefix) + len2, digest2);
+
+    if (len1 != len2 || memcmp(enc1, enc2 + sizeof(prefix), len1) != 0 || memcmp(digest1, digest2, SHA256_DIGEST_LENGTH) != 0) {
+        printf("fused encrypt+hash does not match encrypt then hash\n");
+        return -1;
+    }
+    printf("fused encrypt+hash matches\n");
+
+    return 0;
+}
+
 int main() {
     printf("Beginning Crypto Test.....\n");
 
     test_symmetric_encryption();
     test_dsa();
+    test_hmac();
+    test_fused_encrypt_hash();
     
     return 0;
 }
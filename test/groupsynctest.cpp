@@ -0,0 +1,133 @@
+// group sync test
+// Drives GroupSync with writer threads over a simulated append-only store, whose sync makes durable what was
+// written before it started. Every ack must come after a sync covering its record, concurrent writers must
+// share syncs, a full window must not wait out its time, and after a failed sync no record may be acked.
+// A Wait that never returns fails the test at the timeout.
+
+#include "../src/fs/group_sync.hpp"
+
+// C++ headers
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+// C headers
+#include <cstdio>
+#include <unistd.h>
+
+#define TEST_THREADS 8
+#define TEST_WRITES 50 // per thread
+#define TEST_SYNC_US 2000 // time an fdatasync takes
+#define TEST_LONG_WINDOW_US 1000000
+#define TEST_TIMEOUT_SEC 60
+
+#define CHECK(cond, msg) do { if (!(cond)) { printf("%s\n", msg); return false; } } while (0)
+
+/**
+ * Store records are numbered in write order, by the ticket GroupSync hands out for them.
+*/
+struct test_store {
+    std::mutex m;
+    uint64_t written = 0;
+    std::atomic<uint64_t> durable{0}; // records up to this one survive a power loss
+    std::atomic<uint64_t> syncs{0};
+    std::atomic<bool> fail{false};
+    GroupSync *sync;
+
+    test_store(durability_mode mode, uint64_t window_us) {
+        sync = new GroupSync(mode, window_us, [this] { return doSync(); });
+    }
+    ~test_store() { delete sync; }
+
+    bool doSync() {
+        uint64_t covered;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            covered = written;
+        }
+        usleep(TEST_SYNC_US);
+        syncs++;
+        if (fail)
+            return false;
+        uint64_t d = durable;
+        while (d < covered && !durable.compare_exchange_weak(d, covered))
+            ;
+        return true;
+    }
+
+    uint64_t write(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(m);
+        uint64_t ticket = sync->Written(bytes);
+        written++;
+        return ticket;
+    }
+};
+
+/* TEST_THREADS writers write and wait for their acks; returns the number of acks given before durability */
+static uint64_t run_writers(test_store *store, std::atomic<uint64_t> *failed_acks) {
+    std::atomic<uint64_t> early(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < TEST_THREADS; t++) {
+        threads.emplace_back([store, failed_acks, &early] {
+            for (int i = 0; i < TEST_WRITES; i++) {
+                uint64_t ticket = store->write(4096);
+                if (store->sync->Wait(ticket) < 0)
+                    (*failed_acks)++;
+                else if (store->sync->Mode() != DURABILITY_NONE && store->durable < ticket)
+                    early++;
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    return early;
+}
+
+static bool run() {
+    uint64_t writes = TEST_THREADS * TEST_WRITES;
+    std::atomic<uint64_t> failed_acks(0);
+
+    // group: acked once durable, syncs shared between writers
+    test_store group(DURABILITY_GROUP, 0);
+    CHECK(run_writers(&group, &failed_acks) == 0 && failed_acks == 0, "group: record acked before it was synced");
+    printf("group: %lu writes, %lu syncs\n", writes, group.syncs.load());
+    CHECK(group.syncs < writes, "group: writers did not share syncs");
+
+    // each: one sync per record
+    test_store each(DURABILITY_EACH, 0);
+    CHECK(run_writers(&each, &failed_acks) == 0 && failed_acks == 0, "each: record acked before it was synced");
+    CHECK(each.syncs == writes, "each: syncs do not match records");
+
+    // none: acked at once, never synced
+    test_store none(DURABILITY_NONE, 0);
+    CHECK(run_writers(&none, &failed_acks) == 0 && failed_acks == 0 && none.syncs == 0, "none: records synced");
+
+    // a window filled by SYNC_WINDOW_BYTES closes early
+    test_store window(DURABILITY_GROUP, TEST_LONG_WINDOW_US);
+    auto start = std::chrono::steady_clock::now();
+    CHECK(window.sync->Wait(window.write(SYNC_WINDOW_BYTES)) == NO_ERR, "window: full window not synced");
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    CHECK(waited.count() < TEST_LONG_WINDOW_US / 2, "window: full window waited out its time");
+
+    // a failed sync fails its group and every later one
+    test_store failing(DURABILITY_GROUP, 0);
+    CHECK(failing.sync->Wait(failing.write(4096)) == NO_ERR, "failing: first sync failed");
+    failing.fail = true;
+    CHECK(failing.sync->Wait(failing.write(4096)) == ERR_IO, "failing: record acked by a failed sync");
+    failing.fail = false;
+    uint64_t early = run_writers(&failing, &failed_acks);
+    CHECK(failed_acks == writes && early == 0, "failing: record acked after a failed sync");
+    CHECK(failing.sync->Sync() == ERR_IO, "failing: sync succeeded after a failed one");
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    alarm(TEST_TIMEOUT_SEC);
+    bool ok = run();
+    printf("%s\n", ok ? "group sync test passed" : "group sync test FAILED");
+    return ok ? 0 : 1;
+}
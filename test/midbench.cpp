@@ -0,0 +1,302 @@
+// middleware IPC benchmark
+// Latency of middleware requests served in-process (DCFSMidSim) versus by a middleware daemon
+// (DCFSMidIPC -> MidDaemon -> DCFSMidSim) in a forked process.
+// Both sides write to an in-memory DC server (or each to its own DCServerSeg or DCServerUring with -d),
+// so the difference is the cost of the process split. With -N, both DC servers sit behind an emulated network.
+// Reports latency percentiles per (middleware, operation) as JSON.
+
+#include "../src/fs/backend.hpp"
+#include "../src/fs/mid_daemon.hpp"
+#include "../src/util/crypto.hpp"
+
+// C++ headers
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+// C headers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERS 500
+#define BENCH_BLOCK_SIZE (DEFAULT_BLOCK_SIZE_IN_KB * 1024)
+
+/**
+ * DC server keeping records in memory
+ */
+class MemServer : public DCServer {
+public:
+    err_t ReadRecord(std::string dcname, std::string recordname, buf_desc_t *desc, uint64_t *read_size) {
+        std::lock_guard<std::mutex> lock(m_);
+        auto it = records_.find(recordname);
+        if (it == records_.end())
+            return ERR_NOT_FOUND;
+        if (it->second.size() > desc->size)
+            return ERR_BUF_TOO_SMALL;
+        memcpy(desc->buf, it->second.c_str(), it->second.size());
+        *read_size = it->second.size();
+        return NO_ERR;
+    }
+
+    err_t WriteRecord(std::string dcname, std::string recordname, const buf_desc_t *desc) {
+        std::lock_guard<std::mutex> lock(m_);
+        records_[recordname] = std::string(desc->buf, desc->size);
+        return NO_ERR;
+    }
+
+private:
+    std::map<std::string, std::string> records_;
+    std::mutex m_;
+};
+
+static DCServer *new_dcserver(std::string type, std::string dir, durability_mode durability, const netem_config *netem) {
+    DCServer *dcserver;
+    if (type == "seg")
+        dcserver = new DCServerSeg(dir, durability);
+    else if (type == "uring")
+        dcserver = new DCServerUring(dir, false, durability);
+    else
+        dcserver = new MemServer();
+    return netem ? new DCServerNetem(dcserver, *netem) : dcserver;
+}
+
+static inline double now_us() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+/**
+ * Client side of the middleware protocol, as in StorageBackend: one ECDSA-signed handshake, then HMAC tags.
+ */
+struct bench_client {
+    DCFSMid *mid;
+    EC_KEY *key;
+    std::string mac_key;
+
+    std::string tag(const unsigned char *digest) {
+        unsigned char t[HMAC_TAG_LEN];
+        Util::hmac256((const unsigned char *)mac_key.c_str(), mac_key.size(), digest, SHA256_DIGEST_LENGTH, t);
+        return std::string((char *)t, HMAC_TAG_LEN);
+    }
+
+    bool open() {
+        unsigned char nonce[AES_KEY_LEN], digest[SHA256_DIGEST_LENGTH];
+        Util::generate_symmetric_key(nonce);
+        Util::hash256(nonce, AES_KEY_LEN, digest);
+        int siglen = 0;
+        unsigned char *sig = Util::sign(key, digest, SHA256_DIGEST_LENGTH, &siglen);
+        err_t ret = mid->OpenSession(std::string((char *)nonce, AES_KEY_LEN), &mac_key, sig, siglen);
+        delete[] sig;
+        return ret == NO_ERR;
+    }
+
+    err_t getInodeName(std::string dcname, std::string *recordname) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        Util::hash256((void *)dcname.c_str(), dcname.size(), digest);
+        std::string sig = tag(digest);
+        return mid->GetInodeName(dcname, recordname, (const unsigned char *)sig.c_str(), sig.size());
+    }
+
+    err_t modify(std::string dcname, std::vector<buf_desc_t> *descs, std::string inode_recordname, std::string aes_key) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        err_t ret = digest_modify_args(dcname, descs, inode_recordname, aes_key, digest);
+        if (ret < 0)
+            return ret;
+        std::string sig = tag(digest);
+        return mid->Modify(dcname, descs, inode_recordname, aes_key, (const unsigned char *)sig.c_str(), sig.size());
+    }
+};
+
+enum bench_op { OP_GET_INODE_NAME, OP_MODIFY_1, OP_MODIFY_16 };
+
+static const char *op_name(bench_op op) {
+    switch (op) {
+        case OP_GET_INODE_NAME: return "get_inode_name";
+        case OP_MODIFY_1: return "modify_1blk";
+        case OP_MODIFY_16: return "modify_16blk";
+    }
+    return "unknown";
+}
+
+static bool run_point(FILE *out, bool first, const char *name, bench_client *c, bench_op op, int iters) {
+    std::string dcname, aes_key, inode_recordname;
+    if (c->mid->CreateNew(&dcname, &aes_key, NULL, 0) < 0)
+        return false;
+
+    int nblocks = (op == OP_MODIFY_16) ? 16 : 1;
+    std::vector<double> lat;
+    lat.reserve(iters);
+    bool failed = false;
+
+    for (int i = 0; i < iters && !failed; i++) {
+        if (c->getInodeName(dcname, &inode_recordname) < 0) {
+            failed = true;
+            break;
+        }
+
+        if (op == OP_GET_INODE_NAME) {
+            double st = now_us();
+            failed = c->getInodeName(dcname, &inode_recordname) < 0;
+            lat.push_back(now_us() - st);
+            continue;
+        }
+
+        // payloads as SealBlock leaves them: in middleware-provided buffers, hash not precomputed
+        std::vector<buf_desc_t> descs(nblocks);
+        for (int b = 0; b < nblocks; b++) {
+            descs[b].size = BENCH_BLOCK_SIZE + AES_PAD_LEN;
+            descs[b].buf = c->mid->AllocPayload(descs[b].size);
+            descs[b].file_offset = (uint64_t)b * BENCH_BLOCK_SIZE;
+            RAND_bytes((unsigned char *)descs[b].buf, descs[b].size);
+        }
+        double st = now_us();
+        failed = c->modify(dcname, &descs, inode_recordname, aes_key) < 0;
+        lat.push_back(now_us() - st);
+        for (auto &desc : descs)
+            c->mid->FreePayload(desc.buf);
+    }
+
+    std::sort(lat.begin(), lat.end());
+    double sum = 0;
+    for (double l : lat)
+        sum += l;
+
+    fprintf(out, "%s    {\"middleware\": \"%s\", \"op\": \"%s\", \"ops\": %zu, \"mean_us\": %.2f, "
+            "\"lat_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}, \"ok\": %s}",
+            first ? "" : ",\n", name, op_name(op), lat.size(), lat.empty() ? 0 : sum / lat.size(),
+            percentile(lat, 50), percentile(lat, 90), percentile(lat, 99), percentile(lat, 99.9),
+            lat.empty() ? 0 : lat.back(), failed ? "false" : "true");
+    fflush(out);
+    return !failed;
+}
+
+static pid_t start_daemon(std::string sock_path, std::string dir, std::string dcserver_type, durability_mode durability,
+                          const netem_config *netem, record_sign_mode sign_mode) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    DCServer *dcserver = new_dcserver(dcserver_type, dir + "/segments", durability, netem);
+    MidDaemon daemon(sock_path, [&](EC_KEY *client_key) -> DCFSMid * {
+        return new DCFSMidSim(dcserver, client_key, false, dir, sign_mode);
+    }, MID_DAEMON_WORKERS);
+    if (daemon.Listen() < 0)
+        _exit(1);
+    daemon.Serve();
+    _exit(0);
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-n iters] [-s off|each|batch] [-d mem|seg|uring] [-D none|group|each] [-N netem] [-o out.json]\n", prog);
+    printf("    -n    requests per (middleware, operation) point (default: %d)\n", DEFAULT_ITERS);
+    printf("    -s    writer signatures on records, as --record_signing (default: batch)\n");
+    printf("    -d    DC server in memory, or in segment files as dcfs-midd --dcserver=sim|uring (default: mem)\n");
+    printf("    -D    durability of the segment store, as dcfs-midd --durability (default: none)\n");
+    printf("    -N    emulated network in front of the DC server, as dcfs-midd --netem (default: none)\n");
+    printf("    -o    write JSON to file instead of stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    int iters = DEFAULT_ITERS;
+    std::string record_signing = "batch";
+    std::string dcserver_type = "mem";
+    std::string durability = "none";
+    std::string netem;
+    netem_config netem_conf;
+    record_sign_mode sign_mode;
+    durability_mode sync_mode;
+    FILE *out = stdout;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:d:D:N:o:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iters = atoi(optarg);
+                break;
+            case 's':
+                record_signing = optarg;
+                break;
+            case 'd':
+                dcserver_type = optarg;
+                break;
+            case 'D':
+                durability = optarg;
+                break;
+            case 'N':
+                netem = optarg;
+                break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (!out) {
+                    perror("fopen");
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!parse_record_sign_mode(record_signing, &sign_mode) || !parse_durability_mode(durability, &sync_mode)
+            || (netem.size() > 0 && !parse_netem_config(netem, &netem_conf))
+            || (dcserver_type != "mem" && dcserver_type != "seg" && dcserver_type != "uring")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string dir = "/tmp/dcfs-midbench-" + std::to_string(getpid());
+    std::string sock_path = dir + ".sock";
+
+    const netem_config *netem_p = netem.size() > 0 ? &netem_conf : NULL;
+    pid_t daemon_pid = start_daemon(sock_path, dir + "/ipc", dcserver_type, sync_mode, netem_p, sign_mode);
+    EC_KEY *key;
+    Util::generate_ECDSA_key(&key);
+
+    bench_client inproc = { new DCFSMidSim(new_dcserver(dcserver_type, dir + "/inproc/segments", sync_mode, netem_p), key, false, dir + "/inproc", sign_mode), key, "" };
+    bench_client ipc = { NULL, key, "" };
+    for (int i = 0; i < 100 && !ipc.mid; i++) { // wait for the daemon to listen
+        DCFSMidIPC *mid = new DCFSMidIPC(sock_path, key);
+        if (mid->Connected()) {
+            ipc.mid = mid;
+        } else {
+            delete mid;
+            usleep(10000);
+        }
+    }
+
+    bool ok = ipc.mid && inproc.open() && ipc.open();
+    fprintf(out, "{\n  \"benchmark\": \"midbench\",\n  \"block_size\": %d,\n  \"record_signing\": \"%s\",\n  \"dcserver\": \"%s\",\n  \"durability\": \"%s\",\n  \"netem\": \"%s\",\n  \"results\": [\n",
+            BENCH_BLOCK_SIZE, record_signing.c_str(), dcserver_type.c_str(), durability.c_str(), netem.c_str());
+    bool first = true;
+    for (bench_op op : {OP_GET_INODE_NAME, OP_MODIFY_1, OP_MODIFY_16}) {
+        if (!ok)
+            break;
+        ok &= run_point(out, first, "inproc", &inproc, op, iters);
+        ok &= run_point(out, false, "ipc", &ipc, op, iters);
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    delete ipc.mid;
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    std::string cmd = "rm -rf " + dir + " " + sock_path;
+    if (system(cmd.c_str()) != 0)
+        ok = false;
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+// middleware index restart test
+// Writes MidIndex updates, then reopens the index from disk as a restarted middleware does and checks that
+// committed heads survive, that a prepared update is committed or aborted by what the DC server answers,
+// that one the DC server cannot answer for stays pending until Resolve gets an answer, and that a
+// compacted snapshot and a log with a torn tail load back.
+
+#include "../src/fs/mid_index.hpp"
+
+// C++ headers
+#include <string>
+
+// C headers
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define CHECK(cond, msg) do { if (!(cond)) { printf("%s\n", msg); return false; } } while (0)
+
+static std::string name(char c) {
+    return std::string(HASHLEN_IN_BYTES, c);
+}
+
+static err_t dc_answer = NO_ERR; // what the DC server says about a pending inode record
+
+/* a restarted middleware: load the snapshot and log, then resolve pending updates against the DC server */
+static MidIndex *reopen(MidIndex *index, std::string dir) {
+    delete index;
+    index = new MidIndex(dir);
+    if (index->Load() < 0) {
+        delete index;
+        return NULL;
+    }
+    index->Recover([](const std::string &, const std::string &) { return dc_answer; });
+    return index;
+}
+
+static bool head_is(MidIndex *index, std::string dcname, std::string expected) {
+    std::string recordname;
+    return index->Find(dcname, &recordname) && recordname == expected;
+}
+
+static bool run(std::string dir) {
+    std::string a = name('a'), b = name('b');
+    MidIndex *index = reopen(NULL, dir);
+    CHECK(index, "cannot open an empty index");
+
+    // committed updates survive a restart
+    CHECK(index->Create(a) == NO_ERR && index->Create(b) == NO_ERR, "Create failed");
+    CHECK(index->Prepare(a, name('1')) == NO_ERR && index->Commit(a, name('1')) == NO_ERR, "Commit failed");
+    index = reopen(index, dir);
+    CHECK(index && head_is(index, a, name('1')) && head_is(index, b, ""), "committed heads lost on restart");
+
+    // a prepared inode record the DC server holds is committed, one it does not hold is aborted
+    CHECK(index->Prepare(a, name('2')) == NO_ERR, "Prepare failed");
+    dc_answer = NO_ERR;
+    index = reopen(index, dir);
+    CHECK(index && head_is(index, a, name('2')), "prepared record held by the DC server not committed");
+    CHECK(index->Prepare(a, name('3')) == NO_ERR, "Prepare failed");
+    dc_answer = ERR_NOT_FOUND;
+    index = reopen(index, dir);
+    CHECK(index && head_is(index, a, name('2')), "prepared record missing on the DC server not aborted");
+    CHECK(index->Resolve(a) == NO_ERR, "aborted update still pending");
+
+    // an unreachable DC server leaves the update pending, until Resolve gets an answer
+    CHECK(index->Prepare(a, name('4')) == NO_ERR, "Prepare failed");
+    dc_answer = ERR_NO_CONN;
+    index = reopen(index, dir);
+    CHECK(index && head_is(index, a, name('2')), "unanswered update changed the head");
+    CHECK(index->Resolve(a) < 0 && index->Resolve(b) == NO_ERR, "unanswered update not left pending");
+    CHECK(index->Compact() < 0, "compacted over a pending update");
+    dc_answer = NO_ERR;
+    CHECK(index->Resolve(a) == NO_ERR && head_is(index, a, name('4')), "Resolve did not commit once answered");
+    dc_answer = ERR_NO_CONN; // nothing left to ask about
+    index = reopen(index, dir);
+    CHECK(index && head_is(index, a, name('4')) && index->Resolve(a) == NO_ERR, "resolved update lost on restart");
+
+    // a compacted snapshot, then a log with a torn tail, load back
+    CHECK(index->SetRoot(b, name('r')) == NO_ERR && index->Compact() == NO_ERR, "Compact failed");
+    CHECK(index->Prepare(b, name('5')) == NO_ERR && index->Commit(b, name('5')) == NO_ERR, "Commit failed");
+    std::string log_path = dir + "/index.log";
+    struct stat st;
+    CHECK(stat(log_path.c_str(), &st) == 0, "no index log");
+    int fd = open(log_path.c_str(), O_WRONLY | O_APPEND);
+    bool torn = fd >= 0 && write(fd, "torn", 4) == 4;
+    if (fd >= 0)
+        close(fd);
+    CHECK(torn, "cannot tear the index log");
+    index = reopen(index, dir);
+    std::string root_dcname, root_recordname;
+    CHECK(index, "index with a torn log tail does not load");
+    index->GetRoot(&root_dcname, &root_recordname);
+    CHECK(root_dcname == b && root_recordname == name('r'), "root lost in compaction");
+    CHECK(head_is(index, a, name('4')) && head_is(index, b, name('5')), "heads lost in compaction or torn log");
+    struct stat torn_st;
+    CHECK(stat(log_path.c_str(), &torn_st) == 0 && torn_st.st_size == st.st_size, "torn log tail not truncated");
+
+    delete index;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string dir = "/tmp/dcfs-midindextest-" + std::to_string(getpid());
+    bool ok = run(dir);
+    printf("%s\n", ok ? "middleware index test passed" : "middleware index test FAILED");
+
+    std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        ok = false;
+
+    return ok ? 0 : 1;
+}
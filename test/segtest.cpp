@@ -0,0 +1,168 @@
+// segment store recovery test
+// Writes records to DCServerSeg, then reopens the store after damage a crash or an interrupted close leaves
+// behind: a stale hint, a corrupted hint, a hint covering more than the segment holds, and a torn record at
+// the tail of the active segment. Every record acked before the damage must read back, a torn tail must be cut
+// off, and records written after recovery must survive the next reopen.
+
+#include "../src/fs/backend.hpp"
+
+// C++ headers
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+// C headers
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_RECORDS 64
+#define TEST_MAX_RECORD_SIZE 20000
+#define TORN_TAIL_SIZE 100 // a record header and part of its record
+
+#define CHECK(cond, msg) do { if (!(cond)) { printf("%s\n", msg); return false; } } while (0)
+
+static std::string dc = std::string(HASHLEN_IN_BYTES, 'd');
+
+static std::string record_name(int i) {
+    char name[HASHLEN_IN_BYTES + 1];
+    snprintf(name, sizeof(name), "%0*d", HASHLEN_IN_BYTES, i);
+    return std::string(name, HASHLEN_IN_BYTES);
+}
+
+static std::string record_data(int i) {
+    std::string data(1 + (i * 7919) % TEST_MAX_RECORD_SIZE, 0);
+    for (size_t k = 0; k < data.size(); k++)
+        data[k] = (char)(i * 131 + k);
+    return data;
+}
+
+static std::string read_file(std::string path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static bool write_file(std::string path, const std::string &data, bool append) {
+    std::ofstream out(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+    out.write(data.data(), data.size());
+    return out.good();
+}
+
+static uint64_t file_size(std::string path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static bool write_records(DCServer *dcserver, int from, int to) {
+    for (int i = from; i < to; i++) {
+        std::string data = record_data(i);
+        buf_desc_t desc;
+        desc.buf = &data[0];
+        desc.size = data.size();
+        if (dcserver->WriteRecord(dc, record_name(i), &desc) < 0) {
+            printf("cannot write record %d\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* records [0, n) read back, and record n is not there */
+static bool check_records(DCServer *dcserver, int n, const char *when) {
+    std::vector<char> buf(TEST_MAX_RECORD_SIZE);
+    for (int i = 0; i <= n; i++) {
+        buf_desc_t desc;
+        desc.buf = buf.data();
+        desc.size = buf.size();
+        uint64_t read_size = 0;
+        err_t ret = dcserver->ReadRecord(dc, record_name(i), &desc, &read_size);
+        if (i == n) {
+            if (ret != ERR_NOT_FOUND) {
+                printf("%s: record %d read back, it was never acked\n", when, i);
+                return false;
+            }
+            break;
+        }
+        std::string data = record_data(i);
+        if (ret < 0 || read_size != data.size() || memcmp(buf.data(), data.data(), data.size()) != 0) {
+            printf("%s: record %d lost (%d)\n", when, i, ret);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run(std::string dir) {
+    std::string segment = dir + "/segment.00000000", hint = segment + ".hint";
+
+    DCServer *dcserver = new DCServerSeg(dir);
+    buf_desc_t meta;
+    meta.buf = &dc[0];
+    meta.size = dc.size();
+    CHECK(dcserver->WriteRecord(dc, dc, &meta) == NO_ERR, "cannot write the first record");
+    bool ok = write_records(dcserver, 0, TEST_RECORDS);
+    delete dcserver; // writes the hint
+    CHECK(ok && file_size(hint) > 0, "no hint written on close");
+
+    // a stale hint covers a prefix of the segment, the rest is scanned
+    std::string stale = read_file(hint);
+    dcserver = new DCServerSeg(dir);
+    ok = write_records(dcserver, TEST_RECORDS, 2 * TEST_RECORDS);
+    delete dcserver;
+    CHECK(ok && write_file(hint, stale, false), "cannot restore the stale hint");
+    dcserver = new DCServerSeg(dir);
+    ok = check_records(dcserver, 2 * TEST_RECORDS, "stale hint");
+    delete dcserver;
+    CHECK(ok, "stale hint not completed by a scan");
+
+    // a corrupted hint is ignored
+    std::string corrupt = read_file(hint);
+    CHECK(corrupt.size() > 64, "hint too short");
+    corrupt[corrupt.size() - 2 * sizeof(uint64_t)] ^= 1; // the offset of the last record
+    CHECK(write_file(hint, corrupt, false), "cannot corrupt the hint");
+    dcserver = new DCServerSeg(dir);
+    ok = check_records(dcserver, 2 * TEST_RECORDS, "corrupted hint");
+    delete dcserver;
+    CHECK(ok, "corrupted hint not replaced by a scan");
+
+    // a torn record at the tail is cut off, and writes go on from the last whole record
+    uint64_t whole = file_size(segment);
+    std::string head = read_file(segment).substr(0, TORN_TAIL_SIZE);
+    CHECK(write_file(segment, head, true), "cannot tear the segment");
+    dcserver = new DCServerSeg(dir);
+    ok = check_records(dcserver, 2 * TEST_RECORDS, "torn tail");
+    CHECK(ok && file_size(segment) == whole, "torn tail not truncated");
+    ok = write_records(dcserver, 2 * TEST_RECORDS, 2 * TEST_RECORDS + 1);
+    delete dcserver;
+    CHECK(ok, "cannot write after recovery");
+    dcserver = new DCServerSeg(dir);
+    ok = check_records(dcserver, 2 * TEST_RECORDS + 1, "after recovery");
+    delete dcserver;
+    CHECK(ok, "record written after recovery lost");
+
+    // a hint covering more than the segment holds is ignored
+    CHECK(truncate(segment.c_str(), whole) == 0, "cannot truncate the segment");
+    dcserver = new DCServerSeg(dir);
+    ok = check_records(dcserver, 2 * TEST_RECORDS, "hint past the end");
+    delete dcserver;
+    CHECK(ok, "hint past the end of the segment trusted");
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string dir = "/tmp/dcfs-segtest-" + std::to_string(getpid());
+    bool ok = run(dir);
+    printf("%s\n", ok ? "segment test passed" : "segment test FAILED");
+
+    std::string cmd = "rm -rf " + dir;
+    if (system(cmd.c_str()) != 0)
+        ok = false;
+
+    return ok ? 0 : 1;
+}